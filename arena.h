@@ -0,0 +1,163 @@
+/*
+    DEUCHAT ARENA
+    Written by Furkan Kayar
+
+    Arena is used for memory that is needed only while one command or one server
+    response is handled (splitted fields, response strings). Allocations take space
+    from a block, nothing is freed one by one. arena_reset gives all of it back at once
+    and keeps the first block, so handling the next command does not call malloc.
+
+    An arena is not shared between threads. A zero filled arena is a valid empty arena.
+
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define ARENA_BLOCK_SIZE    4096 // Size of a block, larger allocations get their own block.
+#define ARENA_ALIGN         8
+
+
+typedef struct arena_block{ // Memory that allocations are taken from.
+
+    struct arena_block* previous; // Blocks are freed in reverse order.
+    size_t size;
+    size_t used;
+    char data[];
+
+} arena_block;
+
+typedef struct arena{
+
+    arena_block* current; // Block that new allocations are taken from.
+    char* last; // Last allocation, it can be extended in place.
+
+} arena;
+
+
+/*
+    Initializes an empty arena. First block is allocated with the first allocation.
+*/
+static inline void arena_init(arena* a){
+
+    a->current = NULL;
+    a->last = NULL;
+}
+
+/*
+    Returns given number of bytes from arena.
+    Memory stays valid until the arena is reset.
+*/
+static inline void* arena_alloc(arena* a, size_t size){
+
+    size_t start = 0;
+    if(a->current != NULL)
+        start = (a->current->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if(a->current == NULL || start + size > a->current->size){ // Current block is full, a new one is chained.
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block* block = (arena_block*)malloc(sizeof(arena_block) + block_size);
+        block->previous = a->current;
+        block->size = block_size;
+        block->used = 0;
+        a->current = block;
+        start = 0;
+    }
+
+    a->current->used = start + size;
+    a->last = a->current->data + start;
+    return a->last;
+}
+
+/*
+    Copies given string into arena.
+*/
+static inline char* arena_strdup(arena* a, const char* string){
+
+    size_t length = strlen(string);
+    char* copy = (char*)arena_alloc(a, length + 1);
+    memcpy(copy, string, length + 1);
+    return copy;
+}
+
+/*
+    Formats a string into arena like sprintf. Result is never truncated.
+*/
+static inline char* arena_printf(arena* a, const char* format, ...){
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char* string = (char*)arena_alloc(a, length + 1);
+    va_start(args, format);
+    vsnprintf(string, length + 1, format, args);
+    va_end(args);
+    return string;
+}
+
+/*
+    Appends a formatted string to a string in arena and returns the result.
+    The string is extended in place if it is the last allocation and fits into its block,
+    otherwise it is copied. Building a long response piece by piece stays linear.
+*/
+static inline char* arena_append(arena* a, char* string, const char* format, ...){
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    size_t current_length = strlen(string);
+    char* result = string;
+    if(string == a->last && (size_t)(string - a->current->data) + current_length + length + 1 <= a->current->size){
+        a->current->used = (string - a->current->data) + current_length + length + 1;
+    }
+    else{
+        result = (char*)arena_alloc(a, current_length + length + 1);
+        memcpy(result, string, current_length);
+    }
+
+    va_start(args, format);
+    vsnprintf(result + current_length, length + 1, format, args);
+    va_end(args);
+    return result;
+}
+
+/*
+    Gives all allocations back. First block is kept for the next use,
+    blocks that are allocated for large or many allocations are freed.
+*/
+static inline void arena_reset(arena* a){
+
+    while(a->current != NULL && a->current->previous != NULL){
+        arena_block* previous = a->current->previous;
+        free(a->current);
+        a->current = previous;
+    }
+    if(a->current != NULL && a->current->size > ARENA_BLOCK_SIZE){ // A large first block is not kept.
+        free(a->current);
+        a->current = NULL;
+    }
+    if(a->current != NULL)
+        a->current->used = 0;
+    a->last = NULL;
+}
+
+/*
+    Releases all blocks of arena.
+*/
+static inline void arena_free(arena* a){
+
+    arena_reset(a);
+    free(a->current);
+    arena_init(a);
+}
+
+#endif
@@ -0,0 +1,473 @@
+/*
+    DEUCHAT BENCHMARK
+    Written by Furkan Kayar
+
+    Headless load generator for the server. Opens simulated clients, logs them in,
+    spreads them over rooms with -create and -enter and sends -msg traffic at a fixed rate.
+    Every message carries a sequence number. The time between sending a message and
+    the moment the last member of the room (sender included) receives it is measured.
+
+    Usage: bench.o [--host address] [--port port] [--clients n] [--rooms m]
+                   [--rate messages per second] [--duration seconds] [--size bytes]
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "protocol.h"
+
+
+#define SOCKET_CREATE_ERR   1
+#define CONNECTION_ERR      5
+#define SEND_ERR            6
+#define RECV_ERR            7
+#define OPTION_ERR          9
+#define SETUP_ERR           11
+
+#define MAX_EVENTS          256
+#define DRAIN_TIME          2000 // Time (ms) to wait for late deliveries after sending stops.
+#define SETUP_TIMEOUT       10000 // Time (ms) a client waits for an answer while logging in.
+
+
+typedef struct bench_client{ // A simulated client.
+
+    int socket;
+    int room; // Index of room.
+    frame_decoder decoder;
+    char* output; // Frames that could not be written yet.
+    size_t output_length;
+    size_t output_capacity;
+
+} bench_client;
+
+typedef struct bench_message{ // A sent message that is waiting for its deliveries.
+
+    long long sent_ns;
+    int expected; // Members of room when message is sent.
+    int received;
+
+} bench_message;
+
+typedef struct bench_options{ // Options given from command line.
+
+    char* host;
+    int port;
+    int clients;
+    int rooms;
+    int rate; // Messages per second for all clients.
+    int duration; // Seconds.
+    int size; // Bytes of message text.
+
+} bench_options;
+
+
+int parse_options(int, char**);
+int setup_client(int);
+int wait_for_reply(bench_client*, const char*, const char*);
+int send_frame(bench_client*, const char*, size_t);
+int flush_output(bench_client*);
+void read_client(bench_client*);
+void handle_reply(char*);
+void send_next_message(void);
+void report(long long);
+int compare_latency(const void*, const void*);
+long long now_ns(void);
+
+
+bench_options options = {
+    "127.0.0.1", // host
+    3205, // port
+    100, // clients
+    10, // rooms
+    1000, // rate
+    10, // duration
+    32 // size
+};
+
+bench_client* clients = NULL;
+int* room_members = NULL; // Number of clients in every room.
+bench_message* messages = NULL; // Indexed by sequence number.
+int message_capacity = 0;
+int sent_messages = 0;
+int completed_messages = 0;
+long long delivered_frames = 0;
+long long* latencies = NULL; // Delivery time (ns) of completed messages.
+int epoll_fd;
+int next_sender = 0;
+char* message_text = NULL; // Text that follows sequence number in every message.
+char* message_buffer = NULL;
+
+
+int main(int argc, char** argv){
+
+    int i = 0;
+    struct rlimit limit;
+    struct epoll_event events[MAX_EVENTS];
+
+    if(parse_options(argc, argv) != 0)
+        return OPTION_ERR;
+
+    signal(SIGPIPE, SIG_IGN);
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0){ // Every client needs a socket.
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    clients = (bench_client*)calloc(options.clients, sizeof(bench_client));
+    room_members = (int*)calloc(options.rooms, sizeof(int));
+    message_capacity = options.rate * options.duration + 1024;
+    messages = (bench_message*)calloc(message_capacity, sizeof(bench_message));
+    latencies = (long long*)malloc(sizeof(long long) * message_capacity);
+    message_text = (char*)malloc(options.size + 1);
+    memset(message_text, 'x', options.size);
+    message_text[options.size] = '\0';
+    message_buffer = (char*)malloc(options.size + 32);
+
+    epoll_fd = epoll_create1(0);
+    for(i = 0 ; i < options.clients ; i++){
+        int status = setup_client(i);
+        if(status != 0)
+            return status;
+    }
+    printf("%d clients are connected to %d rooms\n", options.clients, options.rooms);
+
+    for(i = 0 ; i < options.clients ; i++){ // Answers are read by event loop from now on.
+        struct epoll_event event;
+        fcntl(clients[i].socket, F_SETFL, fcntl(clients[i].socket, F_GETFL, 0) | O_NONBLOCK);
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].socket, &event);
+    }
+
+    long long interval = 1000000000LL / options.rate;
+    long long start = now_ns();
+    long long send_end = start + (long long)options.duration * 1000000000LL;
+    long long next_send = start;
+    long long end = send_end + (long long)DRAIN_TIME * 1000000;
+
+    while(1){
+
+        long long now = now_ns();
+        while(now < send_end && next_send <= now && sent_messages < message_capacity){ // Sending is not delayed by late sends.
+            send_next_message();
+            next_send += interval;
+        }
+        if(now >= end || (now >= send_end && completed_messages == sent_messages))
+            break;
+
+        long long wait_ns = (now < send_end ? next_send : end) - now;
+        int timeout = wait_ns <= 0 ? 0 : (int)(wait_ns / 1000000);
+        int event_number = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for(i = 0 ; i < event_number ; i++){
+            bench_client* cl = &clients[events[i].data.u32];
+            if(events[i].events & EPOLLOUT)
+                flush_output(cl);
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_client(cl);
+        }
+    }
+
+    report(now_ns() - start);
+
+    for(i = 0 ; i < options.clients ; i++){
+        close(clients[i].socket);
+    }
+    close(epoll_fd);
+
+    return 0;
+}
+
+/*
+    Connects a client, logs it in and puts it into its room.
+    First client of every room creates the room, others enter it.
+    Returns 0 on success.
+*/
+int setup_client(int index){
+
+    bench_client* cl = &clients[index];
+    struct sockaddr_in server;
+    char text[128];
+
+    cl->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if(cl->socket == -1){
+        puts("Could not create socket");
+        return SOCKET_CREATE_ERR;
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(options.host);
+    server.sin_port = htons(options.port);
+    if(connect(cl->socket, (struct sockaddr*)&server, sizeof(server)) < 0){
+        printf("Connection error: %s\n", strerror(errno));
+        return CONNECTION_ERR;
+    }
+    frame_decoder_init(&cl->decoder);
+    int flag = 1;
+    setsockopt(cl->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); // Messages are measured, they should not wait in client.
+    struct timeval timeout = {SETUP_TIMEOUT / 1000, 0};
+    setsockopt(cl->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    snprintf(text, sizeof(text), "bench%d", index);
+    if(send_frame(cl, text, strlen(text)) != 0 || wait_for_reply(cl, "login_success", NULL) != 0)
+        return SETUP_ERR;
+
+    cl->room = index % options.rooms;
+    if(room_members[cl->room] == 0){
+        snprintf(text, sizeof(text), "-create bench%d_%d", getpid(), cl->room);
+        if(send_frame(cl, text, strlen(text)) != 0 || wait_for_reply(cl, "room_created", text) != 0)
+            return SETUP_ERR;
+    }
+    else{
+        snprintf(text, sizeof(text), "-enter bench%d_%d", getpid(), cl->room);
+        if(send_frame(cl, text, strlen(text)) != 0 || wait_for_reply(cl, "room_entered", text) != 0)
+            return SETUP_ERR;
+    }
+    room_members[cl->room] += 1;
+
+    return 0;
+}
+
+/*
+    Reads frames of a client until a frame that starts with expected type arrives.
+    Other frames (welcome text, counters) are skipped. Returns 0 when the frame arrives.
+*/
+int wait_for_reply(bench_client* cl, const char* expected, const char* command){
+
+    char* payload = NULL;
+    size_t length = 0;
+    size_t space = 0;
+    int status = 0;
+
+    while(1){
+        while((status = frame_decoder_next(&cl->decoder, &payload, &length)) == 1){
+            if(strncmp(payload, expected, strlen(expected)) == 0)
+                return 0;
+            if(strncmp(payload, "update_counter", 14) != 0 && strchr(payload, ';') == NULL && command != NULL){ // Server refused the command.
+                printf("Server refused \"%s\": %s\n", command, payload);
+                return SETUP_ERR;
+            }
+        }
+        if(status == FRAME_ERR){
+            puts("Server sent a frame that is too long");
+            return RECV_ERR;
+        }
+        char* place = frame_decoder_space(&cl->decoder, &space);
+        ssize_t bytes = recv(cl->socket, place, space, 0);
+        if(bytes <= 0){
+            printf("Recv failed while waiting for %s\n", expected);
+            return RECV_ERR;
+        }
+        frame_decoder_commit(&cl->decoder, bytes);
+    }
+}
+
+/*
+    Sends a frame. Bytes that cannot be written now are kept in output buffer of client.
+    Returns 0 on success.
+*/
+int send_frame(bench_client* cl, const char* payload, size_t length){
+
+    size_t needed = cl->output_length + FRAME_HEADER_SIZE + length;
+    if(needed > cl->output_capacity){
+        cl->output_capacity = needed * 2;
+        cl->output = (char*)realloc(cl->output, cl->output_capacity);
+    }
+    frame_encode_header(cl->output + cl->output_length, length);
+    memcpy(cl->output + cl->output_length + FRAME_HEADER_SIZE, payload, length);
+    cl->output_length = needed;
+
+    return flush_output(cl);
+}
+
+/*
+    Writes output buffer of client until it is empty or the socket is full.
+    Returns 0 unless the socket is broken.
+*/
+int flush_output(bench_client* cl){
+
+    size_t written = 0;
+    while(written < cl->output_length){
+        ssize_t bytes = send(cl->socket, cl->output + written, cl->output_length - written, MSG_NOSIGNAL);
+        if(bytes < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            puts("Send failed");
+            return SEND_ERR;
+        }
+        written += bytes;
+    }
+    memmove(cl->output, cl->output + written, cl->output_length - written);
+    cl->output_length -= written;
+
+    return 0;
+}
+
+/*
+    Reads all waiting frames of a client.
+*/
+void read_client(bench_client* cl){
+
+    char* payload = NULL;
+    size_t length = 0;
+    size_t space = 0;
+    int status = 0;
+
+    while(1){
+        char* place = frame_decoder_space(&cl->decoder, &space);
+        ssize_t bytes = recv(cl->socket, place, space, MSG_DONTWAIT);
+        if(bytes < 0 && errno == EINTR)
+            continue;
+        if(bytes <= 0)
+            break;
+        frame_decoder_commit(&cl->decoder, bytes);
+        while((status = frame_decoder_next(&cl->decoder, &payload, &length)) == 1){
+            handle_reply(payload);
+        }
+        if(status == FRAME_ERR)
+            break;
+    }
+}
+
+/*
+    Counts a delivered message. Payload format is "new_message;nickname;sequence text".
+*/
+void handle_reply(char* payload){
+
+    if(strncmp(payload, "new_message;", 12) != 0)
+        return;
+    char* text = strchr(payload + 12, ';');
+    if(text == NULL)
+        return;
+
+    int sequence = atoi(text + 1);
+    if(sequence < 0 || sequence >= sent_messages)
+        return;
+    bench_message* message = &messages[sequence];
+    delivered_frames += 1;
+    message->received += 1;
+    if(message->received == message->expected){ // Last member of room received the message.
+        latencies[completed_messages++] = now_ns() - message->sent_ns;
+    }
+}
+
+/*
+    Sends the next message from the next client.
+*/
+void send_next_message(void){
+
+    bench_client* cl = &clients[next_sender];
+    next_sender = (next_sender + 1) % options.clients;
+
+    int length = sprintf(message_buffer, "-msg %d %s", sent_messages, message_text);
+    messages[sent_messages].sent_ns = now_ns();
+    messages[sent_messages].expected = room_members[cl->room];
+    messages[sent_messages].received = 0;
+    sent_messages += 1;
+    send_frame(cl, message_buffer, length);
+}
+
+/*
+    Prints throughput and delivery time percentiles.
+*/
+void report(long long elapsed_ns){
+
+    double seconds = elapsed_ns / 1e9;
+    printf("Sent messages: %d\n", sent_messages);
+    printf("Completed messages: %d (delivered to all members)\n", completed_messages);
+    printf("Delivered frames: %lld\n", delivered_frames);
+    printf("Throughput: %.0f messages/s, %.0f deliveries/s\n", completed_messages / seconds, delivered_frames / seconds);
+
+    if(completed_messages == 0)
+        return;
+    qsort(latencies, completed_messages, sizeof(long long), compare_latency);
+    printf("Delivery to all (ms): p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+        latencies[(int)(completed_messages * 0.50)] / 1e6,
+        latencies[(int)(completed_messages * 0.99)] / 1e6,
+        latencies[(int)(completed_messages * 0.999)] / 1e6,
+        latencies[completed_messages - 1] / 1e6);
+}
+
+/*
+    Orders latencies from the shortest.
+*/
+int compare_latency(const void* first, const void* second){
+
+    long long a = *(const long long*)first;
+    long long b = *(const long long*)second;
+    return a < b ? -1 : a > b;
+}
+
+/*
+    Returns monotonic time in nanoseconds.
+*/
+long long now_ns(void){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Reads benchmark options from command line.
+    Returns 0 if all options are valid.
+*/
+int parse_options(int argc, char** argv){
+
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {"clients", required_argument, 0, 'c'},
+        {"rooms", required_argument, 0, 'r'},
+        {"rate", required_argument, 0, 'R'},
+        {"duration", required_argument, 0, 'd'},
+        {"size", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+    int option = 0;
+
+    while((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        if(option == 'h')
+            options.host = optarg;
+        else if(option == 'p')
+            options.port = atoi(optarg);
+        else if(option == 'c')
+            options.clients = atoi(optarg);
+        else if(option == 'r')
+            options.rooms = atoi(optarg);
+        else if(option == 'R')
+            options.rate = atoi(optarg);
+        else if(option == 'd')
+            options.duration = atoi(optarg);
+        else if(option == 's')
+            options.size = atoi(optarg);
+        else{
+            puts("Usage: bench.o [--host address] [--port port] [--clients n] [--rooms m]\n"
+                 "               [--rate messages per second] [--duration seconds] [--size bytes]");
+            return OPTION_ERR;
+        }
+    }
+
+    if(options.clients <= 0 || options.rooms <= 0 || options.rooms > options.clients || options.rate <= 0 || options.duration <= 0 || options.size < 0){
+        puts("Clients, rooms, rate and duration have to be positive, rooms cannot be more than clients");
+        return OPTION_ERR;
+    }
+
+    return 0;
+}
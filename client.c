@@ -11,8 +11,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include "protocol.h"
+#include "arena.h"
 
 
 #define LOCALHOST           "127.0.0.1"
@@ -24,6 +31,7 @@
 #define CONNECTION_ERR      5
 #define SEND_ERR            6
 #define RECV_ERR            7
+#define OPTION_ERR          8
 
 #define GRAVE               -1
 #define LOBBY               0
@@ -38,387 +46,911 @@
 #define COLOR_MAGENTA       "\x1b[35m"
 #define COLOR_CYAN          "\x1b[36m"
 #define COLOR_RESET         "\x1b[0m"
-
-void* server_handler(void*);
-char** split(char*, char, int*);
+#define screen_rows(w,c)    ((w) == 0 ? 1 : ((w) - 1) / (c) + 1)
+
+#define CONSOLE_LINES       512 // Lines kept in the scrollback ring.
+#define LINE_SIZE           512 // Longer lines are cut.
+#define INPUT_CHUNK         256 // Keys that are read from terminal at once.
+#define MAX_FIELDS          4 // Fields of a server response after its type.
+#define DOWNLOAD_DIR        "deuchat_files" // Received files are saved here.
+#define CONNECT_ATTEMPTS    10 // Busy or unreachable server is tried again this many times.
+#define RETRY_DELAY         250 // Delay (ms) before the second attempt, it doubles after every attempt.
+#define MAX_RETRY_DELAY     8000
+#define BUSY_PREFIX         "server_busy;" // Server does not serve the connection now.
+
+#define RESPONSE(name, fields, handler, text) {name, sizeof(name) - 1, fields, handler, text}
+
+
+typedef struct response_type{ // Server response that client knows.
+
+    const char* name;
+    size_t length; // Length of name.
+    int fields; // Fields after the name, the last one keeps the rest of the payload.
+    void (*handler)(const struct response_type*, char**);
+    const char* text; // Text that is printed by the handler.
+
+} response_type;
+
+
+int connect_server(char**);
+int handle_input(int);
+int handle_key(int, int);
+int handle_server(int);
+void handle_response(char*, size_t);
+void show_lobby(const response_type*, char**);
+void show_room(const response_type*, char**);
+void show_counter(const response_type*, char**);
+void show_message(const response_type*, char**);
+void show_compact_room(const response_type*, char**);
+void show_member(const response_type*, char**);
+void show_left(const response_type*, char**);
+void show_compact_message(const response_type*, char**);
+void set_counter(int);
+void print_message(const char*, int, const char*);
+void show_prompt(const response_type*, char**);
+void show_notice(const response_type*, char**);
+void show_list(const response_type*, char**);
+void show_send_ready(const response_type*, char**);
+void show_send_rejected(const response_type*, char**);
+void show_file(const response_type*, char**);
+void save_file_data(char*, size_t);
+int start_send(int, char*);
+int send_file_chunk(int);
+void restore_terminal(void);
+char** split(arena*, char*, char, int*);
 void draw(void);
-int kbhit(void);
+void console_print(const char*);
+void console_reset(void);
+void clear_input(void);
+int text_width(const char*);
+int read_frame(int, char**);
+int parse_options(int, char**);
 
 
 char buffer[250] = {'\0'}; // Keeps all characters inputted by keyboard.
 int buf_loc = 0;
 char nickname[100] = {'\0'}; // Client's nickname.
+int client_id = -1;
 char client_location = GRAVE; // Client's location.
-
-int msg_ptr_loc = 0;
-int msg_ptr_col = 0;
-char all_console[10000] = {'\0'}; // Keeps all data that is printed to console.
-
-int main(){
+int compact_frames = 0; // Client asks for compact room frames (--compact).
+int room_id = -1; // Room that compact frames are about.
+int own_member = -1; // Member id of client in its room.
+char member_names[MEMBER_IDS][100]; // Nicknames of room members by member id, empty if id is free.
+int member_count = 0;
+
+char lines[CONSOLE_LINES][LINE_SIZE]; // Scrollback ring, line n is kept at n % CONSOLE_LINES.
+int line_count = 0; // Lines that are completed since the program started.
+int first_line = 0; // First line of the screen after the last reset.
+int drawn_lines = 0; // Lines that are already printed to the screen.
+int dirty_line = -1; // Printed line that is changed later (online counter), -1 if there is none.
+char prompt[LINE_SIZE] = {'\0'}; // Line that is not completed yet, input is printed after it.
+int prompt_length = 0;
+int full_redraw = 1; // Screen is cleared and printed again only after a reset.
+int console_changed = 1; // Nothing is printed if console and input are not changed since the last draw.
+int input_rows = 1; // Screen rows that prompt and input took when they were printed.
+frame_decoder decoder; // Separates data coming from server into frames.
+arena input_arena; // Memory of the command that is entered by keyboard.
+struct termios terminal_attributes; // Terminal settings that are restored at exit.
+int terminal_raw = 0;
+int upload_fd = -1; // File that is being sent, -1 if there is none.
+long long upload_remaining = 0;
+int upload_ready = 0; // Server accepted the file, it is sent while the socket is writable.
+int download_fd = -1; // File that is being received, -1 if it could not be created.
+long long download_remaining = 0; // Bytes of the file that are not received yet, 0 if nothing is received.
+char download_path[LINE_SIZE];
+
+const response_type response_types[] = { // Responses that come most often are found first.
+    RESPONSE("m", 2, show_compact_message, NULL),
+    RESPONSE("new_message", 2, show_message, NULL),
+    RESPONSE("update_counter", 1, show_counter, NULL),
+    RESPONSE("member", 2, show_member, NULL),
+    RESPONSE("left", 1, show_left, NULL),
+    RESPONSE("room", 4, show_compact_room, NULL),
+    RESPONSE("login_success", 2, show_lobby, NULL),
+    RESPONSE("room_created", 3, show_room, NULL),
+    RESPONSE("room_entered", 3, show_room, NULL),
+    RESPONSE("list", 1, show_list, "\n "),
+    RESPONSE("set_password", 1, show_prompt, "Choose a password: "),
+    RESPONSE("confirm_password", 1, show_prompt, "Confirm password: "),
+    RESPONSE("request_password", 1, show_prompt, "Enter password: "),
+    RESPONSE("unsuitable_password", 1, show_notice, "\n Choose new password: "),
+    RESPONSE("suitable_password", 1, show_notice, ""),
+    RESPONSE("incorrect_password", 1, show_notice, "\n "),
+    RESPONSE("password_timeout", 1, show_notice, "\n "),
+    RESPONSE("file", 3, show_file, NULL),
+    RESPONSE("send_ready", 1, show_send_ready, NULL),
+    RESPONSE("send_rejected", 1, show_send_rejected, "\n ")
+};
+
+int main(int argc, char** argv){
 
     int socket_desc;
-    int bytes_read = 0;
-    struct sockaddr_in server;
-    char* message;
-    char server_reply[3000];
-    pthread_t server_listener;
+    char message[100] = {'\0'};
+    char line[100] = {'\0'};
+    char* server_reply;
 
+    if(parse_options(argc, argv) != 0)
+        return OPTION_ERR;
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16); // Screen is written once per draw, not once per line.
     clear();
 
-    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    socket_desc = connect_server(&server_reply);
     if(socket_desc == -1){
 
-        puts("Coult not create socket");
-        return SOCKET_CREATE_ERR;
+        puts("Connection error");
+        return CONNECTION_ERR;
+    }
+
+    // Connection established.
+    puts(server_reply);
+
+
+    if(read_frame(socket_desc, &server_reply) <= 0){
+        puts("Recv failed");
+        return RECV_ERR;
+    }
+
+    puts(server_reply);
+    fflush(stdout); // Output is written once per drawn frame, so it is flushed by hand.
+
+    while(sscanf(line, "%99s", message) != 1){ // Get nickname from user, empty lines are skipped.
+        int bytes_read = read(STDIN_FILENO, line, sizeof(line) - 1); // Terminal gives one line at a time.
+        if(bytes_read <= 0)
+            return 0;
+        line[bytes_read] = '\0';
+    }
+    frame_write(socket_desc, message, strlen(message)); // Send nickname to server.
+    if(compact_frames) // Room messages carry member ids instead of nicknames.
+        frame_write(socket_desc, "-compact", strlen("-compact"));
+
+    if(tcgetattr(STDIN_FILENO, &terminal_attributes) == 0){ // Keys are read one by one without echo until the program ends.
+        struct termios raw = terminal_attributes;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        terminal_raw = 1;
+        atexit(restore_terminal);
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = socket_desc;
+    fds[1].events = POLLIN;
+
+    int run = 1;
+
+    while(run > 0){
+
+        fds[1].events = upload_ready ? POLLIN | POLLOUT : POLLIN; // File is sent only while the socket has space.
+        if(poll(fds, 2, -1) < 0){ // Program sleeps until a key is pushed or server sends something.
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)){
+            run = handle_server(socket_desc);
+            if(run <= 0){
+                puts("Recv failed");
+                fflush(stdout);
+                return RECV_ERR;
+            }
+        }
+
+        if(upload_ready && (fds[1].revents & POLLOUT)){
+            run = send_file_chunk(socket_desc);
+            if(run < 0){
+                puts("Send failed");
+                fflush(stdout);
+                return SEND_ERR;
+            }
+        }
+
+        if(fds[0].revents != 0){
+            run = handle_input(socket_desc);
+            if(run < 0){
+                puts("Send failed");
+                fflush(stdout);
+                return SEND_ERR;
+            }
+        }
+
+        draw(); // Keys and responses that arrived together are drawn once.
     }
 
+
+    close(socket_desc);
+
+    return 0;
+}
+
+/*
+    Reads what server sent and handles every frame that is completed by it.
+    Returns 1 if the connection is still open, 0 if it is closed and -1 on error.
+*/
+int handle_server(int socket_desc){
+
+    size_t length = 0;
+    size_t space = 0;
+    char* payload = NULL;
+    int status = 0;
+
+    char* place = frame_decoder_space(&decoder, &space);
+    int bytes_read = recv(socket_desc, place, space, 0);
+    if(bytes_read < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if(bytes_read <= 0)
+        return bytes_read;
+    frame_decoder_commit(&decoder, bytes_read);
+
+    while((status = frame_decoder_next(&decoder, &payload, &length)) == 1) // Frames that are received together are handled one by one.
+        handle_response(payload, length);
+
+    return status < 0 ? -1 : 1;
+}
+
+/*
+    Connects to the server and reads its first frame. Busy or unreachable server is tried again later,
+    delay doubles after every attempt and a random part of it spreads clients that lost connection together.
+    Returns the socket, or -1 if server could not be reached.
+*/
+int connect_server(char** server_reply){
+
+    struct sockaddr_in server;
+    int delay = RETRY_DELAY;
+    int attempt;
+
     server.sin_addr.s_addr = inet_addr(LOCALHOST);
     server.sin_family = AF_INET;
     server.sin_port = htons(PORT);
+    srand(time(NULL) ^ getpid());
+
+    for(attempt = 1; ; attempt++){
+        int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+        if(socket_desc == -1)
+            return -1;
+        int busy = 1;
+        if(connect(socket_desc, (struct sockaddr *)&server, sizeof(server)) == 0){
+            frame_decoder_init(&decoder);
+            if(read_frame(socket_desc, server_reply) > 0 && strncmp(*server_reply, BUSY_PREFIX, strlen(BUSY_PREFIX)) != 0)
+                return socket_desc; // Connection established.
+            frame_decoder_free(&decoder);
+        }
+        else{
+            busy = 0;
+        }
+        close(socket_desc);
+        if(attempt == CONNECT_ATTEMPTS)
+            return -1;
+        int wait = delay / 2 + rand() % (delay / 2 + 1);
+        printf("%s, trying again in %d ms\n", busy ? "Server is busy" : "Server is not reachable", wait);
+        fflush(stdout);
+        usleep(wait * 1000);
+        delay = delay * 2 > MAX_RETRY_DELAY ? MAX_RETRY_DELAY : delay * 2;
+    }
+}
 
-    if(connect(socket_desc, (struct sockaddr *)&server, sizeof(server)) < 0){
+/*
+    Finds the type of a server response in the response table and calls its handler.
+    Fields are separated in place, payload is not copied and nothing is allocated.
+*/
+void handle_response(char* server_reply, size_t length){
 
-        puts("Connection error");
-        return CONNECTION_ERR;
+    char* fields[MAX_FIELDS];
+    int count;
+    size_t name_length = strcspn(server_reply, ";"); // Server responses with special format (ex. $1;$2;$3;$4)
+    const response_type* type = NULL;
+    int i;
+
+    if(length >= FILE_DATA_PREFIX_LENGTH && memcmp(server_reply, FILE_DATA_PREFIX, FILE_DATA_PREFIX_LENGTH) == 0){ // Part of a file, it can contain any byte.
+        save_file_data(server_reply + FILE_DATA_PREFIX_LENGTH, length - FILE_DATA_PREFIX_LENGTH);
+        return;
     }
 
+    if(length > 0 && server_reply[length - 1] == '\n') server_reply[--length] = '\0';
 
-    if((bytes_read = recv(socket_desc, server_reply, 2000, 0)) < 0){
-        puts("Recv failed");
-        return RECV_ERR;
+    for(i = 0; i < sizeof(response_types) / sizeof(response_types[0]); i++){
+        if(response_types[i].length == name_length && memcmp(response_types[i].name, server_reply, name_length) == 0){
+            type = &response_types[i];
+            break;
+        }
     }
 
-    // Connection established.
-    server_reply[bytes_read] = '\0';
-    puts(server_reply);
+    if(type == NULL){ // Plain text is printed as it is.
+        console_print(server_reply);
+        console_print("\n ");
+        clear_input();
+        return;
+    }
 
+    char* rest = server_reply[name_length] == ';' ? server_reply + name_length + 1 : NULL;
+    for(count = 0; count < type->fields; count++){
+        if(rest == NULL){ // Missing fields are empty.
+            fields[count] = "";
+            continue;
+        }
+        fields[count] = rest;
+        if(count < type->fields - 1){ // Last field keeps the rest, its text can contain ';'.
+            char* end = strchr(rest, ';');
+            if(end != NULL) *end = '\0';
+            rest = end == NULL ? NULL : end + 1;
+        }
+    }
 
-    if((bytes_read = recv(socket_desc, server_reply, 2000, 0)) < 0){
-        puts("Recv failed");
-        return RECV_ERR;
+    type->handler(type, fields);
+}
+
+/*
+    Client is in lobby after nickname is accepted.
+*/
+void show_lobby(const response_type* type, char** fields){
+
+    client_id = atoi(fields[0]); //String to int
+    snprintf(nickname, sizeof(nickname), "%s", fields[1]);
+    console_reset();
+    console_print(" Welcome ");
+    console_print(nickname);
+    console_print(" enter your command!\n\n ");
+    client_location = LOBBY;
+}
+
+/*
+    Client is in a room after creating or entering it.
+*/
+void show_room(const response_type* type, char** fields){
+
+    console_reset();
+    console_print(" Welcome to the chat room ");
+    console_print(fields[0]);
+    console_print("!\n Online: ");
+    console_print(fields[1]);
+    console_print("\n Capacity: ");
+    console_print(fields[2]);
+    console_print("\n\n ");
+    clear_input();
+    client_location = ROOM;
+}
+
+/*
+    Online counter line of the room screen is changed in place.
+*/
+void show_counter(const response_type* type, char** fields){
+
+    set_counter(atoi(fields[0]));
+}
+
+/*
+    Changes the online counter line of the room screen.
+*/
+void set_counter(int online){
+
+    int counter_line = first_line + 1; // Room screen starts with name, online and capacity lines.
+    if(client_location == ROOM && counter_line < line_count && line_count - counter_line <= CONSOLE_LINES){
+        snprintf(lines[counter_line % CONSOLE_LINES], LINE_SIZE, " Online: %d", online);
+        dirty_line = counter_line;
+        console_changed = 1;
     }
+}
 
-    server_reply[bytes_read] = '\0';
-    puts(server_reply);
+/*
+    Prints a room message, own messages have another color.
+*/
+void show_message(const response_type* type, char** fields){
 
-    pthread_create(&server_listener, NULL, server_handler, (void*)&socket_desc); // This thread is used to communicate with server while user entering commands.
+    print_message(fields[0], strcmp(fields[0], nickname) == 0, fields[1]);
+}
 
-    scanf("%s", message); // Get nickname from user.
-    send(socket_desc, message, strlen(message), 0); // Send nickname to server.
+/*
+    Prints a compact room message. Nickname of sender is found by its member id.
+*/
+void show_compact_message(const response_type* type, char** fields){
 
+    int member = atoi(fields[0]);
+    if(member < 0 || member >= MEMBER_IDS || member_names[member][0] == '\0'){ // Member frame is lost (ex. dropped by a slow consumer policy).
+        print_message("?", 0, fields[1]);
+        return;
+    }
+    print_message(member_names[member], member == own_member, fields[1]);
+}
 
-   int run = 1;
+/*
+    Prints a message of a member.
+*/
+void print_message(const char* sender, int own, const char* text){
 
-    while(run){
+    console_print(own ? COLOR_GREEN " " : COLOR_CYAN " ");
+    console_print(sender);
+    console_print(":" COLOR_RESET " ");
+    console_print(text);
+    console_print("\n ");
+}
 
-        while(kbhit()){ // kbhit() returns true when a key is pushed.
-            int ch = getchar(); // Read pushed key from buffer.
+/*
+    Client is in a room and reads compact frames. Members of room follow as member frames.
+*/
+void show_compact_room(const response_type* type, char** fields){
+
+    char* room_fields[] = {fields[3], "0", fields[2]}; // Name, online and capacity like room_entered.
+    room_id = atoi(fields[0]);
+    own_member = atoi(fields[1]);
+    memset(member_names, 0, sizeof(member_names));
+    member_count = 0;
+    show_room(type, room_fields);
+}
 
-            if(ch == 10){ // Enter key
-                buffer[buf_loc] = '\0';
-                buf_loc = 0;
+/*
+    A member is in room. Its nickname is kept until its id is given to another member.
+*/
+void show_member(const response_type* type, char** fields){
+
+    int member = atoi(fields[0]);
+    if(member < 0 || member >= MEMBER_IDS)
+        return;
+    if(member_names[member][0] == '\0')
+        member_count += 1;
+    snprintf(member_names[member], sizeof(member_names[member]), "%s", fields[1]);
+    set_counter(member_count);
+}
 
-                if(strcmp(buffer, "") != 0){
+/*
+    A member left room, its id is free.
+*/
+void show_left(const response_type* type, char** fields){
+
+    int member = atoi(fields[0]);
+    if(member < 0 || member >= MEMBER_IDS || member_names[member][0] == '\0')
+        return;
+    member_names[member][0] = '\0';
+    member_count -= 1;
+    set_counter(member_count);
+}
 
-                    int* length = (int*)malloc(sizeof(int));
-                    char** splitted = split(buffer, ' ', length);
-                    if(!((strcmp(splitted[0], "-msg") == 0 || splitted[0][0] != '-') && client_location == ROOM)){
+/*
+    Prints the text of the response type and waits for a password.
+*/
+void show_prompt(const response_type* type, char** fields){
 
-                        strcat(all_console, buffer);
-                        strcat(all_console, "\n ");
-                        msg_ptr_loc += 1;
-                    }
+    console_print(type->text);
+    clear_input();
+}
 
-                    if(send(socket_desc, buffer, strlen(buffer), 0) < 0){ // Send entered command to the server.
+/*
+    Prints the message sent by server, text of the response type follows it.
+*/
+void show_notice(const response_type* type, char** fields){
 
-                        puts("Send failed");
-                        return SEND_ERR;
-                    }
+    console_print(fields[0]);
+    console_print(type->text);
+    clear_input();
+}
 
-                    if(strcmp(buffer, "-exit") == 0){ // Terminate program.
-                        run = 0;
-                        break;
-                    }
+/*
+    Prints room list.
+*/
+void show_list(const response_type* type, char** fields){
 
-                    memset(buffer, 0, sizeof(buffer));
-                    draw();
-                }
-            }
-            else if(ch == 127){ // Backspace key
-                if(buf_loc != 0){
-                    buf_loc -= 1;
-                    buffer[buf_loc] = '\0';
-                    draw();
-                }
-            }
-            else if(ch == 32){ // Space key
-                if(strcmp(buffer, "") != 0){
-                    buffer[buf_loc] = ch;
-                    buffer[buf_loc+1] = '\0';
-                    buf_loc += 1;
-                    draw();
-                }
-            }
-            else{ // Any key
-              buffer[buf_loc] = ch;
-              buffer[buf_loc+1] = '\0';
-              buf_loc += 1;
-              draw();
-            }
+    console_print(fields[0][0] == '\0' ? "There is no active room!" : fields[0]);
+    console_print(type->text);
+    clear_input();
+}
 
-        }
+/*
+    Server accepted the file, it is sent in frames while the socket is writable.
+*/
+void show_send_ready(const response_type* type, char** fields){
+
+    if(upload_fd == -1)
+        return;
+    upload_ready = 1;
+    console_print("Sending ");
+    console_print(fields[0]);
+    console_print("...\n ");
+}
+
+/*
+    Server did not accept the file or could not keep it, nothing more is sent.
+*/
+void show_send_rejected(const response_type* type, char** fields){
+
+    if(upload_fd != -1){
+        close(upload_fd);
+        upload_fd = -1;
     }
+    upload_ready = 0;
+    show_notice(type, fields);
+}
 
+/*
+    Another member shares a file, its data frames follow. File is saved into the download directory.
+*/
+void show_file(const response_type* type, char** fields){
+
+    if(download_fd != -1) // Previous file is not complete, connection lost a part of it.
+        close(download_fd);
+    download_remaining = atoll(fields[2]);
+    mkdir(DOWNLOAD_DIR, 0755);
+    snprintf(download_path, sizeof(download_path), DOWNLOAD_DIR "/%s", fields[1]);
+    download_fd = open(download_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    console_print(COLOR_MAGENTA " ");
+    console_print(fields[0]);
+    console_print(" sends " COLOR_RESET);
+    console_print(fields[1]);
+    console_print(" (");
+    console_print(fields[2]);
+    console_print(" bytes)\n ");
+}
 
-    close(socket_desc);
+/*
+    Writes a received part of file. The file is closed after its last byte.
+*/
+void save_file_data(char* data, size_t length){
 
-    return 0;
+    if(download_remaining <= 0) // File was not announced.
+        return;
+    if(download_fd != -1 && write(download_fd, data, length) != (ssize_t)length){ // Disk is full, rest of the file is ignored.
+        close(download_fd);
+        download_fd = -1;
+    }
+    download_remaining -= length;
+    if(download_remaining > 0)
+        return;
+
+    console_print(download_fd == -1 ? "File could not be saved to " : "File is saved to ");
+    console_print(download_path);
+    console_print("\n ");
+    if(download_fd != -1)
+        close(download_fd);
+    download_fd = -1;
 }
 
 /*
-    Analyzes server responses for sent messages.
+    Opens a file that is entered with -send and asks server to share it with the room.
+    File is sent after server accepts it. Returns 1 to keep running and -1 if the command could not be sent.
 */
-void* server_handler(void* socket){
+int start_send(int socket_desc, char* path){
 
-    char server_reply[3000] = {'\0'};
-    int socket_desc = *((int*)socket);
-    int bytes_read = 0;
-    int client_id = -1;
+    struct stat file_stat;
+    char command[LINE_SIZE];
 
+    while(*path == ' ') path++;
+    if(upload_fd != -1){ // Server takes one file of a client at a time.
+        console_print("Another file is being sent!\n ");
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd == -1 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)){
+        if(fd != -1) close(fd);
+        console_print("File could not be opened!\n ");
+        return 1;
+    }
 
+    char* name = strrchr(path, '/'); // Server gets only the name of file, not where it is.
+    name = name == NULL ? path : name + 1;
+    snprintf(command, sizeof(command), "-send %lld %s", (long long)file_stat.st_size, name);
+    upload_fd = fd;
+    upload_remaining = file_stat.st_size;
+    upload_ready = 0;
 
-    while(1){
+    return frame_write(socket_desc, command, strlen(command)) < 0 ? -1 : 1;
+}
 
-        if((bytes_read = recv(socket_desc, server_reply, 2000, 0)) < 0){
-            puts("Recv failed");
-        }
-        server_reply[bytes_read] = '\0';
-        int* length = (int*)malloc(sizeof(int));
-        char** splitted = split(server_reply, ';', length); // Server responses with special format (ex. $1;$2;$3;$4)
-
-        if(strcmp(splitted[0], "login_success") == 0){
-            client_id = atoi(splitted[1]); //String to int
-            strcpy(nickname, splitted[2]);
-            memset(all_console,0,sizeof(all_console));
-            char msg[250] = {'\0'};
-            sprintf(msg, " Welcome %s enter your command!\n\n ", nickname);
-            strcat(all_console, msg);
-            msg_ptr_loc = 3;
-            msg_ptr_col = 2;
-            client_location = LOBBY;
-            draw();
-        }
-        else if(strcmp(splitted[0], "room_created") == 0){
-            memset(all_console, 0, sizeof(all_console));
-            char msg[250] = {'\0'};
-            sprintf(msg, " Welcome to the chat room %s!\n Online: %s\n Capacity: %s\n\n ", splitted[1], splitted[2], splitted[3]);
-            strcat(all_console, msg);
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_loc = 5;
-            msg_ptr_col = 2;
-            client_location = ROOM;
-            draw();
-        }
-        else if(strcmp(splitted[0], "room_entered") == 0){
-            memset(all_console, 0, sizeof(all_console));
-            char msg[250] = {'\0'};
-            sprintf(msg, " Welcome to the chat room %s!\n Online: %s  \n Capacity: %s\n\n ", splitted[1], splitted[2], splitted[3]);
-            strcat(all_console, msg);
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_loc = 5;
-            msg_ptr_col = 2;
-            client_location = ROOM;
-            draw();
-        }
-        else if(strcmp(splitted[0], "update_counter") == 0){
-            int first_line_end = 0;
-            while(all_console[first_line_end++] != '\n');
-            int capacity = atoi(splitted[1]);
-            all_console[first_line_end + 9] = splitted[1][0];
-            if(capacity >= 10){
-                all_console[first_line_end + 10] = splitted[1][1];
-            }
-            draw();
+/*
+    Sends the next part of file as one frame. File is closed after its last part.
+    Returns 1 to keep running and -1 if the frame could not be sent.
+*/
+int send_file_chunk(int socket_desc){
+
+    char chunk[FILE_DATA_PREFIX_LENGTH + FILE_CHUNK_SIZE];
+    ssize_t bytes = 0;
+
+    memcpy(chunk, FILE_DATA_PREFIX, FILE_DATA_PREFIX_LENGTH);
+    if(upload_remaining > 0)
+        bytes = read(upload_fd, chunk + FILE_DATA_PREFIX_LENGTH, upload_remaining < FILE_CHUNK_SIZE ? upload_remaining : FILE_CHUNK_SIZE);
+    if(bytes <= 0){ // File is sent, or it became shorter than the size that server expects.
+        if(upload_remaining > 0)
+            console_print("File could not be read!\n ");
+        close(upload_fd);
+        upload_fd = -1;
+        upload_ready = 0;
+        return 1;
+    }
+    upload_remaining -= bytes;
 
-        }
-        else if(strcmp(splitted[0], "new_message") == 0){
-            char msg[250] = {'\0'};
-            if(strcmp(splitted[1], nickname) == 0){
-                sprintf(msg, COLOR_GREEN " %s:" COLOR_RESET " %s\n ", splitted[1], splitted[2]);
-            }
-            else{
-                sprintf(msg, COLOR_CYAN " %s:" COLOR_RESET " %s\n ", splitted[1], splitted[2]);
-            }
+    return frame_write(socket_desc, chunk, FILE_DATA_PREFIX_LENGTH + bytes) < 0 ? -1 : 1;
+}
 
-            strcat(all_console, msg);
-            msg_ptr_loc += 1;
-            draw();
-        }
-        else if(strcmp(splitted[0], "set_password") == 0){
-            strcat(all_console, "Choose a password: ");
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_col = 21;
-            draw();
-        }
-        else if(strcmp(splitted[0], "unsuitable_password") == 0){
-            strcat(all_console, splitted[1]);
-            strcat(all_console, "\n Choose new password: ");
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_col = 23;
-            msg_ptr_loc += 1;
-            draw();
-        }
-        else if(strcmp(splitted[0], "suitable_password") == 0){
-            strcat(all_console, splitted[1]);
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_col = 22;
-            draw();
-        }
-        else if(strcmp(splitted[0], "request_password") == 0){
-            strcat(all_console, "Enter password: ");
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_col = 18;
-            draw();
-        }
-        else if(strcmp(splitted[0], "incorrect_password") == 0){
-            strcat(all_console, splitted[1]);
-            strcat(all_console, "\n ");
-            memset(buffer, 0, sizeof(buffer));
-            msg_ptr_col = 2;
-            msg_ptr_loc += 1;
-            draw();
-        }
-        else if(strcmp(splitted[0], "list") == 0){
-
-            if(strcmp(splitted[1], "") == 0){
-                strcat(all_console,"There is no active room!\n ");
-                msg_ptr_loc += 1;
-                msg_ptr_col = 2;
-                memset(buffer, 0, sizeof(buffer));
-                draw();
+/*
+    Handles all keys that are pushed since the last call.
+    Returns 1 to keep running, 0 to exit and -1 if a command could not be sent.
+*/
+int handle_input(int socket_desc){
+
+    char keys[INPUT_CHUNK];
+    int bytes_read = read(STDIN_FILENO, keys, sizeof(keys));
+    if(bytes_read < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if(bytes_read <= 0) // Terminal is closed.
+        return 0;
+
+    int i;
+    int status = 1;
+    for(i = 0; i < bytes_read && status == 1; i++)
+        status = handle_key(socket_desc, keys[i]);
+
+    return status;
+}
+
+/*
+    Adds a pushed key to the input line, Enter sends the line to server.
+    Returns 1 to keep running, 0 after -exit and -1 if the line could not be sent.
+*/
+int handle_key(int socket_desc, int ch){
+
+    console_changed = 1;
+
+    if(ch == 10){ // Enter key
+        buffer[buf_loc] = '\0';
+
+        if(strcmp(buffer, "") != 0){
+
+            int length = 0;
+            char** splitted = split(&input_arena, buffer, ' ', &length);
+            if(!((strcmp(splitted[0], "-msg") == 0 || splitted[0][0] != '-') && client_location == ROOM)){
+
+                console_print(buffer);
+                console_print("\n ");
             }
-            else{
-                strcat(all_console, splitted[1]);
-                strcat(all_console, "\n ");
-                int line_num = 0;
-                int z = 0;
-                for(z = 0 ; z < strlen(splitted[1]) ; z++) if(splitted[1][z] == '\n') line_num += 1;
-                msg_ptr_loc += line_num + 1;
-                msg_ptr_col = 2;
-                memset(buffer, 0, sizeof(buffer));
-                draw();
+
+            if(strcmp(splitted[0], "-send") == 0){ // File is read here, server gets its size and name.
+                int status = start_send(socket_desc, buffer + strlen("-send"));
+                clear_input();
+                arena_reset(&input_arena);
+                return status;
             }
 
-        }
-        else{
+            if(frame_write(socket_desc, buffer, strlen(buffer)) < 0) // Send entered command to the server.
+                return -1;
+
+            int exit = strcmp(buffer, "-exit") == 0; // Terminate program.
 
-            strcat(all_console, server_reply);
-            strcat(all_console, "\n ");
-            int line_num = 0;
-            int z = 0;
-            for(z = 0 ; z < strlen(server_reply) ; z++) if(server_reply[z] == '\n') line_num += 1;
-            msg_ptr_loc += line_num + 1;
-            msg_ptr_col = 2;
-            memset(buffer, 0, sizeof(buffer));
-            draw();
+            clear_input();
+            arena_reset(&input_arena);
+            if(exit)
+                return 0;
+        }
+    }
+    else if(ch == 127){ // Backspace key
+        if(buf_loc != 0){
+            buf_loc -= 1;
+            buffer[buf_loc] = '\0';
         }
+    }
+    else if(buf_loc < sizeof(buffer) - 1 && (ch != 32 || buf_loc != 0)){ // Input does not start with space.
+        buffer[buf_loc] = ch;
+        buffer[buf_loc+1] = '\0';
+        buf_loc += 1;
+    }
+
+    return 1;
+}
 
+/*
+    Reads the next frame from server. Frames that are received together are returned one by one.
+    Returns 1 if a frame is read, 0 if the connection is closed and FRAME_ERR on error.
+*/
+int read_frame(int socket_desc, char** payload){
+
+    size_t length = 0;
+    size_t space = 0;
+    int status = 0;
+
+    while((status = frame_decoder_next(&decoder, payload, &length)) == 0){
+        char* place = frame_decoder_space(&decoder, &space);
+        int bytes_read = recv(socket_desc, place, space, 0);
+        if(bytes_read <= 0)
+            return bytes_read;
+        frame_decoder_commit(&decoder, bytes_read);
     }
+
+    return status;
 }
 
 /*
     Spliting given string with given delimiter and inserts the array size in length pointer.
+    Parts are allocated from given arena, they are released when the arena is reset.
 */
-char** split(char* string, char delimiter, int* length){
+char** split(arena* a, char* string, char delimiter, int* length){
 
     int i;
     int delimiter_cnt = 0;
     int str_cnt = 0;
     char **str_arr;
+    size_t string_length = strlen(string);
 
-    for(i=0;i<strlen(string);i++)
+    for(i=0;i<string_length;i++)
         if(string[i] == delimiter)
             delimiter_cnt++;
 
-    if(string[strlen(string) - 1] == '\n') string[strlen(string) - 1] = '\0';
+    if(string_length > 0 && string[string_length - 1] == '\n') string[--string_length] = '\0';
 
-    str_arr = (char**)malloc(sizeof(char*) * (delimiter_cnt + 1));
+    str_arr = (char**)arena_alloc(a, sizeof(char*) * (delimiter_cnt + 1));
 
     *length = delimiter_cnt + 1;
 
+    char* start = string;
+    while(str_cnt < *length){
+        char* end = strchr(start, delimiter);
+        size_t part_length = end == NULL ? strlen(start) : (size_t)(end - start);
+        char* tmp = (char*)arena_alloc(a, part_length + 1);
+        memcpy(tmp, start, part_length);
+        tmp[part_length] = '\0';
+        str_arr[str_cnt++] = tmp;
+        start += part_length + 1;
+    }
 
-    for(i=0;i<strlen(string);){
+    return str_arr;
+}
 
-        if(i==0 || string[i] == delimiter){
-            char *tmp = (char*)malloc(sizeof(char) * 500);
-            int k=0;
-            if(i != 0) i++;
-            while(string[i] != delimiter && i < strlen(string)){
-                tmp[k++] = string[i++];
-            }
-            tmp[k] = '\0';
-            str_arr[str_cnt++] = tmp;
+/*
+    Appends text to the console. Every new line character completes the prompt line and
+    moves it into the scrollback ring, the text after the last one becomes the new prompt.
+*/
+void console_print(const char* text){
+
+    console_changed = 1;
+    for(; *text != '\0'; text++){
+        if(*text == '\n'){
+            memcpy(lines[line_count % CONSOLE_LINES], prompt, prompt_length + 1);
+            line_count += 1;
+            prompt_length = 0;
+        }
+        else if(prompt_length < LINE_SIZE - 1){
+            prompt[prompt_length++] = *text;
+        }
+        prompt[prompt_length] = '\0';
+    }
+}
+
+/*
+    Starts a new screen (lobby or room). It is printed from the top when it is drawn.
+*/
+void console_reset(void){
+
+    first_line = line_count;
+    prompt_length = 0;
+    prompt[0] = '\0';
+    dirty_line = -1;
+    full_redraw = 1;
+    console_changed = 1;
+}
+
+/*
+    Empties the line that is being typed.
+*/
+void clear_input(void){
+
+    memset(buffer, 0, sizeof(buffer));
+    buf_loc = 0;
+    console_changed = 1;
+}
 
+/*
+    Returns how many characters of given text are visible on the screen, color codes take no space.
+*/
+int text_width(const char* text){
+
+    int width = 0;
+    while(*text != '\0'){
+        if(*text == '\033'){ // Escape sequence ends with a letter.
+            while(*text != '\0' && !((*text >= 'A' && *text <= 'Z') || (*text >= 'a' && *text <= 'z'))) text++;
+        }
+        else if((*text & 0xC0) != 0x80){ // Continuation bytes of a UTF-8 character take no space.
+            width += 1;
         }
+        if(*text != '\0') text++;
     }
 
-    return str_arr;
+    return width;
 }
 
 /*
-    Prints data to console.
+    Prints what is changed since the last call. Screen is cleared only after a reset, otherwise
+    new lines are printed over the input line, a changed line is rewritten in place and
+    the input line is printed again. Output is flushed once, so terminal gets one write.
 */
 void draw(void){
 
-    clear();
-    printf("%s", all_console);
-
-    gotoxy(msg_ptr_col, msg_ptr_loc);
-    if(buffer[0] == '-'){
-        int* length = (int*)malloc(sizeof(int));
-        char** splitted_buf = split(buffer, ' ', length);
-        printf(COLOR_YELLOW "%s" COLOR_RESET, splitted_buf[0]);
-        int i = 1;
-        for(i = 1 ; i < *length ; i++){
-            printf(" %s", splitted_buf[i]);
+    if(!console_changed)
+        return;
+    console_changed = 0;
+
+    struct winsize size;
+    int columns = 80;
+    int rows = 24;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0){
+        columns = size.ws_col;
+        rows = size.ws_row;
+    }
+
+    if(line_count - first_line > CONSOLE_LINES) first_line = line_count - CONSOLE_LINES; // Older lines are overwritten in the ring.
+
+    if(full_redraw){
+        clear();
+        drawn_lines = first_line;
+        dirty_line = -1;
+        full_redraw = 0;
+    }
+    else{
+        if(input_rows > 1) printf("\033[%dA", input_rows - 1); // Cursor goes to the first row of the input line.
+        printf("\r");
+
+        if(dirty_line >= first_line && dirty_line < drawn_lines){
+            int up = 0;
+            int i;
+            for(i = dirty_line; i < drawn_lines && up < rows; i++) up += screen_rows(text_width(lines[i % CONSOLE_LINES]), columns);
+            if(up < rows - input_rows){ // Line is still on the screen.
+                printf("\033[%dA\033[2K%s\r\033[%dB", up, lines[dirty_line % CONSOLE_LINES], up);
+            }
         }
+        dirty_line = -1;
+        printf("\033[J"); // Input line is cleared, new lines are printed over it.
+    }
+
+    if(line_count - drawn_lines > CONSOLE_LINES) drawn_lines = line_count - CONSOLE_LINES;
+    for(; drawn_lines < line_count; drawn_lines++){
+        printf("%s\n", lines[drawn_lines % CONSOLE_LINES]);
+    }
+
+    printf("%s", prompt);
+    if(buffer[0] == '-'){ // Command name is colored, nothing is allocated for it.
+        int command_length = strcspn(buffer, " ");
+        printf(COLOR_YELLOW "%.*s" COLOR_RESET "%s", command_length, buffer, buffer + command_length);
     }
     else{
         printf("%s", buffer);
     }
+    input_rows = screen_rows(text_width(prompt) + text_width(buffer), columns);
 
-
+    fflush(stdout);
 }
 
 /*
-    This function exists in conio.h library that is not available in linux.
-    It is used to get input character by character from user without blocking the program flow.
-    Reference of this function: https://cboard.cprogramming.com/c-programming/63166-kbhit-linux.html
+    Terminal is given back in the state it was found.
 */
-int kbhit(void){
-
-  struct termios oldt, newt;
-  int ch;
-  int oldf;
+void restore_terminal(void){
 
-  tcgetattr(STDIN_FILENO, &oldt);
-  newt = oldt;
-  newt.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-  oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-  fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    if(terminal_raw){
+        printf("\n");
+        fflush(stdout);
+        tcsetattr(STDIN_FILENO, TCSANOW, &terminal_attributes);
+        terminal_raw = 0;
+    }
+}
 
-  ch = getchar();
+/*
+    Reads client options from command line.
+    Returns 0 if all options are valid.
+*/
+int parse_options(int argc, char** argv){
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-  fcntl(STDIN_FILENO, F_SETFL, oldf);
+    static struct option long_options[] = {
+        {"compact", no_argument, 0, 'c'},
+        {0, 0, 0, 0}
+    };
+    int option = 0;
 
-  if(ch != EOF){
-    ungetc(ch, stdin);
-    return 1;
-  }
+    while((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        if(option == 'c')
+            compact_frames = 1;
+        else{
+            puts("Usage: client.o [--compact]");
+            return OPTION_ERR;
+        }
+    }
 
-  return 0;
+    return 0;
 }
-
-
@@ -0,0 +1,217 @@
+/*
+    DEUCHAT PROTOCOL
+    Written by Furkan Kayar
+
+    Every message between client and server is sent as a frame.
+    A frame starts with 4 bytes payload length in network byte order
+    and continues with the payload itself.
+
+        +----------------+------------------------------+
+        | length (4 byte)| payload (length byte)        |
+        +----------------+------------------------------+
+
+    Payloads keep the old text formats (ex. "new_message;nickname;text").
+    Frames that arrive together or in pieces are separated by frame_decoder.
+    Files are sent as "file_data;" followed by raw bytes, so their payload is not text.
+    Clients that ask for compact frames get room messages as "m;member id;text",
+    member ids are announced once per room session and are smaller than MEMBER_IDS.
+
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_SIZE   4
+#define MAX_FRAME_SIZE      65536 // Payload of a frame cannot be longer than this.
+#define FRAME_BUFFER_SIZE   4096 // Initial buffer size of a decoder.
+#define FRAME_ERR           -1
+#define FILE_DATA_PREFIX    "file_data;" // Payload of a file frame starts with it.
+#define FILE_DATA_PREFIX_LENGTH 10
+#define FILE_CHUNK_SIZE     16384 // File bytes in one frame.
+#define MEMBER_IDS          32 // Member ids of a room are smaller than this.
+
+
+typedef struct frame_decoder{ // Collects received bytes and separates them into frames.
+
+    char* buffer;
+    size_t capacity;
+    size_t start; // First byte that is not decoded yet.
+    size_t end; // End of received bytes.
+    char* terminated; // Byte that is replaced with '\0' after the last returned payload.
+    char saved; // Original value of terminated byte.
+
+} frame_decoder;
+
+
+/*
+    Initializes an empty decoder. Buffer is allocated when the first data arrives.
+*/
+static inline void frame_decoder_init(frame_decoder* decoder){
+
+    decoder->buffer = NULL;
+    decoder->capacity = 0;
+    decoder->start = 0;
+    decoder->end = 0;
+    decoder->terminated = NULL;
+    decoder->saved = '\0';
+}
+
+/*
+    Releases buffer of decoder.
+*/
+static inline void frame_decoder_free(frame_decoder* decoder){
+
+    free(decoder->buffer);
+    frame_decoder_init(decoder);
+}
+
+/*
+    Puts back the byte that is used to terminate last returned payload.
+*/
+static inline void frame_decoder_restore(frame_decoder* decoder){
+
+    if(decoder->terminated != NULL){
+        *(decoder->terminated) = decoder->saved;
+        decoder->terminated = NULL;
+    }
+}
+
+/*
+    Returns the place where received bytes should be written and its size in space pointer.
+    Buffer is compacted or grown if the next frame does not fit into it.
+    Payloads returned before are not valid anymore after this call.
+*/
+static inline char* frame_decoder_space(frame_decoder* decoder, size_t* space){
+
+    size_t needed = FRAME_BUFFER_SIZE;
+    size_t waiting = decoder->end - decoder->start;
+
+    frame_decoder_restore(decoder);
+
+    if(waiting >= FRAME_HEADER_SIZE){ // Size of the next frame is known.
+        uint32_t length = 0;
+        memcpy(&length, decoder->buffer + decoder->start, FRAME_HEADER_SIZE);
+        length = ntohl(length);
+        if(length <= MAX_FRAME_SIZE && length + FRAME_HEADER_SIZE > needed)
+            needed = length + FRAME_HEADER_SIZE;
+    }
+    if(needed <= waiting) // Complete frames are waiting, there should still be room for new bytes.
+        needed = waiting + FRAME_BUFFER_SIZE;
+
+    if(decoder->start > 0 && decoder->capacity - decoder->end < needed - waiting){ // Moving waiting bytes to the beginning of buffer.
+        memmove(decoder->buffer, decoder->buffer + decoder->start, waiting);
+        decoder->start = 0;
+        decoder->end = waiting;
+    }
+
+    if(decoder->capacity < needed){
+        decoder->buffer = (char*)realloc(decoder->buffer, sizeof(char) * (needed + 1)); // One more byte to terminate the last payload.
+        decoder->capacity = needed;
+    }
+
+    *space = decoder->capacity - decoder->end;
+    return decoder->buffer + decoder->end;
+}
+
+/*
+    Marks given number of bytes as received after they are written into space.
+*/
+static inline void frame_decoder_commit(frame_decoder* decoder, size_t bytes){
+
+    decoder->end += bytes;
+}
+
+/*
+    Takes the next complete frame from decoder.
+    Payload is terminated with '\0' in place and stays valid until the next call.
+    Returns 1 if a frame is found, 0 if more bytes are needed and FRAME_ERR if the frame is too long.
+*/
+static inline int frame_decoder_next(frame_decoder* decoder, char** payload, size_t* length){
+
+    uint32_t frame_length = 0;
+
+    frame_decoder_restore(decoder);
+
+    if(decoder->end - decoder->start < FRAME_HEADER_SIZE)
+        return 0;
+
+    memcpy(&frame_length, decoder->buffer + decoder->start, FRAME_HEADER_SIZE);
+    frame_length = ntohl(frame_length);
+    if(frame_length > MAX_FRAME_SIZE)
+        return FRAME_ERR;
+
+    if(decoder->end - decoder->start < FRAME_HEADER_SIZE + frame_length)
+        return 0;
+
+    *payload = decoder->buffer + decoder->start + FRAME_HEADER_SIZE;
+    *length = frame_length;
+    decoder->terminated = *payload + frame_length;
+    decoder->saved = *(decoder->terminated);
+    *(decoder->terminated) = '\0';
+    decoder->start += FRAME_HEADER_SIZE + frame_length;
+
+    if(decoder->start == decoder->end){ // Everything is decoded, buffer can be used from the beginning.
+        decoder->start = 0;
+        decoder->end = 0;
+    }
+
+    return 1;
+}
+
+/*
+    Writes frame header for a payload with given length.
+*/
+static inline void frame_encode_header(char* header, size_t length){
+
+    uint32_t frame_length = htonl((uint32_t)length);
+    memcpy(header, &frame_length, FRAME_HEADER_SIZE);
+}
+
+/*
+    Sends given payload as one frame on a blocking socket.
+    Returns 0 on success and FRAME_ERR if the socket is broken.
+*/
+static inline int frame_write(int fd, const char* payload, size_t length){
+
+    char header[FRAME_HEADER_SIZE];
+    struct iovec parts[2];
+    int part = 0;
+
+    if(length > MAX_FRAME_SIZE)
+        length = MAX_FRAME_SIZE;
+
+    frame_encode_header(header, length);
+    parts[0].iov_base = header;
+    parts[0].iov_len = FRAME_HEADER_SIZE;
+    parts[1].iov_base = (void*)payload;
+    parts[1].iov_len = length;
+
+    while(part < 2){
+        ssize_t written = writev(fd, parts + part, 2 - part);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            return FRAME_ERR;
+        }
+        while(part < 2 && (size_t)written >= parts[part].iov_len){ // Skipping parts that are written completely.
+            written -= parts[part].iov_len;
+            part += 1;
+        }
+        if(part < 2){
+            parts[part].iov_base = (char*)parts[part].iov_base + written;
+            parts[part].iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+#endif
@@ -3,9 +3,8 @@
     Written by Furkan Kayar
 
     -ASSUMPTIONS
-        Total number of clients (alive + disconnected) can be 100 at maximum.
-        Total number of rooms (active + inactive) can be 100 at maximum.
-        Total number of clients entered into a room can be 100 at maximum.
+        Total number of connected clients can be 1048576 at maximum.
+        Total number of active rooms can be 1048576 at maximum.
         Total number of clients in a room at the same time can be 30 at maximum.
         If the last client in a room quits, room is closed.
         When clients create a room, they enter into room automatically.
@@ -15,17 +14,218 @@
         User nicknames are not unique.
         Room names are unique.
         Server listens on 3205 port. So, port 3205 has to be free on the system.
+        Rooms recovered from the journal stay open until a client enters and the last client quits.
+
+    -EVENT LOOP
+        Server runs one shard per core (--shards). A shard is a thread with its own
+        edge-triggered epoll instance and its own server socket on the same port
+        (SO_REUSEPORT), so the kernel spreads new connections over shards.
+        Shards never wait for client input, so commands that need more input from
+        the client (nickname, passwords) are handled as client states.
+        A client that is asked for a password has to answer in password timeout.
+        Clients waiting for a password are kept in a list of their shard with their deadlines,
+        a timer registered to the epoll instance of shard makes it check the list periodically.
+        Input is separated into frames (protocol.h), so every frame is one command
+        even if several commands are received with one read.
+        End of connection and socket errors are learned from reads and epoll events
+        (EPOLLRDHUP, EPOLLHUP, EPOLLERR). The client is removed from its room once at
+        that moment, so rooms only contain live clients and broadcasts never check sockets.
+        With --io-backend uring a shard waits on io_uring instead of epoll (Linux 6.0, raw
+        syscalls, no library). Server socket, eventfd and timer are armed once with multishot
+        accept and poll, every client with a multishot recv into a ring of provided buffers.
+        Sendmsg of all clients that are flushed in a loop are submitted with the next wait, so a
+        fan-out costs one system call. A shard that cannot create io_uring uses epoll.
+
+    -ADMISSION CONTROL
+        Server sockets listen with a large backlog (--backlog), so a reconnect storm waits in the kernel
+        instead of being refused. A shard accepts all waiting connections with non-blocking accept4
+        and only queues the welcome frames, it never waits for a client on the accept path.
+        A connection over --max-connections (all shards) or over --connection-rate (a token bucket
+        per shard that holds one second of connections) gets server_busy and is closed before anything
+        is allocated for it. Client tries again after a random delay that doubles every time, so clients
+        that lost connection together come back spread over the rate.
+
+    -SHARDS
+        A client belongs to the shard that accepted it. A room belongs to the shard that
+        its name hashes to. Only the owner shard reads or changes a client or a room, so
+        there are no locks on the way of a command. Shards ask each other with messages:
+            -create, -pcreate, -enter: Client shard asks room shard, room shard answers.
+            -msg: Client shard encodes the frame, room shard gives it to the shards of members.
+            -quit: Client shard tells room shard.
+            -list: Client shard reads room directories of all shards, no message is sent.
+        Every shard has an inbox (lock-free list, many writers, one reader). Writer that puts
+        a message into an empty inbox wakes the shard with an eventfd. Messages from one shard
+        to another are handled in the order they are sent.
+        While a client waits for an answer from another shard, its next commands stay in its
+        decoder, so commands of a client are still executed in order.
+
+    -BROADCAST
+        A message for a room is encoded once into a shared_frame. The same frame is
+        written to every client in the room, it is never formatted or copied per client.
+        Room shard sends one message with the frame to every shard that has members in room.
+
+    -COMPACT FRAMES
+        A client that sends -compact in lobby reads compact room frames. Room shard gives every
+        member a small id that is reused after the member leaves and announces it once per room
+        session: room;room id;own member id;capacity;name, then member;member id;nickname for every
+        member. Joins and leaves are member and left;member id frames instead of online counters.
+        A message is m;member id;text, so its frame does not carry the nickname and the client
+        finds the nickname by id. Room shard encodes the compact frame once from the normal one
+        and only if the room has compact members. History is sent in normal frames.
+
+    -OUTBOUND QUEUES
+        Client sockets are non-blocking and have TCP_NODELAY, the server decides when bytes
+        are sent. A frame is queued and the client is put into the flush list of its shard.
+        At the end of a loop the shard writes every due queue with one sendmsg (writev), so
+        a burst of messages for a client in one loop is one write and one segment. Room
+        messages can wait for a flush window (--flush-window) to collect more frames, answers
+        are written at the end of the loop, and a queue over the flush threshold (--flush-bytes)
+        is written immediately. More frames than one call takes are written corked (TCP_CORK).
+        If the socket is full, the queue is written when epoll reports that it is writable.
+        A client whose queue stays over the high watermark
+        longer than the slow consumer timeout is handled by the slow consumer policy:
+            drop: New room messages are dropped until the queue is below the low watermark.
+            coalesce: Oldest waiting room messages are dropped to make room for the new ones.
+            disconnect: Client is disconnected.
+
+    -FILE SHARING
+        -send uploads a file to the room of client. The upload is written once into a spool file
+        (--spool-dir) as the frames that members receive: an announcement (file;sender;name;size)
+        and data frames (file_data;bytes) of the same size. The spool file is unlinked at once and
+        closed when the last member has it, a room shard only passes a reference to it.
+        Members get the file with sendfile from page cache to socket, the shard does not read it.
+        Frames are written into the spool file by the spool writer thread, shards only queue them,
+        so a slow disk does not stop a shard. Spool writer tells the shard of the sender when the file
+        is complete or cannot be written. Input of a sender that has more than SPOOL_PENDING_LIMIT
+        frames waiting for the disk is not read until the writer catches up (with io_uring the
+        multishot recv still fills its decoder). Only creating the spool file (mkstemp, unlink)
+        is done by the shard.
+        Data frames are uploaded only between -send and the last byte of the file, a message that
+        starts with "file_data;" at another time is a normal message.
+        A file is written one frame at a time and only when no frame of the client waits, so
+        messages never wait behind a file. With io_uring files are written the same way and
+        a one shot poll reports when a full socket is writable.
+
+    -SLOT TABLES
+        Clients and rooms are stored in slot tables. A table grows by chunks that are
+        never moved, so pointers to slots stay valid. Slots of disconnected clients and
+        closed rooms are put into a free list and used again, so memory follows the
+        number of live clients and rooms instead of all clients since the server started.
+        An id contains slot number and a generation that changes every time the slot is
+        released. An old id (ex. in an epoll event or in a room) does not find the new owner of its slot.
+        Every shard has its own tables. Slot numbers of a shard are shard, shard + shards,
+        shard + 2 * shards ..., so the shard of a client or room is known from its id.
+
+    -REQUEST ARENA
+        Splitted commands and response strings are allocated from an arena of the
+        shard thread (arena.h). The arena is reset after every command, so commands
+        do not call malloc and shards do not share the allocator.
+
+    -LOGGING
+        Commands do not write logs themselves. Every thread copies its records into its own
+        ring (one writer, one reader, no lock) and a log writer thread moves them into the log
+        file as key=value lines. Records under the log level are not copied at all. If a ring
+        is full, the record is dropped and the number of dropped records is logged later.
+
+    -METRICS
+        Every shard updates its own counters and histograms. Admin thread sums them and serves
+        them on a Unix socket and optionally on a loopback port in Prometheus text format.
+            socat - UNIX-CONNECT:deuchat-admin.sock
+            curl http://127.0.0.1:<admin port>/metrics
+
+    -ROOM DIRECTORY
+        Every shard publishes a directory of its rooms: listings sorted by room name in chunks of
+        at most DIRECTORY_CHUNK listings, and an array of the chunks. Directories, chunks and
+        listings are never changed after they are published. A shard that changes a room publishes
+        a new listing (members changed) or a copy of one chunk and of the chunk array (room created
+        or closed, full chunks are split and small ones are merged), so -list reads directories of
+        all shards without locks and without asking them, and a change does not copy all rooms.
+        Replaced memory is freed after every shard passed the end of its loop or was sleeping in
+        epoll (quiescent state based reclamation), because no shard keeps a directory between loops.
+        -list [page] [prefix] merges the rooms that start with prefix from sorted directories and
+        shows one page. A client remembers the last room it was shown, the next page with the same
+        prefix continues the merge after that room, so paging does not merge the earlier pages again.
+
+    -HISTORY
+        Every room keeps its last messages in a ring (--history, -history). The ring holds
+        the frames that are already encoded for broadcast, so adding a message only takes a
+        reference to its frame and does not allocate. Ring is allocated when the room is created
+        or its size is changed. A client that enters the room gets room_entered and the messages
+        in history in one buffer, so they are written together. Only the newest messages that
+        fit under the high watermark are sent.
+
+    -JOURNAL
+        If a data directory is given (--data-dir), every shard appends room events (create,
+        history size, message, close) to its own journal. A journal is a list of memory mapped
+        segment files, a shard only copies records into the mapped segment and never waits for
+        the disk. Journal syncer thread writes appended records of all shards to disk every sync
+        interval (group commit), so a crash loses at most the last sync interval. Syncer also
+        keeps the current segment of every shard allocated on disk JOURNAL_RESERVE_STEP ahead of
+        its records and opens the next segment of every shard before it is needed, so idle shards
+        do not take disk space for whole segments and a shard does not allocate or open files
+        while it appends (it does only if syncer is behind). Messages of rooms that keep no history
+        are not journaled. After JOURNAL_COMPACT_SEGMENTS segments (and at least twice the size of
+        its last snapshot) a shard starts a new segment with a snapshot of its rooms and their
+        history, syncer removes its older segments of the epoch when the snapshot is on disk.
+        A room that is written again by a snapshot gets its history from the snapshot.
+        Records have checksums, a record that was being written when the server stopped ends its segment.
+        Every run of the server is an epoch. On startup segments of the last epoch are read
+        sequentially, rooms and their history are rebuilt, directories of shards are built once
+        after all records are read, and they are written as the first
+        records of a new epoch. CURRENT file is changed to the new epoch and old segments are
+        removed, so a journal is never longer than one run.
+
+    -ROOM NAME INDEX
+        Names of active rooms and reserved names of private rooms waiting for a password
+        are kept in an open addressing hash table (linear probing). Finding a room and
+        checking uniqueness of a name do not depend on the number of rooms.
+        Every shard has the index of its own rooms.
 
 */
 
+#define _GNU_SOURCE // accept4, pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include "protocol.h"
+#include "arena.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup) // Provided buffer rings came with multishot recv (Linux 6.0), they are only enum values.
+#define URING_SUPPORTED // Headers are new enough for the io_uring backend, the kernel is checked when it starts.
+#endif
 
 #define SOCKET_CREATE_ERR   1
 #define BINDING_ERR         2
@@ -34,674 +234,5174 @@
 #define CONNECTION_ERR      5
 #define SEND_ERR            6
 #define RECV_ERR            7
+#define EPOLL_CREATE_ERR    8
+#define OPTION_ERR          9
+#define LOG_ERR             10
+#define ADMIN_ERR           11
+#define TIMER_ERR           12
+#define JOURNAL_ERR         13
 #define PORT                3205
-#define MAX_CLIENT_NUMBER   100
-#define MAX_ROOM_NUMBER     100
 #define ROOM_TYPE_PRIVATE   1
 #define ROOM_TYPE_PUBLIC    0
 #define ROOM_CAPACITY       30
+#if ROOM_CAPACITY > MEMBER_IDS
+#error "Member ids of a room have to fit into MEMBER_IDS"
+#endif
 #define ROOM_ACTIVE         0
 #define ROOM_INACTIVE       1
 #define LOCATION_LOBBY      0
 #define LOCATION_ROOM       1
 #define ALIVE               0
 #define DISCONNECTED        1
+#define MAX_SHARDS          256
+#define MAX_EVENTS          64
+#define STATE_NICKNAME      0 // Client is expected to send its nickname.
+#define STATE_COMMAND       1 // Client is expected to send commands.
+#define STATE_SET_PASSWORD  2 // Client is expected to choose a password for private room.
+#define STATE_ENTER_PASSWORD 3 // Client is expected to enter password of private room.
+#define STATE_CONFIRM_PASSWORD 4 // Client is expected to enter chosen password again.
+#define STATE_WAITING_ROOM  5 // Client waits for an answer from another shard.
+#define FRAME_KIND_REPLY    0 // Answer to a command of client, it is never dropped.
+#define FRAME_KIND_MESSAGE  1 // Room message, it can be dropped for slow clients.
+#define FRAME_KIND_COUNTER  2 // Online counter, only the newest one is needed.
+#define POLICY_DROP         0
+#define POLICY_COALESCE     1
+#define POLICY_DISCONNECT   2
+#define QUEUE_INITIAL_SLOTS 16
+#define QUEUE_MAX_SLOTS     4096 // Frames that can wait for a client at most.
+#define MAX_IOVEC           64 // Queued frames that are written with one call.
+#define FLUSH_INITIAL_SLOTS 64
+#define QUEUE_LIMIT_FACTOR  4 // Queue cannot be larger than this many high watermarks.
+#define INDEX_INITIAL_SLOTS 64
+#define ROOM_RESERVED       -2 // Index value of a name that is reserved by pcreate.
+#define CHUNK_SLOTS         64 // Slots that are allocated together when a table grows.
+#define MAX_CHUNKS          16384
+#define SLOT_BITS           20 // Low bits of an id are slot number, high bits are generation.
+#define SLOT_MASK           ((1 << SLOT_BITS) - 1)
+#define GENERATION_MASK     0x7ff // Generation wraps before the id becomes negative.
+#define LISTENER_ID         -1 // Epoll events with this id belong to server socket.
+#define TIMER_ID            -2 // Epoll events with this id belong to password timer.
+#define WAKE_ID             -3 // Epoll events with this id belong to eventfd of inbox.
+#define TIMER_PERIOD        250 // Time (ms) between checks of password deadlines.
+#define SHARD_CREATE        0 // Requests to the shard of a room.
+#define SHARD_RESERVE       1
+#define SHARD_UNRESERVE     2
+#define SHARD_ENTER         3
+#define SHARD_LEAVE         4
+#define SHARD_MESSAGE       5
+#define SHARD_HISTORY       6
+#define SHARD_CREATED       7 // Answers to the shard of a client.
+#define SHARD_ENTERED       8
+#define SHARD_REJECTED      9
+#define SHARD_RESERVED      10
+#define SHARD_PASSWORD      11
+#define SHARD_DELIVER       12
+#define SHARD_FILE          13 // Request to the shard of a room, it is handled with the other requests.
+#define SHARD_SPOOLED       14 // Spool writer to the shard of a client.
+#define SPOOL_RESUME        0 // Spool writer caught up with the upload.
+#define SPOOL_DONE          1 // All frames of the file are written.
+#define SPOOL_FAILED        2 // Spool file could not be written.
+#define SPOOL_PENDING_LIMIT 64 // Frames of an upload waiting for spool writer before client input is paused.
+#define SPOOL_RESUME_LEVEL  16 // Paused client input is read again below this many waiting frames.
+#define REJECT_NAME_USED    0 // Reasons of SHARD_REJECTED.
+#define REJECT_ROOM_LIMIT   1
+#define REJECT_NOT_FOUND    2
+#define REJECT_FULL         3
+#define REJECT_PASSWORD     4
+#define BUSY_LIMIT          0 // Reasons of rejected connections.
+#define BUSY_RATE           1
+#define BUSY_FULL           2
+#define BUSY_REASONS        3
+#define LOG_DEBUG           0
+#define LOG_INFO            1
+#define LOG_WARN            2
+#define LOG_ERROR           3
+#define LOG_RING_SIZE       1024 // Records that can wait for log writer in one thread.
+#define LOG_IDLE_SLEEP      10000 // Time (us) log writer sleeps when there is nothing to write.
+#define HISTOGRAM_MAX_BUCKETS 16
+#define HISTOGRAM_INBOX_WAIT 0
+#define HISTOGRAM_FANOUT    1
+#define HISTOGRAM_QUEUE_DEPTH 2
+#define HISTOGRAM_TYPES     3
+#define ADMIN_READ_TIMEOUT  100000 // Time (us) admin thread waits for a request before it answers.
+#define COMMAND_LIST        0
+#define COMMAND_CREATE      1
+#define COMMAND_PCREATE     2
+#define COMMAND_ENTER       3
+#define COMMAND_QUIT        4
+#define COMMAND_MSG         5
+#define COMMAND_WHOAMI      6
+#define COMMAND_EXIT        7
+#define COMMAND_MESSAGE     8 // Room message without -msg.
+#define COMMAND_INVALID     9
+#define COMMAND_HISTORY     10
+#define COMMAND_SEND        11
+#define COMMAND_COMPACT     12
+#define COMMAND_TYPES       13
+#define HISTORY_LIMIT       100 // Messages that a room can keep at most.
+#define LIST_PAGE_SIZE      10 // Rooms on a page of -list.
+#define DIRECTORY_CHUNK     128 // Most listings in a chunk of room directory.
+#define JOURNAL_CREATE      1 // Types of journal records.
+#define JOURNAL_HISTORY     2
+#define JOURNAL_MESSAGE     3
+#define JOURNAL_CLOSE       4
+#define JOURNAL_ALIGN       8 // Records start at multiples of this.
+#define MIN_SEGMENT_SIZE    (1024 * 1024) // A segment has to hold the largest record.
+#define JOURNAL_RESERVE_STEP (1024 * 1024) // Segment file is allocated on disk by this many bytes at a time.
+#define JOURNAL_COMPACT_SEGMENTS 4 // Segments appended after a snapshot before a shard writes the next one.
+#define IO_EPOLL            0 // I/O backends of shards.
+#define IO_URING            1
+#define URING_ENTRIES       1024 // Submission queue entries of a shard.
+#define URING_CQ_ENTRIES    8192
+#define URING_BUFFERS       512 // Provided buffers that multishot recv fills, a power of two.
+#define URING_BUFFER_SIZE   4096
+#define URING_BUFFER_GROUP  0
+#define URING_ACCEPT        1 // Operations in the low bits of io_uring user data.
+#define URING_RECV          2
+#define URING_SEND          3
+#define URING_POLL          4
+#define URING_WRITABLE      5 // One shot poll of a socket that sendfile found full.
+#define URING_OP_MASK       7
+#define MAX_WAITING_FILES   8 // Files that can wait for a client at most.
+#define FILE_NOTSENT_LOWAT  65536 // Unsent bytes a socket keeps while files are written, frames do not wait behind more.
+#define uring_data(op, id)  (((uint64_t)(uint32_t)(id) << 32) | (op))
+
+
+
+
+typedef struct shared_frame{ // Encoded frame that is sent to many clients without copying.
+
+    int reference_counter; // Frame is freed when nobody uses it.
+    size_t length; // Length of header and payload.
+    char data[]; // Header and payload.
+
+} shared_frame;
+
+typedef struct outbound_entry{ // Frame waiting in outbound queue of a client.
+
+    shared_frame* frame;
+    int kind;
+
+} outbound_entry;
+
+typedef struct shared_file{ // Spooled upload that is streamed to many clients with sendfile.
+
+    int reference_counter; // Spool file is closed when nobody uses it.
+    int fd; // Spool file, it is unlinked when it is created.
+    size_t size; // Bytes of frames in spool file.
+    size_t first_length; // Length of the announcement frame, data frames follow it.
+    size_t frame_length; // Length of a full data frame, only the last one can be shorter.
+    int spool_pending; // Frames queued for spool writer and not written yet.
+    int spool_paused; // Sender waits for spool writer, it is told when the writer catches up.
+    int spool_failed; // Only spool writer uses it.
+
+} shared_file;
+
+typedef struct spool_write{ // Frame of an upload waiting for spool writer.
+
+    struct spool_write* next;
+    shared_file* file; // Write keeps a reference.
+    int client_id;
+    int shard; // Shard of client.
+    int last; // File is complete after this frame.
+    size_t length;
+    char data[]; // Frame that is written into spool file.
+
+} spool_write;
 
+typedef struct file_transfer{ // File waiting to be streamed to a client.
 
+    shared_file* file;
+    off_t offset; // Bytes of spool file written to client.
+    off_t frame_end; // End of the frame that is being written, frames can be written between frames of file.
+    struct file_transfer* next;
 
+} file_transfer;
 
-typedef struct client{ // Information about a client is stored in struct.
+typedef struct client{ // Information about a client is stored in struct. Only its shard uses it.
 
-    int id;
+    int id; // Has to be the first field, slot tables change generation of it.
     int socket;
     char* nickname;
     int location;
     int room_id;
     int connection_flag;
+    int compact; // Client reads compact room frames.
+    int state; // Decides how the next input of client is handled.
+    char* pending_room_name; // Private room name waiting for a password.
+    char* pending_password; // Chosen password waiting for confirmation.
+    int pending_room_id; // Private room waiting for a password.
+    char* pending_action; // Action that is logged when room shard answers.
+    long long input_deadline; // Time (ms) client has to answer the password prompt until.
+    frame_decoder decoder; // Received bytes waiting to be separated into frames.
+    outbound_entry* queue; // Ring of frames waiting to be written.
+    int queue_capacity;
+    int queue_head;
+    int queue_count;
+    size_t queue_offset; // Written bytes of the first frame in queue.
+    size_t queued_bytes; // Bytes waiting in queue.
+    long long slow_since; // Time (ms) when queue passed the high watermark, 0 if it is not over.
+    int evicted; // Client is disconnected by slow consumer policy.
+    int dropped_frames;
+    long long flush_at; // Time (ms) waiting frames are written at, 0 if they are written at the end of the loop.
+    int flush_listed; // Client is in the flush list of its shard.
+    int blocked; // Socket is full, queue is written when epoll reports EPOLLOUT.
+    struct uring_send* send_request; // Sendmsg that io_uring has not completed, NULL if there is none.
+    file_transfer* files; // Files waiting to be streamed, the first one is being written.
+    file_transfer* last_file;
+    int file_count;
+    shared_file* upload; // File that client is uploading, NULL if there is none.
+    size_t upload_remaining; // File bytes client has not sent yet, they are ignored if the upload is cancelled.
+    char* upload_chunk; // File bytes waiting to fill a data frame.
+    size_t upload_chunk_length;
+    int spool_waiting; // Input is not read until spool writer catches up with the upload.
+    char* list_prefix; // Prefix of the last -list page client was shown.
+    int list_page;
+    char* list_cursor; // Name of the last room on that page, NULL if it was empty.
 
 } client;
 
-typedef struct chat_room{ // Information about chat room is stored in struct.
+typedef struct room_member{ // Client in a room. Nickname is copied, clients of other shards are never read.
 
+    int client_id;
+    char* nickname;
+    int member_id; // Id in compact frames, unique in room.
+    int compact; // Member reads compact frames.
+
+} room_member;
+
+typedef struct chat_room{ // Information about chat room is stored in struct. Only its shard uses it.
+
+    int id; // Has to be the first field, slot tables change generation of it.
     char* name;
     int type;
     char* password;
-    int client_ids[100];
-    int client_counter;
-    int active_client_counter;
+    room_member members[ROOM_CAPACITY]; // Clients that are in room now.
+    int active_client_counter; // Number of members.
+    unsigned int member_ids; // Bit of every member id that is used.
+    int compact_members; // Members that read compact frames.
     int is_active;
+    shared_frame** history; // Ring of last messages, oldest one is at history_head when it is full.
+    int history_capacity;
+    int history_head; // Slot of the next message.
+    int history_count;
 
 } chat_room;
 
+typedef struct index_entry{ // Slot of room name index.
 
-void* connection_handler(void*);
-void init_room_client(void);
-char** split(char*, char);
-char* trim(char*);
-int check_room_name_valid(char*);
-void write_client(int, char*);
-void console_log(char*, int, int, char*, char*);
-int get_room_id_by_name(char*);
-int check_socket_status(client*);
-int is_room_contain_client(int, int);
-int validate_password(char*, char*);
+    char* name; // NULL for empty slots.
+    unsigned int hash;
+    int room_id; // Room id or ROOM_RESERVED.
 
+} index_entry;
 
-client clients[MAX_CLIENT_NUMBER];
-chat_room rooms[MAX_ROOM_NUMBER];
+typedef struct slot_table{ // Growable table whose slots are never moved.
 
-int total_client_number = 0;
-int total_room_number = 0;
-char reserved_room_names[100][100] = {{'\0'}}; // Reserved room names is used in pcreate command.
-char reserved_room_name_counter = 0;
-sem_t mutex; // All client threads requires common data. Mutex is required to synchronize threads.
+    char* chunks[MAX_CHUNKS]; // Chunks are allocated when the table needs more slots.
+    size_t slot_size;
+    int slot_count; // Slots in allocated chunks.
+    int* free_slots; // Released slots are used again before the table grows.
+    int free_count;
+    int free_capacity;
+    void (*init_slot)(void*, int); // Prepares a slot of new chunk.
+    int stride; // Slot numbers of table are offset, offset + stride, offset + 2 * stride ...
+    int offset;
+    int slot_limit; // Slots that fit into slot bits of an id.
 
-int main(){
+} slot_table;
 
-    sem_init(&mutex, 0, 1);
-    int socket_desc, new_socket, c, *new_sock;
-    struct sockaddr_in server, client;
+typedef struct waiting_entry{ // Client that is asked for a password.
 
-    // Create Socket
-    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    int client_id;
+    long long deadline; // Time (ms), entry is checked after it.
 
-    if(socket_desc == -1){
+} waiting_entry;
 
-        puts("Coult not create socket!");
-        return SOCKET_CREATE_ERR;
-    }
+typedef struct shard_message{ // Request or answer sent from one shard to another. Strings are in the same allocation.
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY; // IPv4 local host addr
-    server.sin_port = htons(PORT);
+    struct shard_message* next;
+    int type;
+    int client_id; // Client that the message is about.
+    int room_id;
+    int value; // Room type, online counter, frame kind or reason of rejection.
+    int compact; // Client of request reads compact frames.
+    long long sent_ns; // Time message is put into inbox.
+    shared_frame* frame; // Frame to send, message keeps a reference.
+    shared_file* file; // File to stream after the frame, message keeps a reference.
+    char* name; // Room name.
+    char* nickname;
+    char* text; // Password or part of room list.
+    int count; // Number of recipients.
+    int recipients[]; // Clients that frame is sent to.
 
-    if(bind(socket_desc, (struct sockaddr *)&server, sizeof(server)) < 0){
-        puts("Binding failed");
-        return BINDING_ERR;
-    }
-    puts("Socket is binded");
+} shard_message;
 
-    listen(socket_desc, 3); // Server is started to listen connections on 3205 port.
-    puts("Waiting for incoming connections");
+typedef struct log_record{ // A log line waiting for log writer. Texts are copied, they are cut if they are too long.
 
-    c = sizeof(struct sockaddr_in);
+    long long time_ms; // Wall clock time (ms).
+    int level;
+    int client_id;
+    int socket;
+    char nickname[32];
+    char action[64];
+    char result[128];
 
-    while((new_socket = accept(socket_desc,(struct sockaddr *)&client,(socklen_t*)&c))){ // This loop runs forever for new clients.
+} log_record;
 
-        puts("New connection");
-        write_client(new_socket, "Welcome to the DEUCHAT\n");
+typedef struct log_ring{ // Records of one thread. Only the thread writes head, only log writer writes tail.
 
-        pthread_t client_thread;
-        clients[total_client_number].id = total_client_number; // Giving thread an identity.
-        clients[total_client_number++].socket = new_socket; // Socket number is used to send message to the client.
+    log_record records[LOG_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped; // Records that did not fit into ring.
+    unsigned int reported; // Dropped records that are logged.
+    struct log_ring* next;
 
-        if(pthread_create(&client_thread, NULL, connection_handler, (void*)&clients[total_client_number - 1]) < 0){ // Thread is assigned for the client.
-            puts("Could not create thread");
-            return THREAD_CREATE_ERR;
-        }
+} log_ring;
 
-        puts("Handler assigned\n");
-    }
+typedef struct histogram{ // Description of a histogram. Values are in base units (ns or frames).
 
-    close(socket_desc);
-    close(new_socket);
+    const char* name;
+    const char* help;
+    const long long* bounds; // Upper bounds of buckets, the last bucket has no bound.
+    int bound_count;
+    double scale; // Converts base units to the units that are served.
 
-    return 0;
-}
+} histogram;
 
+typedef struct histogram_counts{ // Number of observed values in buckets of a histogram.
 
-/*
-    This function is used by client threads.
-    Communicates with client until client is disconnected.
-*/
-void *connection_handler(void* client_ptr){
+    unsigned long long buckets[HISTOGRAM_MAX_BUCKETS];
+    unsigned long long sum;
+    unsigned long long count;
 
-    client* cl = ((client*)client_ptr);
-    int sock = cl->socket;
-    char client_message[100] = {'\0'};
-    int bytes_read = 0;
+} histogram_counts;
 
-    write_client(sock, "Enter your nickname: ");
-    bytes_read = recv(sock, client_message, 2000, 0);
-    client_message[bytes_read] = '\0';
-    cl->nickname = (char*)malloc(sizeof(char) * bytes_read);
-    strcpy(cl->nickname, client_message); // A nickname is assigned to client.
-    cl->location = LOCATION_LOBBY;
-    cl->room_id = -1; // Client is not in a room yet.
-    char send[100];
-    sprintf(send, "login_success;%d;%s", cl->id, cl->nickname);
-    write_client(sock, send); // Informs client, client is in lobby now and server is ready to execute commands coming from client.
-
-
-    while((bytes_read = recv(sock, client_message, 2000, 0)) > 0){ // Listens client commands
-
-        client_message[bytes_read] = '\0';
-        char** splitted = split(client_message, ' ');
-        if(strcmp(splitted[0], "-list") == 0){
-            if(cl->location == LOCATION_LOBBY){ // Client can list rooms, only if he/she in lobby
-                int i = 0;
-                char message[500] = {'\0'};
-                strcat(message, "list;");
-                sem_wait(&mutex); // Entering critical region.
-                for(i = 0 ; i < total_room_number ; i++) {
-                    if(rooms[i].is_active == ROOM_ACTIVE){ // Lists only active rooms, rooms turns to inactive forever when they are empty.
-                        int t = 0;
-                        char tmp[100];
-                        sprintf(tmp, "\n Room Name: %s\n Room Type: %s\n", rooms[i].name, rooms[i].type == ROOM_TYPE_PRIVATE ? "Private" : "Public");
-                        strcat(message, tmp);
-                        if(rooms[i].type == ROOM_TYPE_PUBLIC){
-                            strcat(message, " Customers: \n");
-                            for (t = 0 ; t < rooms[i].client_counter ; t++){
-                                if(check_socket_status(&clients[rooms[i].client_ids[t]]) || clients[rooms[i].client_ids[t]].room_id != i)
-                                    continue;
-                                sprintf(tmp, "\t%s\n", clients[rooms[i].client_ids[t]].nickname);
-                                strcat(message, tmp);
-                            }
-                        }
-                        else {
-                            strcat(message, " No customer info given, room is private!\n");
-                        }
-                    }
-                }
-                sem_post(&mutex); // Exiting critical region.
-                write_client(sock, message); // Sending room list to client.
-            }
-            else { // Client is not in lobby, so he/she can not list rooms.
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to list rooms", "Rejected because of user is not in lobby");
-                write_client(sock, "You have to be in lobby to list rooms!");
-            }
-        }
-        else if(strcmp(splitted[0], "-create") == 0){
-            if(cl->location == LOCATION_LOBBY){ // Client can create room, only if he/she is in lobby.
-                int room_id = -1;
-                int room_name_valid = 0;
-                sem_wait(&mutex); // Entering critical region
-                room_name_valid = check_room_name_valid(splitted[1]); // Checking room name's uniqueness.
-                if(strcmp(splitted[1], "") == 0){ // Empty room name is not acceptable.
-                    write_client(sock, "This room name is not valid!");
-                    char result[100];
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", "Rejected because of user name is not valid");
-                    sem_post(&mutex); // Exiting critical region because this turn of loop will not executed.
-                    continue;
-                }
-                else if(!room_name_valid){ // Room name must be valid.
-                    write_client(sock, "This room name is already in use!");
-                    char result[100];
-                    sprintf(result, "Rejected due to unique name constraint: %s", splitted[1]);
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", result);
-                    sem_post(&mutex); // Exiting critical region because this turn of loop will not executed.
-                    continue;
-                }
-                room_id = total_room_number; // Room id is assigned. Room id's are also unique.
-                rooms[room_id].name = (char*)malloc(sizeof(char) * strlen(splitted[1]));
-                strcpy(rooms[room_id].name, splitted[1]);
-                rooms[room_id].type = ROOM_TYPE_PUBLIC;
-                rooms[room_id].is_active = ROOM_ACTIVE;
-                rooms[room_id].client_ids[rooms[room_id].client_counter++] = cl->id; // The client that creates room is added into room.
-                rooms[room_id].active_client_counter = 1; // Counting client number in room.
-                total_room_number += 1; // Counting total room number in system. (Active + inactive)
-                cl->location = LOCATION_ROOM; // Updating client location
-                cl->room_id = room_id; // Updating client's room.
-                char message[100];
-                sprintf(message, "room_created;%s;%d;%d", rooms[room_id].name, rooms[room_id].client_counter, ROOM_CAPACITY);
-                write_client(sock, message); // Informing client
-                sem_post(&mutex);
-                char result[100];
-                sprintf(result, "Successful, room \"%s\" has been created", rooms[room_id].name);
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", result);
+typedef struct server_metrics{ // Counters that are served on admin socket.
 
-            }
-            else{ // Client is not in lobby, so he/she cannot create room.
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", "Rejected because of user is not in lobby");
-                write_client(sock, "You have to be in lobby to create room!");
-            }
+    unsigned long long accepted_connections;
+    long long active_connections;
+    unsigned long long rejected_connections[BUSY_REASONS];
+    unsigned long long commands[COMMAND_TYPES];
+    unsigned long long fanout_messages; // Frames given to room members.
+    unsigned long long fanout_bytes;
+    unsigned long long set_password_prompts;
+    unsigned long long enter_password_prompts;
+    unsigned long long password_timeouts;
+    unsigned long long shard_messages; // Messages sent to other shards.
+    unsigned long long history_frames; // Messages in history sent to entering clients.
+    unsigned long long socket_writes; // Calls that write queued frames to client sockets.
+    unsigned long long written_frames; // Frames written completely by these calls.
+    unsigned long long file_uploads; // Files spooled and shared with a room.
+    unsigned long long file_bytes; // Spooled bytes written to client sockets with sendfile.
+    histogram_counts histograms[HISTOGRAM_TYPES];
 
-        }
-        else if(strcmp(splitted[0], "-pcreate") == 0){
-            if(cl->location == LOCATION_LOBBY){ // Client can create private room, only if he/she is in lobby.
-                int room_id = -1;
-                int room_name_valid = 0;
-                sem_wait(&mutex);
-                room_name_valid = check_room_name_valid(splitted[1]); // Checking room name's uniqueness.
-                if(strcmp(splitted[1], "") == 0){ // Empty room name is not acceptable.
-                    write_client(sock, "This room name is not valid!");
-                    char result[100];
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", "Rejected because of user name is not valid");
-                    sem_post(&mutex); // Exiting critical region because this turn of loop will not executed.
-                    continue;
-                }
-                else if(!room_name_valid){ // Room name must be valid.
-                    write_client(sock, "This room name is already in use!");
-                    char result[100];
-                    sprintf(result, "Rejected due to unique name constraint: %s", splitted[1]);
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room", result);
-                    sem_post(&mutex); // Exiting critical region because this turn of loop will not executed.
-                    continue;
-                }
-                int reserved_index = reserved_room_name_counter;
-                strcpy(reserved_room_names[reserved_room_name_counter++], splitted[1]);
-                /*
-                    Room name is reserved until the client chooses a valid password for room.
-                    This operation can take much time because of client.
-                    So, we need to post mutex for another clients to continue their operations.
-                    But another clients should not create room with same name. Therefore, room name is reserved.
-                    reserved_room_names array is also used when checking uniqueness of room names.
-                */
-                sem_post(&mutex); //Exiting from critical region.
-
-                // Getting valid password from client for private room.
-                int password_valid = 0;
-                char* password = (char*)malloc(sizeof(char) * 200);
-                while(!password_valid){
-                    write_client(sock, "set_password;Set a password for private room.");
-                    int bytes = 0;
-                    while((bytes = recv(sock, password, 200, 0)) > 0){
-                        char result_buffer[100] = {'\0'};
-                        password = trim(password);
-                        password[bytes] = '\0';
-                        if(validate_password(password, result_buffer)){
-                            write_client(sock, result_buffer);
-                            password_valid = 1;
-                            sleep(1);
-                            break;
-                        }
-                        else{
-                            write_client(sock, result_buffer);
-                            password_valid = 0;
-                        }
-                    }
-                }
+} server_metrics;
 
-                // Password has been chosen.
-                sem_wait(&mutex); // Enter critical region again because room will be created.
-                strcpy(reserved_room_names[reserved_index], "\0");
-                room_id = total_room_number; // Room id is assigned. Room id's are also unique.
-                rooms[room_id].name = (char*)malloc(sizeof(char) * strlen(splitted[1]));
-                rooms[room_id].password = (char*)malloc(sizeof(char) * strlen(password));
-                strcpy(rooms[room_id].name, splitted[1]);
-                strcpy(rooms[room_id].password, password);
-                rooms[room_id].type = ROOM_TYPE_PRIVATE;
-                rooms[room_id].is_active = ROOM_ACTIVE;
-                rooms[room_id].client_ids[rooms[room_id].client_counter++] = cl->id; // The client that creates room is added into room.
-                rooms[room_id].active_client_counter = 1; // Counting client number in room.
-                total_room_number += 1; // Counting total room number in system. (Active + inactive)
-                cl->location = LOCATION_ROOM; // Updating client location.
-                cl->room_id = room_id; // Updating client's room.
-                char message[100] = {'\0'};
-                sprintf(message, "room_created;%s;%d;%d\0", rooms[room_id].name, rooms[room_id].client_counter, ROOM_CAPACITY);
-                write_client(sock, message); // Informing client.
-                sem_post(&mutex); // Exiting critical region.
-                char result[100] = {'\0'};
-                sprintf(result, "Successful, room \"%s\" has been created\0", rooms[room_id].name);
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room\0", result);
+typedef struct directory_entry{ // Listing of a room in room directory, it is not changed after it is published.
 
-            }
-            else{ // Client is not in lobby.
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to create a room\0", "Rejected because of user is not in lobby\0");
-                write_client(sock, "You have to be in lobby to create room!\0");
-            }
-        }
-        else if(strcmp(splitted[0], "-enter") == 0){
-            if(cl->location == LOCATION_LOBBY){ // Client can enter into room, only if he/she is in lobby.
-                sem_wait(&mutex); // Entering critical region
-                int room_id = get_room_id_by_name(splitted[1]);
-                if(room_id == -1){ // There is no room that has given name in system.
-                    write_client(sock, "Room could not found!");
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to enter a room", "Rejected because of room does not exists");
-                    sem_post(&mutex); // Exiting critical region, client will not enter room.
-                    continue;
-                }
-                if(rooms[room_id].client_counter == ROOM_CAPACITY){ // Room is full.
-                    write_client(sock, "Room is full capacity!");
-                    console_log(cl->nickname, cl->id, cl->socket, "Attempted to enter a room", "Rejected because of room is full capacity");
-                    sem_post(&mutex); // Exiting critical region, client will not enter room.
-                    continue;
-                }
-                if(rooms[room_id].type == ROOM_TYPE_PRIVATE){ // Room is private, client has to enter correct password.
-                    char password[200] = {'\0'};
-                    write_client(sock, "request_password;Enter password\0");
-                    int bytes = 0;
-                    if((bytes = recv(sock, password, 200, 0)) > 0){
-                        password[bytes] = '\0';
-                        printf("%s %s\n", password, rooms[room_id].password);
-                        if(strcmp(password, rooms[room_id].password) != 0){
-                            write_client(sock, "incorrect_password;Password is not accepted!\0");
-                            sem_post(&mutex); // Exiting critical region, password is not true
-                            continue;
-                        }
-                    }
-                }
-                // Password is true, client is entering into room.
-                cl->location = LOCATION_ROOM;
-                if(!is_room_contain_client(room_id, cl->id)){
-                    rooms[room_id].client_ids[rooms[room_id].client_counter++] = cl->id; // Client is added to room.
-                }
-                rooms[room_id].active_client_counter += 1; // Updating client counter of room.
-                cl->room_id = room_id;
-                char message[100] = {'\0'};
-                sprintf(message, "room_entered;%s;%d;%d\0", rooms[room_id].name, rooms[room_id].active_client_counter, ROOM_CAPACITY);
-                write_client(sock, message); // Informing client
-                sprintf(message, "update_counter;%d\0",rooms[room_id].active_client_counter);
-                int t = 0;
-                for(t = 0 ; t < rooms[room_id].client_counter-1 ; t++){ // Informing all clients in the same room to update their online counters.
-                    // Checking socket status of client. If the socket connection is broken, we should not try to send data to avoid segmentation fault.
-                    if(check_socket_status(&clients[rooms[cl->room_id].client_ids[t]]) || clients[rooms[cl->room_id].client_ids[t]].room_id != cl->room_id)
-                        continue;
-                    write_client(clients[rooms[room_id].client_ids[t]].socket, message); // Socket connection is stable, we can send message.
-                }
-                sem_post(&mutex); // Exiting critical region.
-                char result[100];
-                sprintf(result, "Successful, room \"%s\" has been entered", rooms[room_id].name);
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to enter a room", result);
+    char* name;
+    char* text; // Text that -list shows for the room.
+    char data[]; // Name and text.
 
-            }
-            else{ // Client is not in lobby. So, he/she can enter a room.
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to enter a room", "Rejected because of user is not in lobby");
-                write_client(sock, "You have to be in lobby to enter a room!");
-            }
-        }
-        else if(strcmp(splitted[0], "-quit") == 0){
-            if(cl->location == LOCATION_ROOM){ // Client has to be in a room to quit.
-                sem_wait(&mutex); // Entering critical region
-                rooms[cl->room_id].active_client_counter -= 1; // Updating client counter of room.
-                if(rooms[cl->room_id].active_client_counter == 0){ // Room is empty, room has to be closed.
-                    rooms[cl->room_id].is_active = ROOM_INACTIVE;
-                    strcpy(rooms[cl->room_id].name, ""); // The name of closed room is deleted to be able to create new room with this name.
-                }
-                else{ // Room is not empty, means there left another clients in room. So, their online counters should be updated.
-                    char message[100] = {'\0'};
-                    sprintf(message, "update_counter;%d\0",rooms[cl->room_id].active_client_counter);
-                    int t = 0;
-                    for(t = 0 ; t < rooms[cl->room_id].client_counter ; t++){
-                        if(check_socket_status(&clients[rooms[cl->room_id].client_ids[t]])) // Checking broken sockets.
-                            continue;
-                        write_client(clients[rooms[cl->room_id].client_ids[t]].socket, message);
-                    }
-                }
-                cl->location = LOCATION_LOBBY; // Client is in lobby now.
-                cl->room_id = -1;
-                sem_post(&mutex); // Exiting critical region.
-                char message[100] = {'\0'};
-                sprintf(message, "login_success;%d;%s\0", cl->id, cl->nickname);
-                write_client(cl->socket, message); // Informing client, he/she entered to lobby.
-            }
-            else{
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to quit from a room", "Rejected because of user is not in a room\0");
-                write_client(sock, "You have to be in a room to quit from a room!\0");
-            }
-        }
-        else if(strcmp(splitted[0], "-msg") == 0){
-            if(cl->location == LOCATION_ROOM){ // Client has to be in room to send message.
-                int z = 0;
-                sem_wait(&mutex); // Entering critical region
-                for(z = 0 ; z < rooms[cl->room_id].client_counter ; z++){
-                    char message[250];
-                    sprintf(message, "new_message;%s;%s\0", cl->nickname, splitted[1]);
-                    if(check_socket_status(&clients[rooms[cl->room_id].client_ids[z]]) || clients[rooms[cl->room_id].client_ids[z]].room_id != cl->room_id)
-                        continue;
-                    write_client(clients[rooms[cl->room_id].client_ids[z]].socket, message);
-                }
-                sem_post(&mutex); // Exiting critical region.
-            }
-            else{
-                console_log(cl->nickname, cl->id, cl->socket, "Attempted to send a message", "Rejected because of user is not in room\0");
-                write_client(sock, "You have to be in room to send a message!\0");
-            }
-        }
-        else if(strcmp(splitted[0], "-whoami") == 0){
-            write_client(cl->socket, cl->nickname);
-        }
-        else if(strcmp(splitted[0], "-exit") == 0){
+} directory_entry;
 
-            sem_wait(&mutex); // Entering critical region.
-            if(cl->room_id != -1){ // Exiting from a room. It is like quit command.
-                rooms[cl->room_id].active_client_counter -= 1;
-                if(rooms[cl->room_id].active_client_counter == 0){
-                    rooms[cl->room_id].is_active = ROOM_INACTIVE;
-                    strcpy(rooms[cl->room_id].name, "\0");
-                }
-                else{
-                    char message[100] = {'\0'};
-                    sprintf(message, "update_counter;%d\0",rooms[cl->room_id].active_client_counter);
-                    int t = 0;
-                    for(t = 0 ; t < rooms[cl->room_id].client_counter ; t++){
-                        if(check_socket_status(&clients[rooms[cl->room_id].client_ids[t]]) || clients[rooms[cl->room_id].client_ids[t]].room_id != cl->room_id)
-                            continue;
-                        write_client(clients[rooms[cl->room_id].client_ids[t]].socket, message);
-                    }
-                }
-            }
-            // If client is not a room, exiting easy.
-            cl->connection_flag = DISCONNECTED;
-            console_log(cl->nickname, cl->id, cl->socket, "Attempted to exit", "Successful");
-            sem_post(&mutex);
-            break;
-        }
-        else{ // Unknown command
-            if(cl->location == LOCATION_ROOM){ // Unknown commands are messages if the client in room. Sending message all clients in the same room.
-                int z = 0;
-                sem_wait(&mutex);
-                for(z = 0 ; z < rooms[cl->room_id].client_counter ; z++){
-                    char message[250];
-                    sprintf(message, "new_message;%s;%s\0", cl->nickname, client_message);
-                    if(check_socket_status(&clients[rooms[cl->room_id].client_ids[z]]) || clients[rooms[cl->room_id].client_ids[z]].room_id != cl->room_id)
-                        continue;
-                    write_client(clients[rooms[cl->room_id].client_ids[z]].socket, message);
-                }
-                sem_post(&mutex);
-            }
-            else{
-                write_client(cl->socket, "Invalid command!");
-            }
-        }
-    }
+typedef struct directory_chunk{ // Part of a room directory sorted by name. Only entries are replaced after it is published.
 
+    int count;
+    directory_entry* entries[DIRECTORY_CHUNK];
 
-    return 0;
-}
+} directory_chunk;
 
-/*
-    Special split is used to split client messages.
-    Example:
-        char* client_msg = "-msg This is a test message from client."
-        char** splitted_client_msg = split(client_msg, ' ');
-        splitted_client_msg[0] is "-msg"
-        splitted_client_msg[0] is "This is a test message from client."
+typedef struct directory_span{ // Chunk of a room directory.
 
-*/
-char** split(char* string, char delimiter){
+    directory_chunk* chunk;
+    int first; // Place of its first room in the directory.
 
-    int i;
-    int delimiter_location = -1;
-    int str_cnt = 0;
-    char **str_arr = (char**)malloc(sizeof(char*) * 2);
-    string = trim(string);
+} directory_span;
 
-    for(i=0;i<strlen(string);i++){
-        if(string[i] == delimiter){
-            delimiter_location = i;
-            break;
-        }
-    }
+typedef struct room_directory{ // Rooms of a shard sorted by name, in chunks. It is not changed after it is published.
 
-    if(delimiter_location != -1){
-        str_arr[0] = (char*)malloc(sizeof(char) * delimiter_location == 0 ? 1 : delimiter_location);
-        int k = 0;
+    int count; // Rooms in all chunks.
+    int span_count;
+    directory_span spans[];
 
-        do{
-            str_arr[0][k] = string[k];
+} room_directory;
 
-        }while(string[k++ + 1] != delimiter);
+typedef struct retired_memory{ // Memory that is freed when no shard can be reading it.
 
-        str_arr[0][k++] = '\0';
-        str_arr[1] = (char*)malloc(sizeof(char) * (strlen(string) - k + 1));
+    void* pointer;
+    struct retired_memory* next;
 
-        int t = 0;
-        while(k < strlen(string)){
-            str_arr[1][t++] = string[k++];
-        }
-        str_arr[1][t] = '\0';
+} retired_memory;
 
-        str_arr[0] = trim(str_arr[0]);
-        str_arr[1] = trim(str_arr[1]);
+typedef struct retired_batch{ // Memory retired in one loop of a shard.
 
-    }
-    else {
-        str_arr[0] = string;
-        str_arr[1] = "\0";
-    }
+    retired_memory* memory;
+    struct retired_batch* next;
+    unsigned long long counts[]; // Quiescent counts of shards when the batch is closed.
 
-    return str_arr;
-}
+} retired_batch;
 
-/*
-    Left and right trim for given string.
-    Example:
-        char* str = "    This is a string.      ";
-        str = trim(str);
-        str is "This is a string.";
-*/
-char* trim(char* string){
+typedef struct journal_record{ // Header of a journal record, payload follows it.
 
-    if(!string) return string;
+    uint32_t length; // Bytes of payload.
+    uint32_t checksum; // FNV-1a of header (with 0 checksum) and payload.
+    int32_t type;
+    int32_t room_id; // Id of room in the epoch that wrote the record.
+    int32_t value; // Room type or history size.
 
-    while(*string == ' '){
-        string = string + 1;
-    }
+} journal_record;
 
-    char* back = string + (strlen(string) - 1);
-    while(*back == ' '){
-        *(back) = '\0';
-        back = back -1;
-    }
+typedef struct journal_segment{ // Memory mapped file that records of a shard are appended to.
 
-    return string;
-}
+    char* base;
+    size_t size;
+    size_t reserved; // Bytes of file that are allocated on disk, records are appended only into them.
+    size_t written; // Bytes appended by shard.
+    size_t synced; // Bytes written to disk by journal syncer.
+    int fd;
+    int sequence; // Number of segment in its epoch.
+    struct journal_segment* next; // Full segments waiting for journal syncer.
 
-/*
-    Checks given room name if it is unique.
-    Searches given name in the rooms array and in the reserved names.
-*/
-int check_room_name_valid(char* room_name){
+} journal_segment;
 
-    int i = 0;
+typedef struct uring_send{ // Sendmsg given to io_uring. Frames are retained until it is completed.
 
-    for(i = 0 ; i < total_room_number ; i++){
-        if(strcmp(room_name, rooms[i].name) == 0)
-            return 0;
-    }
+    struct msghdr message;
+    struct iovec parts[MAX_IOVEC];
+    shared_frame* frames[MAX_IOVEC];
+    int frame_count;
+    int client_id;
+    struct uring_send* next; // Free list of shard.
 
-    for(i = 0 ; i < reserved_room_name_counter ; i++){
-        if(strcmp(room_name, reserved_room_names[i]) == 0)
-            return 0;
-    }
+} uring_send;
 
-    return 1;
-}
+typedef struct uring{ // io_uring instance of a shard. Rings are memory shared with the kernel.
 
-/*
-    Sends given message to given socket.
-*/
-void write_client(int __fd, char* message){
+    int fd;
+    unsigned* sq_head; // Written by kernel.
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // Prepared entries, published when they are submitted.
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail; // Written by kernel.
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* buffers; // Provided buffer ring of multishot recv.
+    char* buffer_memory;
+    unsigned short buffer_tail;
+    uring_send* free_sends;
 
-    char* msg = (char*)malloc(sizeof(char) * strlen(message));
-    strcpy(msg, message);
-    const void* __buf = (const void*)msg;
-    size_t __n = strlen(message);
-    write(__fd, __buf, __n);
+} uring;
 
-}
+typedef struct shard{ // Event loop that owns some clients and rooms.
 
-/*
-    Prettify and log given data to console.
-*/
-void console_log(char* nickname, int client_id, int socket, char* action, char* result){
+    int index;
+    pthread_t thread;
+    int epoll_fd; // Epoll instance that owns the server socket and client sockets of shard.
+    int listen_socket; // Server socket of shard, all shards listen on the same port.
+    int wake_fd; // Eventfd that is written when a message is put into empty inbox.
+    int timer_fd; // Timer that expires password prompts.
+    uring* ring; // io_uring instance, NULL if shard waits with epoll.
+    slot_table clients;
+    slot_table rooms;
+    index_entry* room_index; // Hash table from room names to room ids.
+    int room_index_capacity;
+    int room_index_used; // Slots that are not empty, removed slots are included.
+    int room_index_live; // Slots that keep a name.
+    waiting_entry* waiting_clients; // Clients asked for a password, in the order of their deadlines.
+    int waiting_count;
+    int waiting_capacity;
+    int* flush_clients; // Clients that have frames waiting for the end of the loop or flush window.
+    int flush_count;
+    int flush_capacity;
+    server_metrics metrics;
+    journal_segment* journal; // Segment that records are appended to, NULL if persistence is disabled.
+    journal_segment* retired_segments; // Full segments, journal syncer writes and closes them.
+    journal_segment* spare_segment; // Next segment opened by journal syncer, NULL if it is not ready.
+    int journal_epoch;
+    int journal_sequence; // Number of the next segment, shard and syncer take numbers from it.
+    size_t journal_bytes; // Bytes appended after the last snapshot.
+    size_t snapshot_bytes; // Bytes of the last snapshot.
+    int journal_dropped; // Records that could not be appended.
+    int snapshot_sequence; // First segment of the last complete snapshot, older segments can be removed.
+    int snapshot_end_sequence; // Segment and offset that the last snapshot ends at.
+    size_t snapshot_end;
+    int removed_sequence; // Older segments are removed, only journal syncer uses it.
+    room_directory* directory; // Rooms of shard that -list shows, read by all shards.
+    int directory_stale; // Journal is being recovered, directory is built once at the end.
+    unsigned long long quiescent_count; // Loops of shard, it does not read directories between loops.
+    int online; // Shard is not sleeping in epoll.
+    retired_memory* pending_memory; // Memory retired in this loop.
+    retired_batch* retired_batches; // Memory waiting for other shards, oldest first.
+    retired_batch* last_batch;
+    long long accept_tokens; // A millisecond adds --connection-rate tokens, a connection takes 1000 * shards tokens.
+    long long tokens_refilled; // Time (ms) tokens were added last.
+    shard_message* inbox __attribute__((aligned(64))); // Written by other shards, newest message first.
 
-    printf("Nickname: %s\n"
-            "Client ID: %d\n"
-            "Socket: %d\n"
-            "Action: %s\n"
-            "Result: %s\n\n", nickname, client_id, socket, action, result);
-}
+} shard;
 
-/*
-    Find room id with given name.
-*/
-int get_room_id_by_name(char* room_name){
+typedef struct server_options{ // Options given from command line.
+
+    size_t high_watermark; // Queue size (bytes) that makes a client slow.
+    size_t low_watermark; // Queue size (bytes) that makes a slow client normal again.
+    int slow_policy;
+    int slow_timeout; // Time (ms) a client can stay over the high watermark.
+    int log_level; // Records under this level are not written.
+    char* log_file; // "-" is standard output.
+    char* admin_socket; // Path of admin Unix socket, "" disables it.
+    int admin_port; // Loopback port of admin socket, 0 disables it.
+    int password_timeout; // Time (ms) a client has to answer a password prompt, 0 disables it.
+    int shards; // Number of shards, 0 is one shard per core.
+    int history; // Messages a new room keeps for entering clients.
+    char* data_dir; // Directory of journal, "" disables persistence.
+    size_t segment_size; // Bytes of a journal segment.
+    int sync_interval; // Time (ms) between writes of journals to disk.
+    int flush_window; // Time (ms) room messages can wait to be written together, 0 writes them at the end of the loop.
+    size_t flush_bytes; // Queue size (bytes) that is written without waiting.
+    int io_backend; // IO_EPOLL or IO_URING.
+    char* spool_dir; // Directory of spool files of uploads.
+    size_t max_file_size; // Bytes a shared file can have at most.
+    int backlog; // Connections kernel keeps for every shard until they are accepted.
+    int max_connections; // Clients that can be connected at the same time, 0 disables the limit.
+    int connection_rate; // New connections in a second, 0 disables the limit.
+
+} server_options;
+
+
+int init_shard(shard*, int);
+void* shard_loop(void*);
+void accept_connections(void);
+int admit_connection(void);
+void reject_connection(int, int);
+void register_client(int);
+int init_uring(shard*);
+void uring_loop(void);
+struct io_uring_sqe* uring_sqe(void);
+int uring_enter(int);
+void uring_arm(int, int, int);
+void uring_write_queue(client*);
+void finish_send(uring_send*, int);
+void handle_completions(void);
+void receive_buffer(int, int, unsigned);
+void uring_poll_writable(client*);
+void recycle_buffer(uring*, int);
+void handle_client(client*);
+void process_message(client*, char*);
+void execute_command(client*, char*);
+void start_upload(client*, char*, char*);
+void receive_upload(client*, char*, size_t);
+void write_upload_chunk(client*, int);
+void cancel_upload(client*);
+void spooled_upload(shard_message*);
+int start_spool_writer(void);
+void* spool_writer(void*);
+void write_spool(spool_write*);
+void set_room_password(client*, char*);
+void confirm_room_password(client*, char*);
+void check_room_password(client*, char*);
+void wait_for_password(client*, int);
+void release_pending_room(client*);
+void expire_waiting_clients(void);
+void request_room(client*, int, shard_message*, char*);
+void disconnect_client(client*);
+shard_message* create_message(int, int, int, const char*, const char*, const char*, int);
+void post_message(int, shard_message*);
+void drain_inbox(void);
+void handle_room_request(shard_message*);
+void handle_room_answer(shard_message*);
+void answer_client(shard_message*, int, int, int);
+void create_room(shard_message*);
+chat_room* open_room(char*, int, char*);
+void join_room(shard_message*);
+void leave_room(shard_message*);
+directory_entry* create_directory_entry(chat_room*);
+void directory_insert(chat_room*);
+void directory_remove(chat_room*);
+void directory_update(chat_room*);
+directory_chunk* create_directory_chunk(directory_entry**, int);
+void replace_chunks(room_directory*, int, int, directory_chunk**, int);
+int directory_span_of(room_directory*, int);
+directory_entry* directory_at(room_directory*, int);
+int directory_lower_bound(room_directory*, char*);
+int directory_prefix_end(room_directory*, char*, int);
+char* list_rooms(client*, int, char*);
+void retire_memory(void*);
+void reclaim_memory(void);
+void deliver_frame(shard_message*);
+void broadcast_room(chat_room*, shared_frame*, shared_frame*, shared_file*, int, int);
+void resize_history(chat_room*, int);
+void record_history(chat_room*, shared_frame*);
+shared_frame* create_entered_frame(chat_room*, room_member*);
+void append_payload(shared_frame*, const char*, size_t);
+shared_frame* create_compact_message(chat_room*, shard_message*);
+int room_shard(char*);
+int id_shard(int);
+char** split(char*, char);
+char* trim(char*);
+void write_client(int, char*);
+void send_client(client*, char*);
+shared_frame* create_frame(const char*, ...);
+void retain_frame(shared_frame*);
+void release_frame(shared_frame*);
+void queue_frame(client*, shared_frame*, int);
+int admit_frame(client*, shared_frame*, int);
+void push_frame(client*, shared_frame*, int);
+void drop_waiting_messages(client*, size_t);
+int writing_frames(client*);
+void write_queue(client*);
+void remove_written(client*, size_t);
+void flush_client(client*);
+int flush_waiting_clients(void);
+void evict_client(client*);
+void clear_queue(client*);
+void schedule_flush(client*);
+void queue_file(client*, shared_file*);
+int write_file(client*);
+void retain_file(shared_file*);
+void release_file(shared_file*);
+void clear_files(client*);
+long long now_ms(void);
+long long now_ns(void);
+void observe_histogram(int, long long);
+int start_admin(void);
+void* admin_loop(void*);
+void serve_metrics(int);
+char* format_metrics(arena*);
+char* format_histogram(arena*, char*, int);
+int parse_options(int, char**);
+void log_action(int, client*, char*, char*);
+void log_message(int, const char*, ...);
+log_record* reserve_log_record(void);
+void commit_log_record(void);
+int start_logging(void);
+void* log_writer(void*);
+void write_log_record(log_record*);
+void write_log_text(const char*);
+int get_room_id_by_name(char*);
+unsigned int hash_name(char*);
+int find_index_slot(char*, unsigned int);
+int find_room_index(char*);
+void insert_room_index(char*, int);
+void remove_room_index(char*);
+void rehash_room_index(void);
+room_member* add_room_member(chat_room*, int, char*, int);
+int remove_room_member(chat_room*, int);
+void init_table(slot_table*, size_t, void (*)(void*, int), int, int);
+void* table_slot(slot_table*, int);
+int table_alloc(slot_table*);
+void table_release(slot_table*, int);
+int next_generation(int);
+void init_client_slot(void*, int);
+void init_room_slot(void*, int);
+client* find_client(int);
+chat_room* find_room(int);
+void close_room(chat_room*);
+int validate_password(char*, char*);
+int start_journal(void);
+journal_segment* open_segment(int, int, int);
+journal_segment* roll_segment(void);
+void retire_segment(journal_segment*);
+int reserve_segment(journal_segment*, size_t);
+void journal_append(int, int, int, const char*, size_t, const char*, size_t);
+void journal_room(chat_room*);
+void snapshot_rooms(void);
+void compact_journal(void);
+void remove_compacted_segments(shard*, journal_segment*, int);
+int recover_journal(int);
+int replay_record(journal_record*, char*, int*);
+void* journal_syncer(void*);
+void sync_segment(journal_segment*);
+void remove_old_segments(int);
+int compare_names(const void*, const void*);
+void build_directory(void);
+int compare_entries(const void*, const void*);
+unsigned int journal_checksum(const char*, size_t);
+unsigned int journal_checksum_parts(const char*, size_t, const char*, size_t);
+
+
+shard* shards = NULL;
+int shard_count = 0;
+int connection_count = 0; // Connections of all shards, they are counted for admission control.
+__thread shard* this_shard = NULL; // Shard of the calling thread, NULL for admin and log threads.
+char removed_index_name[] = ""; // Name of removed slots, probing continues over them.
+__thread arena request_arena; // Memory of the command that is handled by shard.
+__thread log_ring* thread_log_ring = NULL; // Log records of the thread.
+log_ring* log_rings = NULL; // Rings of all threads, a ring is added when its thread logs first time.
+spool_write* spool_queue = NULL; // Frames waiting for spool writer, newest first.
+int spool_wake_fd = -1; // Eventfd that is written when a frame is put into empty spool queue.
+FILE* log_file;
+server_options options = {
+    256 * 1024, // high_watermark
+    64 * 1024, // low_watermark
+    POLICY_DISCONNECT, // slow_policy
+    5000, // slow_timeout
+    LOG_INFO, // log_level
+    "deuchat.log", // log_file
+    "deuchat-admin.sock", // admin_socket
+    0, // admin_port
+    60000, // password_timeout
+    0, // shards
+    20, // history
+    "", // data_dir
+    64 * 1024 * 1024, // segment_size
+    10, // sync_interval
+    0, // flush_window
+    16 * 1024, // flush_bytes
+    IO_EPOLL, // io_backend
+    "/tmp", // spool_dir
+    64 * 1024 * 1024, // max_file_size
+    4096, // backlog
+    0, // max_connections
+    0 // connection_rate
+};
+
+const char* reject_replies[] = {"This room name is already in use!", "Room could not be created!", "Room could not found!", "Room is full capacity!", "incorrect_password;Password is not accepted!"};
+const char* busy_reasons[] = {"limit", "rate", "full"};
+const char* reject_results[] = {"Rejected due to unique name constraint", "Rejected because of room limit", "Rejected because of room does not exists", "Rejected because of room is full capacity", "Rejected because of password is not correct"};
+const long long wait_bounds[] = {0, 1000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 50000000, 100000000}; // ns
+const long long depth_bounds[] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096}; // frames
+#define WAIT_BOUNDS         (int)(sizeof(wait_bounds) / sizeof(wait_bounds[0]))
+#define DEPTH_BOUNDS        (int)(sizeof(depth_bounds) / sizeof(depth_bounds[0]))
+histogram histograms[HISTOGRAM_TYPES] = {
+    {"deuchat_shard_message_wait_seconds", "Time a message waits in the inbox of a shard.", wait_bounds, WAIT_BOUNDS, 1e-9},
+    {"deuchat_fanout_duration_seconds", "Time spent giving a broadcast to the shards of all members of a room.", wait_bounds, WAIT_BOUNDS, 1e-9},
+    {"deuchat_outbound_queue_depth", "Frames waiting in outbound queue after a frame is sent to a client.", depth_bounds, DEPTH_BOUNDS, 1}
+};
+int admin_sockets[2] = {-1, -1}; // Unix socket and loopback port.
+
+int main(int argc, char** argv){
 
     int i = 0;
-    if(strcmp(room_name, "") == 0)
-        return -1;
+    int result = 0;
 
-    for(i = 0 ; i < total_room_number ; i++){
-        if(strcmp(room_name, rooms[i].name) == 0){
-            return i;
-        }
+    if(parse_options(argc, argv) != 0)
+        return OPTION_ERR;
+
+    if((i = start_logging()) != 0)
+        return i;
+
+    signal(SIGPIPE, SIG_IGN); // Writing to a closed socket is reported as an error instead of killing the server.
+
+    shard_count = options.shards > 0 ? options.shards : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(shard_count < 1)
+        shard_count = 1;
+    if(shard_count > MAX_SHARDS)
+        shard_count = MAX_SHARDS;
+    if(posix_memalign((void**)&shards, 64, sizeof(shard) * shard_count) != 0){ // Inboxes do not share cache lines.
+        puts("Could not create shards");
+        return THREAD_CREATE_ERR;
     }
+    memset(shards, 0, sizeof(shard) * shard_count);
+    for(i = 0 ; i < shard_count ; i++){
+        if((result = init_shard(&shards[i], i)) != 0)
+            return result;
+    }
+    puts("Socket is binded");
 
-    return -1;
-}
+    if((i = start_journal()) != 0) // Rooms are recovered before clients can connect.
+        return i;
 
-/*
-    Checking socket status for a client.
-    This is really important operation.
-    Program crashes(seg fault) if we try to send
-    data on broken socket. So, we need to
-    check first the status of socket.
-*/
-int check_socket_status(client* cl){
+    if((i = start_spool_writer()) != 0)
+        return i;
 
-    int __fd = cl->socket;
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int retval = getsockopt(__fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if((i = start_admin()) != 0) // Metrics of shards are ready.
+        return i;
 
-    if(cl->connection_flag == DISCONNECTED){
-        return 1;
+    puts("Waiting for incoming connections");
+
+    for(i = 0 ; i < shard_count ; i++){
+        if(pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]) != 0){
+            puts("Could not create thread");
+            return THREAD_CREATE_ERR;
+        }
     }
 
-    if(retval != 0){
-        printf("Error getting socket error code: %s\n", strerror(retval));
-        cl->connection_flag = DISCONNECTED;
-        return 1;
+    for(i = 0 ; i < shard_count ; i++){
+        pthread_join(shards[i].thread, NULL);
     }
 
-    if (error != 0) {
-        printf("Socket error: %s\n", strerror(error));
-        cl->connection_flag = DISCONNECTED;
-        return 1;
+    for(i = 0 ; i < shard_count ; i++){
+        close(shards[i].epoll_fd);
+        close(shards[i].listen_socket);
     }
 
     return 0;
 }
 
+
 /*
-    Checking whether the given customer is in the given room.
+    Opens server socket, epoll instance, eventfd and password timer of a shard.
+    Returns 0 on success.
 */
-int is_room_contain_client(int room_id, int client_id){
-    int i = 0;
-    for(i = 0 ; i < rooms[room_id].client_counter ; i++){
-        if(rooms[room_id].client_ids[i] == client_id){
-            return 1;
+int init_shard(shard* s, int index){
+
+    struct sockaddr_in server;
+    struct epoll_event event;
+    int reuse = 1;
+
+    s->index = index;
+    s->timer_fd = -1;
+    init_table(&s->clients, sizeof(client), init_client_slot, shard_count, index);
+    init_table(&s->rooms, sizeof(chat_room), init_room_slot, shard_count, index);
+    s->directory = (room_directory*)calloc(1, sizeof(room_directory)); // Empty directory, readers never see NULL.
+    s->online = 1;
+
+    // Create Socket
+    s->listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if(s->listen_socket == -1){
+
+        puts("Coult not create socket!");
+        return SOCKET_CREATE_ERR;
+    }
+
+    setsockopt(s->listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(s->listen_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)); // Every shard binds the same port, kernel spreads connections.
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY; // IPv4 local host addr
+    server.sin_port = htons(PORT);
+
+    if(bind(s->listen_socket, (struct sockaddr *)&server, sizeof(server)) < 0){
+        puts("Binding failed");
+        return BINDING_ERR;
+    }
+
+    listen(s->listen_socket, options.backlog); // Shard is started to listen connections on 3205 port. Kernel limits backlog to net.core.somaxconn.
+
+    s->epoll_fd = epoll_create1(0);
+    s->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(s->epoll_fd == -1 || s->wake_fd == -1){
+        puts("Could not create epoll instance");
+        return EPOLL_CREATE_ERR;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u64 = (uint64_t)LISTENER_ID; // Events without a client belong to the server socket.
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_socket, &event);
+    event.data.u64 = (uint64_t)WAKE_ID;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &event);
+
+    if(options.password_timeout > 0){ // Password prompts are checked by shards, no thread sleeps for them.
+        struct itimerspec period = {{TIMER_PERIOD / 1000, (TIMER_PERIOD % 1000) * 1000000}, {TIMER_PERIOD / 1000, (TIMER_PERIOD % 1000) * 1000000}};
+        s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if(s->timer_fd == -1 || timerfd_settime(s->timer_fd, 0, &period, NULL) < 0){
+            puts("Could not create password timer");
+            return TIMER_ERR;
         }
+        event.data.u64 = (uint64_t)TIMER_ID;
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &event);
     }
+
+    if(options.io_backend == IO_URING && init_uring(s) != 0){ // Kernel or headers are too old, epoll is used.
+        printf("Shard %d uses epoll, io_uring is not available\n", index);
+        log_message(LOG_WARN, "Shard %d uses epoll, io_uring is not available", index);
+    }
+
     return 0;
 }
 
 /*
-    Checking given password and creating proper message for client.
+    This function is used by shard threads.
+    Waits for socket events and inbox messages and dispatches them until the server is closed.
+    Epoll does not block while the inbox has messages that the shard sent to itself.
 */
-int validate_password(char* password, char* result_buffer){
+void* shard_loop(void* arg){
 
-    if(strlen(password) < 4){
-        strcpy(result_buffer, "unsuitable_password;Password cannot be shorter than 4 characters!\0");
+    struct epoll_event events[MAX_EVENTS];
+    int event_number = 0;
+    int i = 0;
+    int flush_timeout = -1; // Time (ms) until the next flush window ends, -1 if nothing waits.
+    cpu_set_t cpus;
+
+    this_shard = (shard*)arg;
+    CPU_ZERO(&cpus);
+    CPU_SET(this_shard->index % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); // Shards stay on their cores, it may fail on machines with fewer cores.
+
+    if(this_shard->ring != NULL){
+        uring_loop();
         return 0;
     }
-    else if(strstr(password, " ") != NULL){
-        strcpy(result_buffer, "unsuitable_password;Password cannot contain space character!\0");
+
+    while(1){
+
+        int timeout = __atomic_load_n(&this_shard->inbox, __ATOMIC_ACQUIRE) != NULL ? 0 : flush_timeout;
+        if(timeout != 0) // Shard does not read directories while it sleeps, memory can be freed without waiting for it.
+            __atomic_store_n(&this_shard->online, 0, __ATOMIC_SEQ_CST);
+        event_number = epoll_wait(this_shard->epoll_fd, events, MAX_EVENTS, timeout);
+        __atomic_store_n(&this_shard->online, 1, __ATOMIC_SEQ_CST);
+        if(event_number < 0){
+            if(errno == EINTR)
+                continue;
+            log_message(LOG_ERROR, "Epoll wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for(i = 0 ; i < event_number ; i++){
+            int client_id = (int)events[i].data.u64;
+            if(client_id == LISTENER_ID){ // Server socket is readable, new connections are waiting.
+                accept_connections();
+                continue;
+            }
+            if(client_id == WAKE_ID){ // Another shard put a message into empty inbox.
+                uint64_t wakes;
+                while(read(this_shard->wake_fd, &wakes, sizeof(wakes)) > 0);
+                continue;
+            }
+            if(client_id == TIMER_ID){ // Password deadlines have to be checked.
+                uint64_t expirations;
+                while(read(this_shard->timer_fd, &expirations, sizeof(expirations)) > 0); // Timer is edge-triggered, it is read to be reported again.
+                expire_waiting_clients();
+                arena_reset(&request_arena);
+                continue;
+            }
+            client* cl = find_client(client_id);
+            if(cl == NULL) // Event of a client that is already disconnected.
+                continue;
+            if(events[i].events & EPOLLOUT){ // Socket has space again, waiting frames are written.
+                flush_client(cl);
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+                handle_client(cl);
+            }
+        }
+
+        drain_inbox();
+        flush_timeout = flush_waiting_clients(); // Frames queued in this loop are written together.
+        compact_journal();
+        reclaim_memory();
+    }
+
+    return 0;
+}
+
+/*
+    Accepts all waiting connections of shard when epoll reports the server socket.
+    Server socket is edge-triggered, so it is read until there is no connection left.
+*/
+void accept_connections(void){
+
+    int new_socket;
+
+    while(1){
+
+        new_socket = accept4(this_shard->listen_socket, NULL, NULL, SOCK_NONBLOCK);
+        if(new_socket < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                log_message(LOG_ERROR, "Accept failed: %s", strerror(errno));
+            return;
+        }
+
+        register_client(new_socket);
+    }
+}
+
+/*
+    Decides if a new connection is served. Connections of all shards are counted together against
+    --max-connections. Every shard takes its part of --connection-rate from a token bucket that keeps
+    one second of connections, so a reconnect storm is served at the rate instead of all at once.
+    Returns -1 if connection is admitted, otherwise the reason of rejection.
+*/
+int admit_connection(void){
+
+    if(__atomic_add_fetch(&connection_count, 1, __ATOMIC_RELAXED) > options.max_connections && options.max_connections > 0){
+        __atomic_fetch_sub(&connection_count, 1, __ATOMIC_RELAXED);
+        return BUSY_LIMIT;
+    }
+    if(options.connection_rate > 0){
+        long long now = now_ms();
+        long long cost = 1000LL * shard_count; // Tokens are so small that nothing is lost while refilling.
+        long long capacity = (long long)options.connection_rate * 1000 > cost ? (long long)options.connection_rate * 1000 : cost; // One connection at least.
+        long long elapsed = now - this_shard->tokens_refilled;
+        if(elapsed > 1000000) // Bucket is full after this time, multiplication cannot overflow.
+            elapsed = 1000000;
+        this_shard->accept_tokens += elapsed * options.connection_rate;
+        if(this_shard->accept_tokens > capacity)
+            this_shard->accept_tokens = capacity;
+        this_shard->tokens_refilled = now;
+        if(this_shard->accept_tokens < cost){
+            __atomic_fetch_sub(&connection_count, 1, __ATOMIC_RELAXED);
+            return BUSY_RATE;
+        }
+        this_shard->accept_tokens -= cost;
+    }
+    return -1;
+}
+
+/*
+    Tells a connection that server is busy and closes it. New socket has an empty buffer,
+    so the answer is written at once and the shard does not wait for the client.
+*/
+void reject_connection(int socket, int reason){
+
+    __atomic_fetch_add(&this_shard->metrics.rejected_connections[reason], 1, __ATOMIC_RELAXED);
+    log_message(LOG_DEBUG, "Connection on socket %d is rejected: %s", socket, busy_reasons[reason]);
+    write_client(socket, "server_busy;Server is busy, try again later.");
+    close(socket);
+}
+
+/*
+    Gives an accepted socket a client slot and starts receiving its input,
+    with epoll or with a multishot recv of io_uring.
+*/
+void register_client(int new_socket){
+
+    struct epoll_event event;
+
+    int busy = admit_connection();
+    if(busy != -1){ // Connection is closed before anything is allocated for it.
+        reject_connection(new_socket, busy);
+        return;
+    }
+    log_message(LOG_DEBUG, "New connection on socket %d", new_socket);
+    int nodelay = 1;
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)); // Frames are already coalesced by flush list.
+    int slot = table_alloc(&this_shard->clients);
+    if(slot == -1){ // There is no place for new client.
+        log_message(LOG_WARN, "Connection on socket %d is rejected, server is full", new_socket);
+        __atomic_fetch_sub(&connection_count, 1, __ATOMIC_RELAXED);
+        reject_connection(new_socket, BUSY_FULL);
+        return;
+    }
+    client* cl = (client*)table_slot(&this_shard->clients, slot); // Slot already has a new identity for client.
+    cl->socket = new_socket; // Socket number is used to send message to the client.
+    cl->location = LOCATION_LOBBY;
+    cl->room_id = -1; // Client is not in a room yet.
+    cl->connection_flag = ALIVE;
+    cl->compact = 0;
+    __atomic_fetch_add(&this_shard->metrics.accepted_connections, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&this_shard->metrics.active_connections, 1, __ATOMIC_RELAXED);
+    cl->state = STATE_NICKNAME;
+    cl->nickname = NULL;
+    cl->pending_room_name = NULL;
+    cl->pending_password = NULL;
+    frame_decoder_init(&cl->decoder);
+    cl->queue = NULL;
+    cl->queue_capacity = 0;
+    cl->queue_head = 0;
+    cl->queue_count = 0;
+    cl->queue_offset = 0;
+    cl->queued_bytes = 0;
+    cl->slow_since = 0;
+    cl->evicted = 0;
+    cl->dropped_frames = 0;
+    cl->flush_at = 0;
+    cl->flush_listed = 0; // Old entry of the slot in flush list has the old id.
+    cl->blocked = 0;
+    cl->send_request = NULL;
+    cl->files = NULL;
+    cl->last_file = NULL;
+    cl->file_count = 0;
+    cl->upload = NULL;
+    cl->upload_remaining = 0;
+    cl->upload_chunk = NULL;
+    cl->spool_waiting = 0;
+
+    send_client(cl, "Welcome to the DEUCHAT\n");
+    send_client(cl, "Enter your nickname: ");
+
+    if(this_shard->ring != NULL){
+        uring_arm(URING_RECV, new_socket, cl->id);
+        return;
+    }
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = (uint64_t)cl->id;
+    epoll_ctl(this_shard->epoll_fd, EPOLL_CTL_ADD, new_socket, &event); // Input that is already waiting is reported immediately.
+}
+
+#ifdef URING_SUPPORTED
+
+/*
+    Creates the io_uring instance of shard, maps its rings and registers provided buffers for multishot recv.
+    Returns 0 on success, -1 if the kernel does not support what the backend needs (Linux 6.0).
+*/
+int init_uring(shard* s){
+
+    struct io_uring_params params;
+    struct io_uring_buf_reg registration;
+    struct utsname system;
+    int major = 0;
+    int minor = 0;
+    int i = 0;
+
+    if(uname(&system) != 0 || sscanf(system.release, "%d.%d", &major, &minor) != 2 || major < 6) // Multishot recv needs 6.0.
+        return -1;
+
+    uring* r = (uring*)calloc(1, sizeof(uring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(r->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)){
+        if(r->fd >= 0)
+            close(r->fd);
+        free(r);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char* rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(rings == MAP_FAILED || r->sqes == MAP_FAILED){
+        close(r->fd);
+        free(r);
+        return -1;
+    }
+    r->sq_head = (unsigned*)(rings + params.sq_off.head);
+    r->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    r->sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    unsigned* sq_array = (unsigned*)(rings + params.sq_off.array);
+    for(i = 0 ; i < (int)params.sq_entries ; i++) // Entry n is always at slot n.
+        sq_array[i] = i;
+    r->cq_head = (unsigned*)(rings + params.cq_off.head);
+    r->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    r->cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    if(posix_memalign((void**)&r->buffers, sysconf(_SC_PAGESIZE), URING_BUFFERS * sizeof(struct io_uring_buf)) != 0){
+        close(r->fd);
+        free(r);
+        return -1;
+    }
+    memset(r->buffers, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)r->buffers;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0){ // Provided buffer rings need 5.19.
+        close(r->fd); // Closing the instance also unmaps its rings.
+        free(r->buffers);
+        free(r);
+        return -1;
+    }
+    r->buffer_memory = (char*)malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+
+    for(i = 0 ; i < URING_BUFFERS ; i++)
+        recycle_buffer(r, i);
+    s->ring = r;
+
+    return 0;
+}
+
+/*
+    Event loop of a shard that uses io_uring. Server socket, inbox eventfd and timer are armed once
+    with multishot operations. Entries prepared while completions and inbox are handled
+    (recv of new clients, sends of the flush list) are submitted together with the next wait.
+*/
+void uring_loop(void){
+
+    int flush_timeout = -1;
+
+    uring_arm(URING_ACCEPT, this_shard->listen_socket, LISTENER_ID);
+    uring_arm(URING_POLL, this_shard->wake_fd, WAKE_ID);
+    if(this_shard->timer_fd != -1)
+        uring_arm(URING_POLL, this_shard->timer_fd, TIMER_ID);
+
+    while(1){
+
+        int timeout = __atomic_load_n(&this_shard->inbox, __ATOMIC_ACQUIRE) != NULL ? 0 : flush_timeout;
+        if(timeout != 0)
+            __atomic_store_n(&this_shard->online, 0, __ATOMIC_SEQ_CST);
+        if(uring_enter(timeout) < 0){
+            __atomic_store_n(&this_shard->online, 1, __ATOMIC_SEQ_CST);
+            log_message(LOG_ERROR, "io_uring wait failed: %s", strerror(errno));
+            break;
+        }
+        __atomic_store_n(&this_shard->online, 1, __ATOMIC_SEQ_CST);
+
+        handle_completions();
+        drain_inbox();
+        flush_timeout = flush_waiting_clients();
+        compact_journal();
+        reclaim_memory();
+    }
+}
+
+/*
+    Returns the next submission queue entry, zero filled. Prepared entries are submitted if the queue is full.
+*/
+struct io_uring_sqe* uring_sqe(void){
+
+    uring* r = this_shard->ring;
+    if(r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries)
+        uring_enter(0);
+
+    struct io_uring_sqe* sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    r->sq_local_tail += 1;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+    Submits prepared entries. Waits for a completion if timeout is not 0, -1 waits without a limit.
+    Returns 0 on success and -1 on error.
+*/
+int uring_enter(int timeout){
+
+    uring* r = this_shard->ring;
+    struct io_uring_getevents_arg argument;
+    struct __kernel_timespec time;
+    unsigned flags = 0;
+    int result = 0;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned pending = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if(timeout == 0 && pending == 0)
+        return 0;
+
+    memset(&argument, 0, sizeof(argument));
+    if(timeout > 0){
+        time.tv_sec = timeout / 1000;
+        time.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        argument.ts = (uint64_t)(uintptr_t)&time;
+    }
+    if(timeout != 0)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    do{
+        result = syscall(__NR_io_uring_enter, r->fd, pending, timeout != 0 ? 1 : 0, flags | IORING_ENTER_EXT_ARG, &argument, sizeof(argument));
+    }while(result < 0 && errno == EINTR);
+
+    if(result < 0 && (errno == ETIME || errno == EBUSY || errno == EAGAIN)) // Timeout or completions have to be handled first.
+        return 0;
+    return result < 0 ? -1 : 0;
+}
+
+/*
+    Prepares a multishot operation: accept on server socket, recv into provided buffers or poll.
+*/
+void uring_arm(int operation, int fd, int id){
+
+    struct io_uring_sqe* sqe = uring_sqe();
+    sqe->fd = fd;
+    sqe->user_data = uring_data(operation, id);
+    if(operation == URING_ACCEPT){
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+    }
+    else if(operation == URING_RECV){
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+    }
+    else{
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+}
+
+/*
+    Prepares a sendmsg for waiting frames of client. A client has one sendmsg at a time,
+    the rest of the queue is sent when it is completed. Sends of all clients are submitted together.
+    Files are written with sendfile like epoll does, io_uring only reports when a full socket is writable.
+*/
+void uring_write_queue(client* cl){
+
+    uring* r = this_shard->ring;
+    if(cl->send_request != NULL || cl->blocked)
+        return;
+    while(cl->files != NULL && (cl->queue_count == 0 || cl->files->offset != cl->files->frame_end)){
+        if(!write_file(cl)){
+            if(cl->blocked)
+                uring_poll_writable(cl);
+            return;
+        }
+    }
+    if(cl->queue_count == 0)
+        return;
+
+    uring_send* send = r->free_sends;
+    if(send != NULL)
+        r->free_sends = send->next;
+    else
+        send = (uring_send*)malloc(sizeof(uring_send));
+
+    send->frame_count = 0;
+    while(send->frame_count < cl->queue_count && send->frame_count < MAX_IOVEC){
+        shared_frame* frame = cl->queue[(cl->queue_head + send->frame_count) % cl->queue_capacity].frame;
+        size_t offset = send->frame_count == 0 ? cl->queue_offset : 0;
+        retain_frame(frame); // Frame stays valid even if client is disconnected before the kernel completes.
+        send->frames[send->frame_count] = frame;
+        send->parts[send->frame_count].iov_base = frame->data + offset;
+        send->parts[send->frame_count].iov_len = frame->length - offset;
+        send->frame_count += 1;
+    }
+    memset(&send->message, 0, sizeof(send->message));
+    send->message.msg_iov = send->parts;
+    send->message.msg_iovlen = send->frame_count;
+    send->client_id = cl->id;
+
+    struct io_uring_sqe* sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = cl->socket;
+    sqe->addr = (uint64_t)(uintptr_t)&send->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // Kernel keeps sending until everything is written.
+    sqe->user_data = (uint64_t)(uintptr_t)send | URING_SEND;
+    cl->send_request = send;
+    __atomic_fetch_add(&this_shard->metrics.socket_writes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Prepares a one shot poll that reports when the socket of client has space again.
+*/
+void uring_poll_writable(client* cl){
+
+    struct io_uring_sqe* sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = cl->socket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = uring_data(URING_WRITABLE, cl->id);
+}
+
+/*
+    Handles a completed sendmsg. Written frames leave the queue and the rest of the queue is sent.
+*/
+void finish_send(uring_send* send, int result){
+
+    client* cl = find_client(send->client_id);
+    int i = 0;
+
+    if(cl != NULL && cl->send_request == send){
+        cl->send_request = NULL;
+        if(result < 0){ // Socket is broken, recv ends and client is disconnected.
+            cl->connection_flag = DISCONNECTED;
+            shutdown(cl->socket, SHUT_RDWR);
+        }
+        else{
+            remove_written(cl, result);
+            if(cl->connection_flag == ALIVE && !cl->evicted)
+                uring_write_queue(cl);
+        }
+    }
+
+    for(i = 0 ; i < send->frame_count ; i++)
+        release_frame(send->frames[i]);
+    send->next = this_shard->ring->free_sends;
+    this_shard->ring->free_sends = send;
+}
+
+/*
+    Handles every completion that is waiting: new connections, received data, completed sends and
+    readable eventfd or timer. A multishot operation that ends without an error is armed again.
+*/
+void handle_completions(void){
+
+    uring* r = this_shard->ring;
+    unsigned head = *r->cq_head;
+
+    while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+
+        struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+        uint64_t data = cqe->user_data;
+        int result = cqe->res;
+        unsigned flags = cqe->flags;
+        head += 1;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE); // Entry is copied, kernel can use its place.
+
+        int operation = (int)(data & URING_OP_MASK);
+        int id = (int)(data >> 32);
+        if(operation == URING_SEND){
+            finish_send((uring_send*)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK), result);
+        }
+        else if(operation == URING_ACCEPT){
+            if(result >= 0)
+                register_client(result);
+            else if(result != -EAGAIN && result != -EINTR)
+                log_message(LOG_ERROR, "Accept failed: %s", strerror(-result));
+            if(!(flags & IORING_CQE_F_MORE))
+                uring_arm(URING_ACCEPT, this_shard->listen_socket, LISTENER_ID);
+        }
+        else if(operation == URING_POLL){
+            uint64_t count;
+            if(id == WAKE_ID){ // Another shard put a message into empty inbox.
+                while(read(this_shard->wake_fd, &count, sizeof(count)) > 0);
+            }
+            else{ // Password deadlines have to be checked.
+                while(read(this_shard->timer_fd, &count, sizeof(count)) > 0);
+                expire_waiting_clients();
+                arena_reset(&request_arena);
+            }
+            if(!(flags & IORING_CQE_F_MORE))
+                uring_arm(URING_POLL, id == WAKE_ID ? this_shard->wake_fd : this_shard->timer_fd, id);
+        }
+        else if(operation == URING_RECV){
+            receive_buffer(id, result, flags);
+        }
+        else if(operation == URING_WRITABLE){
+            client* cl = find_client(id);
+            if(cl != NULL && cl->socket != -1)
+                flush_client(cl);
+        }
+    }
+}
+
+/*
+    Handles a completion of multishot recv. Received bytes are copied into the decoder of client
+    and the buffer goes back to the ring at once. Recv is armed again if it ended because buffers ran out.
+*/
+void receive_buffer(int client_id, int result, unsigned flags){
+
+    client* cl = find_client(client_id);
+    if(cl != NULL && cl->socket == -1)
+        cl = NULL;
+
+    if(result > 0 && (flags & IORING_CQE_F_BUFFER)){
+        int buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cl != NULL){
+            char* data = this_shard->ring->buffer_memory + (size_t)buffer * URING_BUFFER_SIZE;
+            size_t copied = 0;
+            while(copied < (size_t)result){
+                size_t space = 0;
+                char* place = frame_decoder_space(&cl->decoder, &space);
+                size_t part = (size_t)result - copied < space ? (size_t)result - copied : space;
+                memcpy(place, data + copied, part);
+                frame_decoder_commit(&cl->decoder, part);
+                copied += part;
+            }
+        }
+        recycle_buffer(this_shard->ring, buffer);
+        if(cl != NULL)
+            handle_client(cl);
+        if(cl != NULL && cl->socket == -1) // Client is disconnected while its commands were handled.
+            cl = NULL;
+    }
+
+    if(cl == NULL || (flags & IORING_CQE_F_MORE))
+        return;
+    if(result == -ENOBUFS || result > 0){
+        uring_arm(URING_RECV, cl->socket, cl->id);
+    }
+    else{ // Connection is closed by client or broken.
+        disconnect_client(cl);
+    }
+}
+
+/*
+    Gives a provided buffer back to the kernel.
+*/
+void recycle_buffer(uring* r, int buffer){
+
+    struct io_uring_buf* entry = &r->buffers->bufs[r->buffer_tail & (URING_BUFFERS - 1)];
+    entry->addr = (uint64_t)(uintptr_t)(r->buffer_memory + (size_t)buffer * URING_BUFFER_SIZE);
+    entry->len = URING_BUFFER_SIZE;
+    entry->bid = buffer;
+    r->buffer_tail += 1;
+    __atomic_store_n(&r->buffers->tail, r->buffer_tail, __ATOMIC_RELEASE);
+}
+
+#else
+
+int init_uring(shard* s){ (void)s; return -1; } // Headers do not have the io_uring interface, only epoll is available.
+void uring_loop(void){}
+struct io_uring_sqe* uring_sqe(void){ return NULL; }
+int uring_enter(int timeout){ (void)timeout; return 0; }
+void uring_arm(int operation, int fd, int id){ (void)operation; (void)fd; (void)id; }
+void uring_write_queue(client* cl){ (void)cl; }
+void finish_send(uring_send* send, int result){ (void)send; (void)result; }
+void handle_completions(void){}
+void receive_buffer(int client_id, int result, unsigned flags){ (void)client_id; (void)result; (void)flags; }
+void uring_poll_writable(client* cl){ (void)cl; }
+void recycle_buffer(uring* r, int buffer){ (void)r; (void)buffer; }
+
+#endif
+
+/*
+    Processes every complete frame of client and reads all waiting input.
+    Client socket is edge-triggered, so it is read until there is no data left.
+    Nothing is processed or read while client waits for another shard,
+    the shard calls this function again when the answer arrives.
+*/
+void handle_client(client* cl){
+
+    char* client_message = NULL;
+    size_t space = 0;
+    size_t length = 0;
+    int bytes_read = 0;
+    int frame_status = 0;
+
+    while(cl->socket != -1){
+
+        while(cl->socket != -1 && cl->state != STATE_WAITING_ROOM && !cl->spool_waiting && (frame_status = frame_decoder_next(&cl->decoder, &client_message, &length)) == 1){
+            if(cl->upload_remaining > 0 && length >= FILE_DATA_PREFIX_LENGTH && memcmp(client_message, FILE_DATA_PREFIX, FILE_DATA_PREFIX_LENGTH) == 0) // Part of an upload, it can contain any byte.
+                receive_upload(cl, client_message + FILE_DATA_PREFIX_LENGTH, length - FILE_DATA_PREFIX_LENGTH);
+            else
+                process_message(cl, client_message);
+            arena_reset(&request_arena); // Nothing of the command is needed anymore.
+        }
+        if(frame_status == FRAME_ERR){ // Client does not follow the protocol.
+            log_action(LOG_WARN, cl, "Sent a frame", "Rejected because of frame is too long");
+            disconnect_client(cl);
+        }
+        if(cl->socket == -1 || cl->state == STATE_WAITING_ROOM || cl->spool_waiting)
+            break;
+        if(this_shard->ring != NULL) // Input is received by multishot recv, not read here.
+            break;
+
+        char* buffer = frame_decoder_space(&cl->decoder, &space);
+        bytes_read = recv(cl->socket, buffer, space, MSG_DONTWAIT);
+        if(bytes_read > 0){
+            frame_decoder_commit(&cl->decoder, bytes_read);
+        }
+        else if(bytes_read < 0 && errno == EINTR){
+            continue;
+        }
+        else if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            break; // All data is read.
+        }
+        else{ // Connection is closed by client or broken.
+            disconnect_client(cl);
+        }
+    }
+}
+
+/*
+    Handles a message of client according to state of client.
+*/
+void process_message(client* cl, char* client_message){
+
+    if(cl->state == STATE_NICKNAME){
+        cl->nickname = (char*)malloc(sizeof(char) * (strlen(client_message) + 1));
+        strcpy(cl->nickname, client_message); // A nickname is assigned to client.
+        cl->state = STATE_COMMAND;
+        send_client(cl, arena_printf(&request_arena, "login_success;%d;%s", cl->id, cl->nickname)); // Informs client, client is in lobby now and server is ready to execute commands coming from client.
+    }
+    else if(cl->state == STATE_SET_PASSWORD){
+        set_room_password(cl, client_message);
+    }
+    else if(cl->state == STATE_CONFIRM_PASSWORD){
+        confirm_room_password(cl, client_message);
+    }
+    else if(cl->state == STATE_ENTER_PASSWORD){
+        check_room_password(cl, client_message);
+    }
+    else{
+        execute_command(cl, client_message);
+    }
+}
+
+/*
+    Executes a command coming from client.
+    Commands about rooms are sent to the shard of room, client waits for its answer.
+*/
+void execute_command(client* cl, char* client_message){
+
+    char** splitted = split(client_message, ' ');
+    if(strcmp(splitted[0], "-list") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_LIST], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_LOBBY){ // Client can list rooms, only if he/she in lobby
+            int page = 1;
+            char* prefix = splitted[1];
+            char* end = NULL;
+            long number = strtol(prefix, &end, 10);
+            if(end != prefix && (*end == ' ' || *end == '\0')){ // First word is page number, rest is prefix.
+                page = number < 1 ? 1 : number > INT_MAX / LIST_PAGE_SIZE ? INT_MAX / LIST_PAGE_SIZE : (int)number;
+                prefix = trim(end);
+            }
+            send_client(cl, list_rooms(cl, page, prefix)); // Sending room list to client.
+        }
+        else { // Client is not in lobby, so he/she can not list rooms.
+            log_action(LOG_INFO, cl, "Attempted to list rooms", "Rejected because of user is not in lobby");
+            send_client(cl, "You have to be in lobby to list rooms!");
+        }
+    }
+    else if(strcmp(splitted[0], "-create") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_CREATE], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_LOBBY){ // Client can create room, only if he/she is in lobby.
+            if(strcmp(splitted[1], "") == 0){ // Empty room name is not acceptable.
+                send_client(cl, "This room name is not valid!");
+                log_action(LOG_INFO, cl, "Attempted to create a room", "Rejected because of user name is not valid");
+                return;
+            }
+            shard_message* message = create_message(SHARD_CREATE, cl->id, -1, splitted[1], cl->nickname, NULL, 0);
+            message->value = ROOM_TYPE_PUBLIC;
+            request_room(cl, room_shard(splitted[1]), message, "Attempted to create a room"); // Uniqueness of name is checked by shard of room.
+        }
+        else{ // Client is not in lobby, so he/she cannot create room.
+            log_action(LOG_INFO, cl, "Attempted to create a room", "Rejected because of user is not in lobby");
+            send_client(cl, "You have to be in lobby to create room!");
+        }
+
+    }
+    else if(strcmp(splitted[0], "-pcreate") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_PCREATE], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_LOBBY){ // Client can create private room, only if he/she is in lobby.
+            if(strcmp(splitted[1], "") == 0){ // Empty room name is not acceptable.
+                send_client(cl, "This room name is not valid!");
+                log_action(LOG_INFO, cl, "Attempted to create a room", "Rejected because of user name is not valid");
+                return;
+            }
+            /*
+                Room name is reserved until the client chooses a valid password for room.
+                This operation can take much time because of client.
+                So, client waits in STATE_SET_PASSWORD and shard continues with another clients.
+                But another clients should not create room with same name. Therefore, room name is reserved.
+                Reserved names are kept in the room name index of room shard, so they are checked like room names.
+                Name is released if the client does not answer in password timeout.
+            */
+            shard_message* message = create_message(SHARD_RESERVE, cl->id, -1, splitted[1], NULL, NULL, 0);
+            request_room(cl, room_shard(splitted[1]), message, "Attempted to create a room");
+        }
+        else{ // Client is not in lobby.
+            log_action(LOG_INFO, cl, "Attempted to create a room\0", "Rejected because of user is not in lobby\0");
+            send_client(cl, "You have to be in lobby to create room!\0");
+        }
+    }
+    else if(strcmp(splitted[0], "-enter") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_ENTER], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_LOBBY){ // Client can enter into room, only if he/she is in lobby.
+            shard_message* message = create_message(SHARD_ENTER, cl->id, -1, splitted[1], cl->nickname, NULL, 0);
+            request_room(cl, room_shard(splitted[1]), message, "Attempted to enter a room"); // Shard of room asks password for private rooms.
+        }
+        else{ // Client is not in lobby. So, he/she can enter a room.
+            log_action(LOG_INFO, cl, "Attempted to enter a room", "Rejected because of user is not in lobby");
+            send_client(cl, "You have to be in lobby to enter a room!");
+        }
+    }
+    else if(strcmp(splitted[0], "-quit") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_QUIT], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_ROOM){ // Client has to be in a room to quit.
+            post_message(id_shard(cl->room_id), create_message(SHARD_LEAVE, cl->id, cl->room_id, NULL, NULL, NULL, 0));
+            cancel_upload(cl); // File would be shared with a room that client left.
+            cl->location = LOCATION_LOBBY; // Client is in lobby now.
+            cl->room_id = -1; // Frames of room that are still on the way are not sent.
+            char* message = arena_printf(&request_arena, "login_success;%d;%s", cl->id, cl->nickname);
+            send_client(cl, message); // Informing client, he/she entered to lobby.
+        }
+        else{
+            log_action(LOG_INFO, cl, "Attempted to quit from a room", "Rejected because of user is not in a room\0");
+            send_client(cl, "You have to be in a room to quit from a room!\0");
+        }
+    }
+    else if(strcmp(splitted[0], "-msg") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_MSG], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_ROOM){ // Client has to be in room to send message.
+            shard_message* message = create_message(SHARD_MESSAGE, cl->id, cl->room_id, NULL, NULL, NULL, 0);
+            message->frame = create_frame("new_message;%s;%s", cl->nickname, splitted[1]); // Message is encoded once for all clients.
+            message->value = FRAME_KIND_MESSAGE;
+            post_message(id_shard(cl->room_id), message); // Shard of room knows the members.
+        }
+        else{
+            log_action(LOG_INFO, cl, "Attempted to send a message", "Rejected because of user is not in room\0");
+            send_client(cl, "You have to be in room to send a message!\0");
+        }
+    }
+    else if(strcmp(splitted[0], "-send") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_SEND], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_ROOM){ // Files are shared with the room that client is in.
+            char** arguments = split(splitted[1], ' ');
+            start_upload(cl, arguments[0], arguments[1]);
+        }
+        else{
+            log_action(LOG_INFO, cl, "Attempted to send a file", "Rejected because of user is not in a room");
+            send_client(cl, "send_rejected;You have to be in a room to send a file!");
+        }
+    }
+    else if(strcmp(splitted[0], "-history") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_HISTORY], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_ROOM){ // History size can be changed only by clients in the room.
+            char* end = NULL;
+            long size = strtol(splitted[1], &end, 10);
+            if(end == splitted[1] || *end != '\0' || size < 0 || size > HISTORY_LIMIT){
+                send_client(cl, arena_printf(&request_arena, "History size has to be between 0 and %d!", HISTORY_LIMIT));
+                return;
+            }
+            shard_message* message = create_message(SHARD_HISTORY, cl->id, cl->room_id, NULL, NULL, NULL, 0);
+            message->value = (int)size;
+            post_message(id_shard(cl->room_id), message);
+            send_client(cl, arena_printf(&request_arena, "Room keeps last %ld messages now.", size));
+            log_action(LOG_INFO, cl, "Changed history size of room", "Successful");
+        }
+        else{
+            log_action(LOG_INFO, cl, "Attempted to change history size", "Rejected because of user is not in a room");
+            send_client(cl, "You have to be in a room to change history size!");
+        }
+    }
+    else if(strcmp(splitted[0], "-compact") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_COMPACT], 1, __ATOMIC_RELAXED);
+        if(cl->location == LOCATION_LOBBY){ // Member ids are announced when client enters a room, so mode changes in lobby.
+            cl->compact = 1; // Nothing is answered, next room frames show the mode.
+            log_action(LOG_DEBUG, cl, "Asked for compact frames", "Successful");
+        }
+        else{
+            log_action(LOG_INFO, cl, "Asked for compact frames", "Rejected because of user is not in lobby");
+            send_client(cl, "You have to be in lobby to use compact frames!");
+        }
+    }
+    else if(strcmp(splitted[0], "-whoami") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_WHOAMI], 1, __ATOMIC_RELAXED);
+        send_client(cl, cl->nickname);
+    }
+    else if(strcmp(splitted[0], "-exit") == 0){
+        __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_EXIT], 1, __ATOMIC_RELAXED);
+        log_action(LOG_INFO, cl, "Attempted to exit", "Successful");
+        disconnect_client(cl);
+    }
+    else{ // Unknown command
+        if(cl->location == LOCATION_ROOM){ // Unknown commands are messages if the client in room. Sending message all clients in the same room.
+            __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_MESSAGE], 1, __ATOMIC_RELAXED);
+            shard_message* message = create_message(SHARD_MESSAGE, cl->id, cl->room_id, NULL, NULL, NULL, 0);
+            message->frame = create_frame("new_message;%s;%s", cl->nickname, client_message);
+            message->value = FRAME_KIND_MESSAGE;
+            post_message(id_shard(cl->room_id), message);
+        }
+        else{
+            __atomic_fetch_add(&this_shard->metrics.commands[COMMAND_INVALID], 1, __ATOMIC_RELAXED);
+            send_client(cl, "Invalid command!");
+        }
+    }
+}
+
+/*
+    Starts an upload of client. Announcement of the file is written into a new spool file
+    and client is told to send the file, data frames follow the announcement in spool file.
+*/
+void start_upload(client* cl, char* size_text, char* name){
+
+    char* end = NULL;
+    unsigned long long size = strtoull(size_text, &end, 10);
+    if(end == size_text || *end != '\0' || size == 0 || strcmp(name, "") == 0 || strchr(name, '/') != NULL || strchr(name, ';') != NULL){
+        send_client(cl, "send_rejected;File could not be sent!");
+        return;
+    }
+    if(size > options.max_file_size){
+        log_action(LOG_INFO, cl, "Attempted to send a file", "Rejected because of file is too large");
+        send_client(cl, arena_printf(&request_arena, "send_rejected;File cannot be larger than %zu bytes!", options.max_file_size));
+        return;
+    }
+    if(cl->upload != NULL || cl->upload_remaining > 0){ // Client uploads one file at a time.
+        send_client(cl, "send_rejected;Another file is being sent!");
+        return;
+    }
+
+    char* path = arena_printf(&request_arena, "%s/deuchat-spool-XXXXXX", options.spool_dir);
+    int fd = mkstemp(path);
+    if(fd == -1){
+        log_message(LOG_ERROR, "Spool file could not be created in %s: %s", options.spool_dir, strerror(errno));
+        send_client(cl, "send_rejected;File could not be sent!");
+        return;
+    }
+    unlink(path); // Spool file lives until the last client it is streamed to releases it.
+
+    shared_frame* announcement = create_frame("file;%s;%s;%llu", cl->nickname, name, size);
+    shared_file* file = (shared_file*)calloc(1, sizeof(shared_file));
+    file->reference_counter = 1;
+    file->fd = fd;
+    file->first_length = announcement->length;
+    file->frame_length = FRAME_HEADER_SIZE + FILE_DATA_PREFIX_LENGTH + FILE_CHUNK_SIZE;
+
+    cl->upload = file;
+    cl->upload_remaining = size;
+    cl->upload_chunk = (char*)malloc(FILE_CHUNK_SIZE);
+    memcpy(cl->upload_chunk, announcement->data, announcement->length); // Announcement is the first frame of spool file.
+    cl->upload_chunk_length = announcement->length;
+    write_upload_chunk(cl, 0);
+    release_frame(announcement);
+    send_client(cl, arena_printf(&request_arena, "send_ready;%s", name)); // Client streams the file after this answer.
+    log_action(LOG_INFO, cl, "Started to send a file", name);
+}
+
+/*
+    Adds received bytes of a file to the upload of client. Bytes are spooled in data frames of
+    the same size, so a frame of file ends at a known offset. Spool writer tells the shard
+    when the complete file is written.
+*/
+void receive_upload(client* cl, char* data, size_t length){
+
+    if(length > cl->upload_remaining){
+        log_action(LOG_WARN, cl, "Sent a file", "Rejected because of file is longer than its size");
+        cl->upload_remaining = 0;
+        if(cl->upload != NULL){
+            cancel_upload(cl);
+            send_client(cl, "send_rejected;File is longer than its size!");
+        }
+        return;
+    }
+    cl->upload_remaining -= length;
+    if(cl->upload == NULL) // Upload is rejected or cancelled, rest of the file is ignored.
+        return;
+
+    while(length > 0){
+        size_t part = FILE_CHUNK_SIZE - cl->upload_chunk_length;
+        if(part > length)
+            part = length;
+        memcpy(cl->upload_chunk + cl->upload_chunk_length, data, part);
+        cl->upload_chunk_length += part;
+        data += part;
+        length -= part;
+        if(cl->upload_chunk_length == FILE_CHUNK_SIZE)
+            write_upload_chunk(cl, cl->upload_remaining == 0 && length == 0);
+    }
+    if(cl->upload_remaining == 0 && cl->upload_chunk != NULL) // Last frame of file is shorter.
+        write_upload_chunk(cl, 1);
+    if(cl->upload == NULL || cl->upload_remaining == 0)
+        return;
+
+    shared_file* file = cl->upload;
+    if(__atomic_load_n(&file->spool_pending, __ATOMIC_SEQ_CST) < SPOOL_PENDING_LIMIT)
+        return;
+    __atomic_store_n(&file->spool_paused, 1, __ATOMIC_SEQ_CST); // Disk is slower than client, its input waits.
+    if(__atomic_load_n(&file->spool_pending, __ATOMIC_SEQ_CST) > SPOOL_RESUME_LEVEL)
+        cl->spool_waiting = 1;
+    else
+        __atomic_store_n(&file->spool_paused, 0, __ATOMIC_SEQ_CST); // Writer caught up before it could see the flag.
+}
+
+/*
+    Queues waiting bytes of upload for spool writer as one frame. The announcement is queued as
+    it is, file bytes are queued as a data frame. The chunk of client is freed after the last frame.
+*/
+void write_upload_chunk(client* cl, int last){
+
+    shared_file* file = cl->upload;
+    int announcement = file->size == 0;
+    size_t header = announcement ? 0 : FRAME_HEADER_SIZE + FILE_DATA_PREFIX_LENGTH;
+    spool_write* queued = (spool_write*)malloc(sizeof(spool_write) + header + cl->upload_chunk_length);
+
+    if(!announcement){
+        frame_encode_header(queued->data, FILE_DATA_PREFIX_LENGTH + cl->upload_chunk_length);
+        memcpy(queued->data + FRAME_HEADER_SIZE, FILE_DATA_PREFIX, FILE_DATA_PREFIX_LENGTH);
+    }
+    memcpy(queued->data + header, cl->upload_chunk, cl->upload_chunk_length);
+    queued->length = header + cl->upload_chunk_length;
+    queued->file = file;
+    queued->client_id = cl->id;
+    queued->shard = this_shard->index;
+    queued->last = last;
+    retain_file(file);
+    file->size += queued->length; // Frames are written in the order they are queued.
+    __atomic_add_fetch(&file->spool_pending, 1, __ATOMIC_SEQ_CST);
+    cl->upload_chunk_length = 0;
+    if(last){
+        free(cl->upload_chunk);
+        cl->upload_chunk = NULL;
+    }
+
+    spool_write* head = __atomic_load_n(&spool_queue, __ATOMIC_RELAXED);
+    do{
+        queued->next = head;
+    }while(!__atomic_compare_exchange_n(&spool_queue, &head, queued, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(head == NULL){
+        uint64_t wake = 1;
+        if(write(spool_wake_fd, &wake, sizeof(wake)) < 0) // Counter cannot overflow, writer is already awake if it fails.
+            return;
+    }
+}
+
+/*
+    Drops the upload of client, spooled part of the file is removed when spool writer releases it.
+*/
+void cancel_upload(client* cl){
+
+    if(cl->upload == NULL)
+        return;
+    release_file(cl->upload);
+    cl->upload = NULL;
+    free(cl->upload_chunk);
+    cl->upload_chunk = NULL;
+}
+
+/*
+    Handles a message of spool writer about the upload of a client. A complete file is sent to
+    the shard of room, input of a client that waited for the writer is read again.
+*/
+void spooled_upload(shard_message* message){
+
+    client* cl = find_client(message->client_id);
+    if(cl == NULL || cl->upload != message->file) // Client disconnected or the upload was cancelled.
+        return;
+
+    if(message->value == SPOOL_FAILED){
+        cancel_upload(cl);
+        send_client(cl, "send_rejected;File could not be sent!");
+        log_action(LOG_WARN, cl, "Sent a file", "Rejected because of spool file could not be written");
+    }
+    else if(message->value == SPOOL_DONE){
+        shard_message* request = create_message(SHARD_FILE, cl->id, cl->room_id, NULL, NULL, NULL, 0);
+        request->file = cl->upload; // Reference of upload is given to the message.
+        cl->upload = NULL;
+        post_message(id_shard(cl->room_id), request);
+        __atomic_fetch_add(&this_shard->metrics.file_uploads, 1, __ATOMIC_RELAXED);
+        send_client(cl, "File is shared with the room.");
+        log_action(LOG_INFO, cl, "Sent a file", "Successful");
+    }
+    if(cl->spool_waiting){ // Writer caught up or the rest of the file is ignored.
+        cl->spool_waiting = 0;
+        handle_client(cl);
+    }
+}
+
+/*
+    Creates the eventfd and thread of spool writer.
+    Returns 0 on success.
+*/
+int start_spool_writer(void){
+
+    pthread_t writer;
+
+    spool_wake_fd = eventfd(0, 0);
+    if(spool_wake_fd == -1){
+        puts("Could not create spool writer");
+        return THREAD_CREATE_ERR;
+    }
+    if(pthread_create(&writer, NULL, spool_writer, NULL) != 0){
+        puts("Could not create thread");
+        return THREAD_CREATE_ERR;
+    }
+    pthread_detach(writer);
+
+    return 0;
+}
+
+/*
+    This function is used by spool writer thread.
+    Writes queued frames of uploads into their spool files in the order they are queued,
+    so shards never wait for the disk.
+*/
+void* spool_writer(void* arg){
+
+    while(1){
+        uint64_t wakes;
+        if(read(spool_wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EINTR)
+            break;
+
+        spool_write* queued = __atomic_exchange_n(&spool_queue, NULL, __ATOMIC_ACQUIRE);
+        spool_write* ordered = NULL;
+        while(queued != NULL){ // Queue is newest first, it is reversed.
+            spool_write* next = queued->next;
+            queued->next = ordered;
+            ordered = queued;
+            queued = next;
+        }
+        while(ordered != NULL){
+            spool_write* next = ordered->next;
+            write_spool(ordered);
+            ordered = next;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes a frame into its spool file and tells the shard of sender when the file is complete,
+    when it cannot be written, or when a paused sender can continue.
+*/
+void write_spool(spool_write* queued){
+
+    shared_file* file = queued->file;
+    int result = -1;
+
+    if(!file->spool_failed && write(file->fd, queued->data, queued->length) != (ssize_t)queued->length){ // Spool directory is full, upload cannot continue.
+        log_message(LOG_ERROR, "Spool file could not be written: %s", strerror(errno));
+        file->spool_failed = 1;
+        result = SPOOL_FAILED;
+    }
+    else if(!file->spool_failed && queued->last){
+        result = SPOOL_DONE;
+    }
+    if(__atomic_sub_fetch(&file->spool_pending, 1, __ATOMIC_SEQ_CST) <= SPOOL_RESUME_LEVEL && result == -1 && __atomic_exchange_n(&file->spool_paused, 0, __ATOMIC_SEQ_CST))
+        result = SPOOL_RESUME;
+
+    if(result != -1){
+        shard_message* message = create_message(SHARD_SPOOLED, queued->client_id, -1, NULL, NULL, NULL, 0);
+        message->value = result;
+        message->file = file; // Reference of write is given to the message.
+        post_message(queued->shard, message);
+    }
+    else{
+        release_file(file);
+    }
+    free(queued);
+}
+
+/*
+    Handles password chosen by client for a private room.
+    A valid password is asked again before the room is created.
+*/
+void set_room_password(client* cl, char* password){
+
+    char result_buffer[100] = {'\0'};
+    password = trim(password);
+    if(!validate_password(password, result_buffer)){
+        send_client(cl, result_buffer); // Client stays in STATE_SET_PASSWORD and sends a new password.
+        wait_for_password(cl, STATE_SET_PASSWORD);
+        return;
+    }
+
+    cl->pending_password = (char*)malloc(sizeof(char) * (strlen(password) + 1));
+    strcpy(cl->pending_password, password);
+    wait_for_password(cl, STATE_CONFIRM_PASSWORD); // Next input of client is the same password.
+    send_client(cl, "confirm_password;Enter password again.");
+}
+
+/*
+    Handles password entered again by client for a private room.
+    Shard of room creates the room when it is the same as the chosen password.
+*/
+void confirm_room_password(client* cl, char* password){
+
+    password = trim(password);
+    if(strcmp(password, cl->pending_password) != 0){ // Client chooses a new password.
+        free(cl->pending_password);
+        cl->pending_password = NULL;
+        send_client(cl, "unsuitable_password;Passwords do not match!");
+        wait_for_password(cl, STATE_SET_PASSWORD);
+        return;
+    }
+    send_client(cl, "suitable_password;Password accepted!"); // Frames are separated by client, so room_created can be sent when it arrives.
+
+    // Password has been chosen, reserved name belongs to the room from now on.
+    shard_message* message = create_message(SHARD_CREATE, cl->id, -1, cl->pending_room_name, cl->nickname, password, 0);
+    message->value = ROOM_TYPE_PRIVATE;
+    int owner = room_shard(cl->pending_room_name);
+    free(cl->pending_room_name);
+    free(cl->pending_password);
+    cl->pending_room_name = NULL;
+    cl->pending_password = NULL;
+    request_room(cl, owner, message, "Attempted to create a room\0");
+}
+
+/*
+    Handles password entered by client for a private room.
+    Shard of room checks it and adds the client into room when the password is correct.
+*/
+void check_room_password(client* cl, char* password){
+
+    shard_message* message = create_message(SHARD_ENTER, cl->id, cl->pending_room_id, NULL, cl->nickname, password, 0);
+    request_room(cl, id_shard(cl->pending_room_id), message, "Attempted to enter a room"); // Client has one chance to enter password like before.
+}
+
+/*
+    Sends a request about a room to the shard of room. Client waits for the answer,
+    given action is logged with the result when the answer arrives.
+*/
+void request_room(client* cl, int owner, shard_message* message, char* action){
+
+    cl->state = STATE_WAITING_ROOM;
+    cl->pending_action = action;
+    message->compact = cl->compact; // Room shard encodes the frames of member.
+    post_message(owner, message);
+}
+
+/*
+    Puts client into a state that waits for a password and starts the timeout of the prompt.
+*/
+void wait_for_password(client* cl, int state){
+
+    cl->state = state;
+    if(options.password_timeout <= 0)
+        return;
+
+    cl->input_deadline = now_ms() + options.password_timeout;
+    if(this_shard->waiting_count == this_shard->waiting_capacity){
+        this_shard->waiting_capacity = this_shard->waiting_capacity == 0 ? 16 : this_shard->waiting_capacity * 2;
+        this_shard->waiting_clients = (waiting_entry*)realloc(this_shard->waiting_clients, sizeof(waiting_entry) * this_shard->waiting_capacity);
+    }
+    this_shard->waiting_clients[this_shard->waiting_count].client_id = cl->id; // Timeout is the same for all prompts, so the list stays sorted.
+    this_shard->waiting_clients[this_shard->waiting_count].deadline = cl->input_deadline;
+    this_shard->waiting_count += 1;
+}
+
+/*
+    Releases the room name reserved by client and the password that is not confirmed.
+*/
+void release_pending_room(client* cl){
+
+    if(cl->pending_room_name != NULL){
+        post_message(room_shard(cl->pending_room_name), create_message(SHARD_UNRESERVE, cl->id, -1, cl->pending_room_name, NULL, NULL, 0));
+        free(cl->pending_room_name);
+        cl->pending_room_name = NULL;
+    }
+    free(cl->pending_password);
+    cl->pending_password = NULL;
+}
+
+/*
+    Called by a shard when its password timer expires.
+    Clients that did not answer their password prompts in time go back to commands.
+    Entries of clients that answered or disconnected are only removed from the list.
+*/
+void expire_waiting_clients(void){
+
+    long long now = now_ms();
+    int expired_count = 0;
+    int i = 0;
+
+    while(expired_count < this_shard->waiting_count && this_shard->waiting_clients[expired_count].deadline <= now)
+        expired_count += 1;
+    int* expired = (int*)arena_alloc(&request_arena, sizeof(int) * (expired_count + 1));
+    for(i = 0 ; i < expired_count ; i++)
+        expired[i] = this_shard->waiting_clients[i].client_id;
+    memmove(this_shard->waiting_clients, this_shard->waiting_clients + expired_count, sizeof(waiting_entry) * (this_shard->waiting_count - expired_count));
+    this_shard->waiting_count -= expired_count;
+
+    for(i = 0 ; i < expired_count ; i++){
+        client* cl = find_client(expired[i]);
+        if(cl == NULL) // Client is already disconnected.
+            continue;
+        if(cl->socket != -1 && cl->state >= STATE_SET_PASSWORD && cl->state <= STATE_CONFIRM_PASSWORD && cl->input_deadline <= now){ // Client may have answered and been asked again.
+            if(cl->state == STATE_ENTER_PASSWORD)
+                send_client(cl, "password_timeout;Password is not entered in time!");
+            else{
+                release_pending_room(cl);
+                send_client(cl, "password_timeout;Password is not entered in time, room is not created!");
+            }
+            cl->state = STATE_COMMAND;
+            __atomic_fetch_add(&this_shard->metrics.password_timeouts, 1, __ATOMIC_RELAXED);
+            log_action(LOG_INFO, cl, "Attempted to enter a password", "Rejected because of timeout");
+            handle_client(cl); // Commands sent after the password prompt are waiting.
+        }
+    }
+}
+
+/*
+    Closes connection of client. Client leaves its room
+    and releases the room name that it reserved.
+    Only the shard of client calls this function.
+*/
+void disconnect_client(client* cl){
+
+    if(cl->socket == -1) // Already disconnected.
+        return;
+    if(cl->room_id != -1){ // Exiting from a room. It is like quit command.
+        post_message(id_shard(cl->room_id), create_message(SHARD_LEAVE, cl->id, cl->room_id, NULL, NULL, NULL, 0));
+        cl->room_id = -1;
+    }
+    release_pending_room(cl); // Reserved room name will not be used.
+    cancel_upload(cl);
+    // If client is not a room, exiting easy.
+    cl->connection_flag = DISCONNECTED;
+    if(this_shard->ring != NULL){ // Prepared entries are given to the kernel before the socket number can be used again.
+        uring_enter(0);
+        shutdown(cl->socket, SHUT_RDWR); // Multishot recv ends, io_uring keeps the socket open until then.
+    }
+    epoll_ctl(this_shard->epoll_fd, EPOLL_CTL_DEL, cl->socket, NULL);
+    close(cl->socket);
+    cl->socket = -1;
+    clear_queue(cl);
+    clear_files(cl);
+    __atomic_fetch_sub(&this_shard->metrics.active_connections, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&connection_count, 1, __ATOMIC_RELAXED);
+    cl->id = next_generation(cl->id); // Events and answers of shards for the old id are ignored from now on.
+    frame_decoder_free(&cl->decoder);
+    free(cl->nickname);
+    cl->nickname = NULL;
+    free(cl->list_prefix);
+    cl->list_prefix = NULL;
+    free(cl->list_cursor);
+    cl->list_cursor = NULL;
+
+    table_release(&this_shard->clients, cl->id & SLOT_MASK);
+}
+
+/*
+    Creates a message for a shard. Given strings are copied into the same allocation,
+    recipients array has room for given number of client ids.
+*/
+shard_message* create_message(int type, int client_id, int room_id, const char* name, const char* nickname, const char* text, int count){
+
+    size_t name_length = name == NULL ? 0 : strlen(name) + 1;
+    size_t nickname_length = nickname == NULL ? 0 : strlen(nickname) + 1;
+    size_t text_length = text == NULL ? 0 : strlen(text) + 1;
+    shard_message* message = (shard_message*)malloc(sizeof(shard_message) + sizeof(int) * count + name_length + nickname_length + text_length);
+    char* strings = (char*)(message->recipients + count);
+
+    message->type = type;
+    message->client_id = client_id;
+    message->room_id = room_id;
+    message->value = 0;
+    message->compact = 0;
+    message->frame = NULL;
+    message->file = NULL;
+    message->count = count;
+    message->name = name == NULL ? NULL : memcpy(strings, name, name_length);
+    message->nickname = nickname == NULL ? NULL : memcpy(strings + name_length, nickname, nickname_length);
+    message->text = text == NULL ? NULL : memcpy(strings + name_length + nickname_length, text, text_length);
+
+    return message;
+}
+
+/*
+    Puts a message into the inbox of given shard. Inbox is a lock-free list,
+    the shard is woken only if its inbox was empty. A shard does not wake itself,
+    it checks its inbox before it waits for events.
+*/
+void post_message(int target, shard_message* message){
+
+    shard* s = &shards[target];
+    shard_message* head = __atomic_load_n(&s->inbox, __ATOMIC_RELAXED);
+
+    message->sent_ns = now_ns();
+    do{
+        message->next = head;
+    }while(!__atomic_compare_exchange_n(&s->inbox, &head, message, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(s != this_shard){
+        if(this_shard != NULL) // Spool writer is not a shard.
+            __atomic_fetch_add(&this_shard->metrics.shard_messages, 1, __ATOMIC_RELAXED);
+        if(head == NULL){
+            uint64_t wake = 1;
+            if(write(s->wake_fd, &wake, sizeof(wake)) < 0) // Counter cannot overflow, shard is already awake if it fails.
+                return;
+        }
+    }
+}
+
+/*
+    Takes all messages in the inbox of shard and handles them in the order they are sent.
+*/
+void drain_inbox(void){
+
+    shard_message* message = __atomic_exchange_n(&this_shard->inbox, NULL, __ATOMIC_ACQUIRE);
+    shard_message* ordered = NULL;
+    long long now = now_ns();
+
+    while(message != NULL){ // Inbox is newest first, it is reversed.
+        shard_message* next = message->next;
+        message->next = ordered;
+        ordered = message;
+        message = next;
+    }
+
+    while(ordered != NULL){
+        message = ordered;
+        ordered = ordered->next;
+        observe_histogram(HISTOGRAM_INBOX_WAIT, now - message->sent_ns);
+        if(message->type < SHARD_CREATED || message->type == SHARD_FILE)
+            handle_room_request(message);
+        else
+            handle_room_answer(message);
+        if(message->frame != NULL)
+            release_frame(message->frame);
+        if(message->file != NULL)
+            release_file(message->file);
+        free(message);
+        arena_reset(&request_arena);
+    }
+}
+
+/*
+    Handles a request that is sent to the shard of a room.
+*/
+void handle_room_request(shard_message* message){
+
+    if(message->type == SHARD_CREATE){
+        create_room(message);
+    }
+    else if(message->type == SHARD_RESERVE){
+        if(find_room_index(message->name) != -1){ // Room name must be unique.
+            answer_client(message, SHARD_REJECTED, -1, REJECT_NAME_USED);
+            return;
+        }
+        insert_room_index(message->name, ROOM_RESERVED);
+        answer_client(message, SHARD_RESERVED, -1, 0);
+    }
+    else if(message->type == SHARD_UNRESERVE){
+        if(find_room_index(message->name) == ROOM_RESERVED)
+            remove_room_index(message->name);
+    }
+    else if(message->type == SHARD_ENTER){
+        join_room(message);
+    }
+    else if(message->type == SHARD_LEAVE){
+        leave_room(message);
+    }
+    else if(message->type == SHARD_MESSAGE){
+        chat_room* room = find_room(message->room_id);
+        if(room != NULL){
+            record_history(room, message->frame);
+            shared_frame* compact_frame = room->compact_members > 0 ? create_compact_message(room, message) : NULL;
+            broadcast_room(room, message->frame, compact_frame, NULL, message->value, -1);
+            if(compact_frame != NULL)
+                release_frame(compact_frame);
+            if(room->history_capacity > 0) // Only history is rebuilt from messages.
+                journal_append(JOURNAL_MESSAGE, room->id, 0, message->frame->data, message->frame->length, NULL, 0); // After fan-out, members do not wait for it.
+        }
+    }
+    else if(message->type == SHARD_FILE){
+        chat_room* room = find_room(message->room_id);
+        if(room != NULL) // Sender already has the file.
+            broadcast_room(room, NULL, NULL, message->file, FRAME_KIND_MESSAGE, message->client_id);
+    }
+    else if(message->type == SHARD_HISTORY){
+        chat_room* room = find_room(message->room_id);
+        if(room != NULL){
+            resize_history(room, message->value);
+            journal_append(JOURNAL_HISTORY, room->id, message->value, NULL, 0, NULL, 0);
+        }
+    }
+}
+
+/*
+    Sends the answer of a request to the shard of client. Name of room is copied into answer.
+*/
+void answer_client(shard_message* request, int type, int room_id, int value){
+
+    shard_message* answer = create_message(type, request->client_id, room_id, request->name, NULL, NULL, 0);
+    answer->value = value;
+    post_message(id_shard(request->client_id), answer);
+}
+
+/*
+    Creates a room for client. Name of a private room was reserved by the same client.
+    Client is the first member of room.
+*/
+void create_room(shard_message* message){
+
+    int existing = find_room_index(message->name);
+    if(existing != -1 && !(message->value == ROOM_TYPE_PRIVATE && existing == ROOM_RESERVED)){ // Room name must be valid.
+        answer_client(message, SHARD_REJECTED, -1, REJECT_NAME_USED);
+        return;
+    }
+    chat_room* room = open_room(message->name, message->value, message->text);
+    if(room == NULL){ // There is no place for new room, reserved name is released.
+        if(existing == ROOM_RESERVED)
+            remove_room_index(message->name);
+        answer_client(message, SHARD_REJECTED, -1, REJECT_ROOM_LIMIT);
+        return;
+    }
+    journal_room(room);
+    room_member* member = add_room_member(room, message->client_id, message->nickname, message->compact); // The client that creates room is added into room.
+    shard_message* answer = create_message(SHARD_CREATED, message->client_id, room->id, room->name, NULL, NULL, 0);
+    answer->value = 1;
+    if(member->compact) // Client learns its member id.
+        answer->frame = create_entered_frame(room, member);
+    post_message(id_shard(message->client_id), answer);
+}
+
+/*
+    Takes a room slot of calling shard and prepares an empty room.
+    Returns NULL if there is no place for new room.
+*/
+chat_room* open_room(char* name, int type, char* password){
+
+    int slot = table_alloc(&this_shard->rooms);
+    if(slot == -1)
+        return NULL;
+    chat_room* room = (chat_room*)table_slot(&this_shard->rooms, slot);
+    room->name = (char*)malloc(sizeof(char) * (strlen(name) + 1)); // Room id is assigned by the slot. Room id's are also unique.
+    strcpy(room->name, name);
+    insert_room_index(name, room->id); // Reserved name belongs to the room now.
+    room->type = type;
+    room->password = NULL;
+    if(room->type == ROOM_TYPE_PRIVATE){
+        room->password = (char*)malloc(sizeof(char) * (strlen(password) + 1));
+        strcpy(room->password, password);
+    }
+    room->is_active = ROOM_ACTIVE;
+    resize_history(room, options.history); // Memory of history does not change until the size is changed.
+    directory_insert(room);
+    return room;
+}
+
+/*
+    Adds client into a room and informs clients in the room.
+    Room is found by name for -enter and by id when client sends the password of a private room.
+*/
+void join_room(shard_message* message){
+
+    chat_room* room = message->room_id >= 0 ? find_room(message->room_id) : find_room(get_room_id_by_name(message->name));
+    if(room == NULL){ // There is no room that has given name in system, or it is closed while client is entering password.
+        answer_client(message, SHARD_REJECTED, -1, REJECT_NOT_FOUND);
+        return;
+    }
+    if(room->active_client_counter == ROOM_CAPACITY){ // Room is full.
+        answer_client(message, SHARD_REJECTED, -1, REJECT_FULL);
+        return;
+    }
+    if(room->type == ROOM_TYPE_PRIVATE){ // Room is private, client has to enter correct password.
+        if(message->text == NULL){
+            answer_client(message, SHARD_PASSWORD, room->id, 0);
+            return;
+        }
+        if(strcmp(message->text, room->password) != 0){ // Password is not true
+            answer_client(message, SHARD_REJECTED, -1, REJECT_PASSWORD);
+            return;
+        }
+    }
+
+    room_member* member = add_room_member(room, message->client_id, message->nickname, message->compact); // Client is added to room.
+    shard_message* answer = create_message(SHARD_ENTERED, message->client_id, room->id, room->name, NULL, NULL, 0);
+    answer->value = room->active_client_counter;
+    answer->frame = create_entered_frame(room, member); // Client sees what it missed without asking.
+    post_message(id_shard(message->client_id), answer); // Client is informed before the next frames of room.
+    shared_frame* frame = create_frame("update_counter;%d", room->active_client_counter);
+    shared_frame* compact_frame = room->compact_members > 0 ? create_frame("member;%d;%s", member->member_id, member->nickname) : NULL;
+    broadcast_room(room, frame, compact_frame, NULL, FRAME_KIND_COUNTER, message->client_id); // Informing all clients in the same room to update their online counters.
+    release_frame(frame);
+    if(compact_frame != NULL)
+        release_frame(compact_frame);
+}
+
+/*
+    Removes client from a room. Room is closed if it is empty,
+    otherwise online counters of other clients in room are updated.
+*/
+void leave_room(shard_message* message){
+
+    chat_room* room = find_room(message->room_id);
+    if(room == NULL)
+        return;
+
+    int member_id = remove_room_member(room, message->client_id); // Updating client counter of room.
+    if(room->active_client_counter == 0){ // Room is empty, room has to be closed.
+        close_room(room);
+    }
+    else if(member_id != -1){ // Room is not empty, means there left another clients in room. So, their online counters should be updated.
+        shared_frame* frame = create_frame("update_counter;%d", room->active_client_counter);
+        shared_frame* compact_frame = room->compact_members > 0 ? create_frame("left;%d", member_id) : NULL;
+        broadcast_room(room, frame, compact_frame, NULL, FRAME_KIND_COUNTER, -1);
+        release_frame(frame);
+        if(compact_frame != NULL)
+            release_frame(compact_frame);
+    }
+}
+
+/*
+    Handles an answer that is sent to the shard of a client.
+    Answers for a client that disconnected while it was waiting undo what the room shard did.
+*/
+void handle_room_answer(shard_message* message){
+
+    client* cl = find_client(message->client_id);
+
+    if(message->type == SHARD_DELIVER){
+        deliver_frame(message);
+        return;
+    }
+    if(message->type == SHARD_SPOOLED){
+        spooled_upload(message);
+        return;
+    }
+    if(cl == NULL || cl->state != STATE_WAITING_ROOM){ // Client is disconnected.
+        if(message->type == SHARD_CREATED || message->type == SHARD_ENTERED)
+            post_message(id_shard(message->room_id), create_message(SHARD_LEAVE, message->client_id, message->room_id, NULL, NULL, NULL, 0));
+        else if(message->type == SHARD_RESERVED)
+            post_message(room_shard(message->name), create_message(SHARD_UNRESERVE, message->client_id, -1, message->name, NULL, NULL, 0));
+        return;
+    }
+
+    if(message->type == SHARD_CREATED || message->type == SHARD_ENTERED){
+        int created = message->type == SHARD_CREATED;
+        cl->state = STATE_COMMAND;
+        cl->location = LOCATION_ROOM; // Updating client location.
+        cl->room_id = message->room_id; // Updating client's room.
+        if(message->frame == NULL)
+            send_client(cl, arena_printf(&request_arena, "room_created;%s;%d;%d", message->name, message->value, ROOM_CAPACITY)); // Informing client
+        else
+            queue_frame(cl, message->frame, FRAME_KIND_REPLY); // room_entered or compact room frames, and history of room.
+        char* result = arena_printf(&request_arena, "Successful, room \"%s\" has been %s", message->name, created ? "created" : "entered");
+        log_action(LOG_INFO, cl, cl->pending_action, result);
+    }
+    else if(message->type == SHARD_REJECTED){
+        cl->state = STATE_COMMAND;
+        send_client(cl, (char*)reject_replies[message->value]);
+        char* result = arena_printf(&request_arena, "%s: %s", reject_results[message->value], message->name == NULL ? "-" : message->name);
+        log_action(LOG_INFO, cl, cl->pending_action, result);
+    }
+    else if(message->type == SHARD_RESERVED){
+        cl->pending_room_name = (char*)malloc(sizeof(char) * (strlen(message->name) + 1));
+        strcpy(cl->pending_room_name, message->name);
+        wait_for_password(cl, STATE_SET_PASSWORD); // Next input of client is password.
+        __atomic_fetch_add(&this_shard->metrics.set_password_prompts, 1, __ATOMIC_RELAXED);
+        send_client(cl, "set_password;Set a password for private room.");
+    }
+    else if(message->type == SHARD_PASSWORD){
+        cl->pending_room_id = message->room_id;
+        wait_for_password(cl, STATE_ENTER_PASSWORD); // Next input of client is password.
+        __atomic_fetch_add(&this_shard->metrics.enter_password_prompts, 1, __ATOMIC_RELAXED);
+        send_client(cl, "request_password;Enter password\0");
+    }
+
+    arena_reset(&request_arena);
+    handle_client(cl); // Commands that arrived while client was waiting are processed.
+}
+
+/*
+    Sends the frame or file of a room to clients of shard. Frames and files of a room that the client
+    already left are not sent.
+*/
+void deliver_frame(shard_message* message){
+
+    int i = 0;
+    for(i = 0 ; i < message->count ; i++){
+        client* cl = find_client(message->recipients[i]);
+        if(cl == NULL || cl->room_id != message->room_id)
+            continue;
+        if(message->frame != NULL)
+            queue_frame(cl, message->frame, message->value);
+        if(message->file != NULL)
+            queue_file(cl, message->file);
+    }
+}
+
+/*
+    Sends the same frame or file to all members of room except given client. Frame and file are shared,
+    so they are not copied for any client. Members that read compact frames get compact frame if it is given.
+    Members are grouped by their shards and frames, every group gets one message.
+*/
+void broadcast_room(chat_room* room, shared_frame* frame, shared_frame* compact_frame, shared_file* file, int kind, int except_id){
+
+    int member_shards[ROOM_CAPACITY];
+    int compact[ROOM_CAPACITY];
+    int sent[ROOM_CAPACITY] = {0};
+    int i = 0;
+    int t = 0;
+    int total = 0;
+    unsigned long long bytes = 0;
+    long long start = now_ns();
+
+    for(i = 0 ; i < room->active_client_counter ; i++){
+        member_shards[i] = id_shard(room->members[i].client_id);
+        compact[i] = room->members[i].compact && compact_frame != NULL;
+        sent[i] = room->members[i].client_id == except_id;
+    }
+
+    for(i = 0 ; i < room->active_client_counter ; i++){
+        if(sent[i])
+            continue;
+        int count = 0;
+        for(t = i ; t < room->active_client_counter ; t++){ // Counting members in the same shard that get the same frame.
+            if(!sent[t] && member_shards[t] == member_shards[i] && compact[t] == compact[i])
+                count += 1;
+        }
+        shard_message* message = create_message(SHARD_DELIVER, -1, room->id, NULL, NULL, NULL, count);
+        count = 0;
+        for(t = i ; t < room->active_client_counter ; t++){
+            if(!sent[t] && member_shards[t] == member_shards[i] && compact[t] == compact[i]){
+                message->recipients[count++] = room->members[t].client_id;
+                sent[t] = 1;
+            }
+        }
+        shared_frame* group_frame = compact[i] ? compact_frame : frame;
+        if(group_frame != NULL){
+            retain_frame(group_frame); // Every message keeps the frame until its shard writes it.
+            message->frame = group_frame;
+        }
+        if(file != NULL){
+            retain_file(file);
+            message->file = file;
+        }
+        message->value = compact[i] && kind == FRAME_KIND_COUNTER ? FRAME_KIND_MESSAGE : kind; // Member and left frames cannot be replaced by the next one.
+        post_message(member_shards[i], message);
+        total += count;
+        bytes += (unsigned long long)count * (group_frame != NULL ? group_frame->length : file->size);
+    }
+
+    __atomic_fetch_add(&this_shard->metrics.fanout_messages, total, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&this_shard->metrics.fanout_bytes, bytes, __ATOMIC_RELAXED);
+    observe_histogram(HISTOGRAM_FANOUT, now_ns() - start);
+}
+
+/*
+    Changes the number of messages that room keeps. Newest messages are kept.
+*/
+void resize_history(chat_room* room, int size){
+
+    shared_frame** history = size > 0 ? (shared_frame**)malloc(sizeof(shared_frame*) * size) : NULL;
+    int kept = room->history_count < size ? room->history_count : size;
+    int i = 0;
+
+    for(i = 0 ; i < room->history_count ; i++){ // Oldest messages first.
+        shared_frame* frame = room->history[(room->history_head - room->history_count + i + room->history_capacity) % room->history_capacity];
+        if(i < room->history_count - kept)
+            release_frame(frame);
+        else
+            history[i - (room->history_count - kept)] = frame;
+    }
+    free(room->history);
+    room->history = history;
+    room->history_capacity = size;
+    room->history_count = kept;
+    room->history_head = size > 0 ? kept % size : 0;
+}
+
+/*
+    Adds a message to history of room. Oldest message is dropped when the ring is full.
+*/
+void record_history(chat_room* room, shared_frame* frame){
+
+    if(room->history_capacity == 0)
+        return;
+
+    shared_frame** slot = &room->history[room->history_head];
+    if(room->history_count == room->history_capacity)
+        release_frame(*slot);
+    else
+        room->history_count += 1;
+    retain_frame(frame); // History keeps the frame after it is written to members.
+    *slot = frame;
+    room->history_head = (room->history_head + 1) % room->history_capacity;
+}
+
+/*
+    Encodes room_entered answer and appends the frames in history of room to it.
+    History is cut to the newest messages that fit under the high watermark.
+    A member that reads compact frames gets the room frame and a member frame for every member instead.
+    Frames are already encoded, so they are only copied one after another.
+*/
+shared_frame* create_entered_frame(chat_room* room, room_member* member){
+
+    char* payloads[ROOM_CAPACITY + 1];
+    int count = 0;
+    int i = 0;
+
+    if(member->compact){
+        payloads[count++] = arena_printf(&request_arena, "room;%d;%d;%d;%s", room->id, member->member_id, ROOM_CAPACITY, room->name);
+        for(i = 0 ; i < room->active_client_counter ; i++) // Client itself is in the list too.
+            payloads[count++] = arena_printf(&request_arena, "member;%d;%s", room->members[i].member_id, room->members[i].nickname);
+    }
+    else{
+        payloads[count++] = arena_printf(&request_arena, "room_entered;%s;%d;%d", room->name, room->active_client_counter, ROOM_CAPACITY);
+    }
+
+    size_t length = 0;
+    int replayed = 0;
+    for(i = 0 ; i < count ; i++)
+        length += FRAME_HEADER_SIZE + strlen(payloads[i]);
+    while(replayed < room->history_count){ // Newest messages that fit under the high watermark are sent, a reply over the queue limit would evict the client.
+        shared_frame* message = room->history[(room->history_head - 1 - replayed + room->history_capacity) % room->history_capacity];
+        if(length + message->length > options.high_watermark)
+            break;
+        length += message->length;
+        replayed += 1;
+    }
+
+    shared_frame* frame = (shared_frame*)malloc(sizeof(shared_frame) + length + 1);
+    frame->reference_counter = 1;
+    frame->length = 0;
+    for(i = 0 ; i < count ; i++)
+        append_payload(frame, payloads[i], strlen(payloads[i]));
+    for(i = 0 ; i < replayed ; i++){ // Oldest message first.
+        shared_frame* message = room->history[(room->history_head - replayed + i + room->history_capacity) % room->history_capacity];
+        memcpy(frame->data + frame->length, message->data, message->length);
+        frame->length += message->length;
+    }
+    __atomic_fetch_add(&this_shard->metrics.history_frames, replayed, __ATOMIC_RELAXED);
+
+    return frame;
+}
+
+/*
+    Appends a frame with given payload to the end of frame. Frame has to have enough space.
+*/
+void append_payload(shared_frame* frame, const char* payload, size_t length){
+
+    frame_encode_header(frame->data + frame->length, length);
+    memcpy(frame->data + frame->length + FRAME_HEADER_SIZE, payload, length);
+    frame->length += FRAME_HEADER_SIZE + length;
+}
+
+/*
+    Encodes the compact frame of a room message from its normal frame (new_message;nickname;text).
+    Returns NULL if sender is not a member anymore, compact members get the normal frame then.
+*/
+shared_frame* create_compact_message(chat_room* room, shard_message* message){
+
+    int i = 0;
+    for(i = 0 ; i < room->active_client_counter ; i++){ // Room has a few members, they are searched.
+        if(room->members[i].client_id == message->client_id)
+            break;
+    }
+    if(i == room->active_client_counter)
+        return NULL;
+
+    room_member* member = &room->members[i];
+    size_t skipped = FRAME_HEADER_SIZE + strlen("new_message;") + strlen(member->nickname) + 1;
+    int text_length = (int)(message->frame->length - skipped);
+    return create_frame("m;%d;%.*s", member->member_id, text_length, message->frame->data + skipped);
+}
+
+/*
+    Returns the shard that owns the room with given name.
+*/
+int room_shard(char* name){
+
+    return hash_name(name) % shard_count;
+}
+
+/*
+    Returns the shard that owns the client or room with given id.
+*/
+int id_shard(int id){
+
+    return (id & SLOT_MASK) % shard_count;
+}
+
+/*
+    Closes an empty room and releases its slot.
+    The name of closed room is deleted to be able to create new room with this name.
+*/
+void close_room(chat_room* room){
+
+    journal_append(JOURNAL_CLOSE, room->id, 0, NULL, 0, NULL, 0);
+    room->is_active = ROOM_INACTIVE;
+    directory_remove(room);
+    resize_history(room, 0); // Frames in history are released.
+    remove_room_index(room->name);
+    free(room->name);
+    free(room->password);
+    room->name = NULL;
+    room->password = NULL;
+    room->id = next_generation(room->id); // Clients waiting with the old id cannot enter the next room in this slot.
+    table_release(&this_shard->rooms, room->id & SLOT_MASK);
+}
+
+/*
+    Creates the listing of a room. Entry is never changed after it is published,
+    a new entry replaces it when the room changes.
+*/
+directory_entry* create_directory_entry(chat_room* room){
+
+    size_t length = strlen(room->name) + 1;
+    int t = 0;
+    char* text = arena_printf(&request_arena, "\n Room Name: %s\n Room Type: %s\n", room->name, room->type == ROOM_TYPE_PRIVATE ? "Private" : "Public");
+    if(room->type == ROOM_TYPE_PUBLIC){
+        text = arena_append(&request_arena, text, " Customers: \n");
+        for(t = 0 ; t < room->active_client_counter ; t++){
+            text = arena_append(&request_arena, text, "\t%s\n", room->members[t].nickname);
+        }
+    }
+    else{
+        text = arena_append(&request_arena, text, " No customer info given, room is private!\n");
+    }
+
+    directory_entry* entry = (directory_entry*)malloc(sizeof(directory_entry) + length + strlen(text) + 1);
+    entry->name = entry->data;
+    memcpy(entry->name, room->name, length);
+    entry->text = entry->data + length;
+    strcpy(entry->text, text);
+    return entry;
+}
+
+/*
+    Adds a new room to directory of calling shard. Only the chunk of its place is copied with
+    the new entry, and split if it is full. Old chunk is freed when no shard can be reading it.
+*/
+void directory_insert(chat_room* room){
+
+    if(this_shard->directory_stale) // Journal is being recovered.
+        return;
+    room_directory* old = this_shard->directory;
+    directory_entry* entries[DIRECTORY_CHUNK + 1];
+    directory_chunk* chunks[2];
+    int place = directory_lower_bound(old, room->name);
+    int span = 0;
+    int removed = 0;
+    int count = 0;
+    int local = 0;
+
+    if(old->span_count > 0){ // A room after all others goes to the last chunk.
+        span = directory_span_of(old, place < old->count ? place : old->count - 1);
+        directory_chunk* chunk = old->spans[span].chunk;
+        local = place - old->spans[span].first;
+        memcpy(entries, chunk->entries, sizeof(directory_entry*) * local);
+        memcpy(entries + local + 1, chunk->entries + local, sizeof(directory_entry*) * (chunk->count - local));
+        count = chunk->count;
+        removed = 1;
+    }
+    entries[local] = create_directory_entry(room);
+    count += 1;
+
+    if(count <= DIRECTORY_CHUNK){
+        chunks[0] = create_directory_chunk(entries, count);
+        replace_chunks(old, span, removed, chunks, 1);
+    }
+    else{ // Full chunk is split in two halves.
+        chunks[0] = create_directory_chunk(entries, count / 2);
+        chunks[1] = create_directory_chunk(entries + count / 2, count - count / 2);
+        replace_chunks(old, span, removed, chunks, 2);
+    }
+}
+
+/*
+    Removes a closed room from directory of calling shard. Its chunk is copied without it,
+    and merged with the next chunk if both are small.
+*/
+void directory_remove(chat_room* room){
+
+    if(this_shard->directory_stale) // Journal is being recovered.
+        return;
+    room_directory* old = this_shard->directory;
+    int place = directory_lower_bound(old, room->name);
+    if(place == old->count || strcmp(directory_at(old, place)->name, room->name) != 0)
+        return;
+
+    directory_entry* entries[DIRECTORY_CHUNK];
+    int span = directory_span_of(old, place);
+    directory_chunk* chunk = old->spans[span].chunk;
+    int local = place - old->spans[span].first;
+    directory_entry* entry = chunk->entries[local];
+    int count = chunk->count - 1;
+    int removed = 1;
+
+    memcpy(entries, chunk->entries, sizeof(directory_entry*) * local);
+    memcpy(entries + local, chunk->entries + local + 1, sizeof(directory_entry*) * (count - local));
+    if(span + 1 < old->span_count && count + old->spans[span + 1].chunk->count <= DIRECTORY_CHUNK / 2){ // Chunks do not become many and small.
+        directory_chunk* next = old->spans[span + 1].chunk;
+        memcpy(entries + count, next->entries, sizeof(directory_entry*) * next->count);
+        count += next->count;
+        removed = 2;
+    }
+
+    if(count > 0){
+        directory_chunk* merged = create_directory_chunk(entries, count);
+        replace_chunks(old, span, removed, &merged, 1);
+    }
+    else{
+        replace_chunks(old, span, removed, NULL, 0);
+    }
+    retire_memory(entry);
+}
+
+/*
+    Replaces the listing of a room after its members change. Only the entry is replaced,
+    chunk and directory keep their places.
+*/
+void directory_update(chat_room* room){
+
+    if(this_shard->directory_stale) // Journal is being recovered.
+        return;
+    room_directory* directory = this_shard->directory;
+    int place = directory_lower_bound(directory, room->name);
+    if(place == directory->count || strcmp(directory_at(directory, place)->name, room->name) != 0)
+        return;
+
+    int span = directory_span_of(directory, place);
+    directory_entry** slot = &directory->spans[span].chunk->entries[place - directory->spans[span].first];
+    directory_entry* old = *slot;
+    __atomic_store_n(slot, create_directory_entry(room), __ATOMIC_SEQ_CST);
+    retire_memory(old);
+}
+
+/*
+    Creates a chunk of given sorted listings.
+*/
+directory_chunk* create_directory_chunk(directory_entry** entries, int count){
+
+    directory_chunk* chunk = (directory_chunk*)malloc(sizeof(directory_chunk));
+    memcpy(chunk->entries, entries, sizeof(directory_entry*) * count);
+    chunk->count = count;
+    return chunk;
+}
+
+/*
+    Publishes a copy of directory of calling shard where given number of chunks from span
+    are replaced with given chunks. Replaced chunks and the old directory are freed when
+    no shard can be reading them, their entries are kept.
+*/
+void replace_chunks(room_directory* old, int span, int removed, directory_chunk** chunks, int added){
+
+    int span_count = old->span_count - removed + added;
+    room_directory* directory = (room_directory*)malloc(sizeof(room_directory) + sizeof(directory_span) * span_count);
+    int first = span > 0 ? old->spans[span - 1].first + old->spans[span - 1].chunk->count : 0;
+    int i = 0;
+
+    memcpy(directory->spans, old->spans, sizeof(directory_span) * span);
+    for(i = 0 ; i < added ; i++){
+        directory->spans[span + i].chunk = chunks[i];
+    }
+    for(i = span + removed ; i < old->span_count ; i++){
+        directory->spans[i - removed + added].chunk = old->spans[i].chunk;
+    }
+    for(i = span ; i < span_count ; i++){ // Places of later chunks are moved.
+        directory->spans[i].first = first;
+        first += directory->spans[i].chunk->count;
+    }
+    directory->span_count = span_count;
+    directory->count = first;
+    __atomic_store_n(&this_shard->directory, directory, __ATOMIC_SEQ_CST);
+
+    for(i = span ; i < span + removed ; i++){
+        retire_memory(old->spans[i].chunk);
+    }
+    retire_memory(old);
+}
+
+/*
+    Returns the chunk that holds given place of directory.
+*/
+int directory_span_of(room_directory* directory, int place){
+
+    int low = 0;
+    int high = directory->span_count - 1;
+    while(low < high){ // Last chunk whose first place is not after given place.
+        int middle = (low + high + 1) / 2;
+        if(directory->spans[middle].first <= place)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+/*
+    Returns the listing at given place of directory.
+*/
+directory_entry* directory_at(room_directory* directory, int place){
+
+    int span = directory_span_of(directory, place);
+    return __atomic_load_n(&directory->spans[span].chunk->entries[place - directory->spans[span].first], __ATOMIC_ACQUIRE);
+}
+
+/*
+    Returns the place of the first room whose name is not less than given name.
+*/
+int directory_lower_bound(room_directory* directory, char* name){
+
+    int low = 0;
+    int high = directory->count;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(strcmp(directory_at(directory, middle)->name, name) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/*
+    Returns the place after the last room whose name starts with given prefix.
+    Names with the same prefix are together in a sorted directory.
+*/
+int directory_prefix_end(room_directory* directory, char* prefix, int from){
+
+    size_t length = strlen(prefix);
+    int low = from;
+    int high = directory->count;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(strncmp(directory_at(directory, middle)->name, prefix, length) == 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/*
+    Creates a page of room list from directories of all shards. Directories are only read,
+    so listing does not wait for shards or stop them. Rooms are sorted by name.
+    If client asks for the page after its last one with the same prefix, merge continues
+    after the last room it was shown.
+*/
+char* list_rooms(client* cl, int page, char* prefix){
+
+    int starts[MAX_SHARDS];
+    int ends[MAX_SHARDS];
+    room_directory* directories[MAX_SHARDS];
+    int total = 0;
+    int i = 0;
+    int s = 0;
+    int next_page = cl->list_cursor != NULL && page == cl->list_page + 1 && strcmp(prefix, cl->list_prefix) == 0;
+
+    for(s = 0 ; s < shard_count ; s++){ // Rooms that match prefix are found with binary search.
+        directories[s] = __atomic_load_n(&shards[s].directory, __ATOMIC_SEQ_CST);
+        starts[s] = directory_lower_bound(directories[s], prefix);
+        ends[s] = directory_prefix_end(directories[s], prefix, starts[s]);
+        total += ends[s] - starts[s];
+    }
+
+    char* text = arena_strdup(&request_arena, "list;");
+    char* cursor = NULL;
+    if(total == 0)
+        return text;
+
+    int pages = (total + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE;
+    int first = (page - 1) * LIST_PAGE_SIZE;
+    if(next_page){ // Rooms of earlier pages are skipped with binary search, cursor has the prefix.
+        for(s = 0 ; s < shard_count ; s++){
+            starts[s] = directory_lower_bound(directories[s], cl->list_cursor);
+            if(starts[s] < ends[s] && strcmp(directory_at(directories[s], starts[s])->name, cl->list_cursor) == 0)
+                starts[s] += 1;
+        }
+        i = first;
+    }
+    for( ; i < first + LIST_PAGE_SIZE && i < total ; i++){ // Sorted parts of shards are merged.
+        directory_entry* smallest = NULL;
+        int smallest_shard = 0;
+        for(s = 0 ; s < shard_count ; s++){
+            if(starts[s] == ends[s])
+                continue;
+            directory_entry* entry = directory_at(directories[s], starts[s]);
+            if(smallest == NULL || strcmp(entry->name, smallest->name) < 0){
+                smallest = entry;
+                smallest_shard = s;
+            }
+        }
+        if(smallest == NULL) // Rooms were closed after the cursor was taken.
+            break;
+        starts[smallest_shard] += 1;
+        if(i >= first){
+            text = arena_append(&request_arena, text, "%s", smallest->text);
+            cursor = smallest->name;
+        }
+    }
+    text = arena_append(&request_arena, text, "\n Page %d of %d (%d rooms), -list <page> [prefix] shows another page.\n", page, pages, total);
+
+    free(cl->list_prefix); // Client continues from this page next time.
+    free(cl->list_cursor);
+    cl->list_prefix = strdup(prefix);
+    cl->list_page = page;
+    cl->list_cursor = cursor != NULL ? strdup(cursor) : NULL;
+
+    return text;
+}
+
+/*
+    Frees given memory when no shard can be reading it anymore.
+    Memory that is retired in one loop of shard is freed together.
+*/
+void retire_memory(void* pointer){
+
+    retired_memory* retired = (retired_memory*)malloc(sizeof(retired_memory));
+    retired->pointer = pointer;
+    retired->next = this_shard->pending_memory;
+    this_shard->pending_memory = retired;
+}
+
+/*
+    Called by a shard between its loops, when it does not read any directory.
+    Memory retired in this loop waits until every other shard passes such a point or sleeps.
+    Memory that waited enough is freed.
+*/
+void reclaim_memory(void){
+
+    int s = 0;
+    __atomic_add_fetch(&this_shard->quiescent_count, 1, __ATOMIC_SEQ_CST); // Shard does not read any directory now.
+
+    if(this_shard->pending_memory != NULL){
+        retired_batch* batch = (retired_batch*)malloc(sizeof(retired_batch) + sizeof(unsigned long long) * shard_count);
+        batch->memory = this_shard->pending_memory;
+        for(s = 0 ; s < shard_count ; s++)
+            batch->counts[s] = __atomic_load_n(&shards[s].quiescent_count, __ATOMIC_SEQ_CST);
+        batch->next = NULL;
+        if(this_shard->last_batch == NULL)
+            this_shard->retired_batches = batch;
+        else
+            this_shard->last_batch->next = batch;
+        this_shard->last_batch = batch;
+        this_shard->pending_memory = NULL;
+    }
+
+    while(this_shard->retired_batches != NULL){ // Batches are in order, a batch is not freed before the older ones.
+        retired_batch* batch = this_shard->retired_batches;
+        for(s = 0 ; s < shard_count ; s++){
+            if(&shards[s] == this_shard || !__atomic_load_n(&shards[s].online, __ATOMIC_SEQ_CST))
+                continue;
+            if(__atomic_load_n(&shards[s].quiescent_count, __ATOMIC_SEQ_CST) == batch->counts[s]) // Shard may still be reading it.
+                return;
+        }
+        while(batch->memory != NULL){
+            retired_memory* next = batch->memory->next;
+            free(batch->memory->pointer);
+            free(batch->memory);
+            batch->memory = next;
+        }
+        this_shard->retired_batches = batch->next;
+        if(this_shard->retired_batches == NULL)
+            this_shard->last_batch = NULL;
+        free(batch);
+    }
+}
+
+/*
+    Special split is used to split client messages.
+    Example:
+        char* client_msg = "-msg This is a test message from client."
+        char** splitted_client_msg = split(client_msg, ' ');
+        splitted_client_msg[0] is "-msg"
+        splitted_client_msg[0] is "This is a test message from client."
+
+*/
+char** split(char* string, char delimiter){
+
+    char **str_arr = (char**)arena_alloc(&request_arena, sizeof(char*) * 2); // Parts are released when the command is finished.
+    string = trim(string);
+    char* delimiter_location = strchr(string, delimiter);
+
+    if(delimiter_location != NULL){
+        size_t first_length = delimiter_location - string;
+        str_arr[0] = (char*)arena_alloc(&request_arena, first_length + 1);
+        memcpy(str_arr[0], string, first_length);
+        str_arr[0][first_length] = '\0';
+        str_arr[1] = arena_strdup(&request_arena, delimiter_location + 1);
+
+        str_arr[0] = trim(str_arr[0]);
+        str_arr[1] = trim(str_arr[1]);
+
+    }
+    else {
+        str_arr[0] = string;
+        str_arr[1] = "\0";
+    }
+
+    return str_arr;
+}
+
+/*
+    Left and right trim for given string.
+    Example:
+        char* str = "    This is a string.      ";
+        str = trim(str);
+        str is "This is a string.";
+*/
+char* trim(char* string){
+
+    if(!string) return string;
+
+    while(*string == ' '){
+        string = string + 1;
+    }
+    if(*string == '\0') return string; // Empty string has no last character.
+
+    char* back = string + (strlen(string) - 1);
+    while(*back == ' '){
+        *(back) = '\0';
+        back = back -1;
+    }
+
+    return string;
+}
+
+/*
+    Sends given message to given socket as one frame.
+    Used for sockets that are not registered as clients, other threads cannot write to them.
+*/
+void write_client(int __fd, char* message){
+
+    frame_write(__fd, message, strlen(message));
+}
+
+/*
+    Sends given message to given client as one frame.
+    Nothing is sent if the client is disconnected, its socket number may belong to another client now.
+*/
+void send_client(client* cl, char* message){
+
+    shared_frame* frame = create_frame("%s", message);
+    queue_frame(cl, frame, FRAME_KIND_REPLY);
+    release_frame(frame);
+}
+
+/*
+    Encodes a frame with formatted payload. Payload is written directly after the header.
+    Frame has one reference that belongs to caller.
+*/
+shared_frame* create_frame(const char* format, ...){
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args); // Measuring payload before allocation.
+    va_end(args);
+    if(length > MAX_FRAME_SIZE)
+        length = MAX_FRAME_SIZE;
+
+    shared_frame* frame = (shared_frame*)malloc(sizeof(shared_frame) + FRAME_HEADER_SIZE + length + 1);
+    frame->reference_counter = 1;
+    frame->length = FRAME_HEADER_SIZE + length;
+    frame_encode_header(frame->data, length);
+    va_start(args, format);
+    vsnprintf(frame->data + FRAME_HEADER_SIZE, length + 1, format, args);
+    va_end(args);
+
+    return frame;
+}
+
+/*
+    Adds a reference to frame. Anyone who keeps the frame has to retain it.
+*/
+void retain_frame(shared_frame* frame){
+
+    __atomic_add_fetch(&frame->reference_counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Removes a reference from frame. Last reference frees the frame.
+*/
+void release_frame(shared_frame* frame){
+
+    if(__atomic_sub_fetch(&frame->reference_counter, 1, __ATOMIC_ACQ_REL) == 0)
+        free(frame);
+}
+
+/*
+    Sends an encoded frame to client.
+    Frame is queued and client is put into flush list, waiting frames of client are written
+    together at the end of the loop or after the flush window. A queue that passes the flush
+    threshold is written immediately.
+*/
+void queue_frame(client* cl, shared_frame* frame, int kind){
+
+    if(cl->connection_flag == DISCONNECTED || cl->evicted)
+        return;
+
+    int waiting = cl->queue_count > 0;
+    if(admit_frame(cl, frame, kind)){
+        push_frame(cl, frame, kind);
+        if(!waiting) // First frame decides when the queue is written.
+            cl->flush_at = options.flush_window > 0 ? now_ms() + options.flush_window : 0;
+        if(kind == FRAME_KIND_REPLY) // Answers do not wait for the flush window.
+            cl->flush_at = 0;
+        schedule_flush(cl);
+        if(cl->queued_bytes >= options.flush_bytes && !cl->blocked)
+            write_queue(cl);
+    }
+    observe_histogram(HISTOGRAM_QUEUE_DEPTH, cl->queue_count);
+}
+
+/*
+    Puts client into the flush list of its shard, its waiting frames and files are written at the end of the loop.
+*/
+void schedule_flush(client* cl){
+
+    if(cl->flush_listed || cl->blocked) // Client is already waiting for the loop or for EPOLLOUT.
+        return;
+    if(this_shard->flush_count == this_shard->flush_capacity){
+        this_shard->flush_capacity = this_shard->flush_capacity == 0 ? FLUSH_INITIAL_SLOTS : this_shard->flush_capacity * 2;
+        this_shard->flush_clients = (int*)realloc(this_shard->flush_clients, sizeof(int) * this_shard->flush_capacity);
+    }
+    this_shard->flush_clients[this_shard->flush_count++] = cl->id;
+    cl->flush_listed = 1;
+}
+
+/*
+    Sends a spooled file to client. File waits after the files that are already waiting,
+    it is streamed when no frame waits, so messages are not delayed by files.
+*/
+void queue_file(client* cl, shared_file* file){
+
+    if(cl->connection_flag == DISCONNECTED || cl->evicted)
+        return;
+    if(cl->file_count == MAX_WAITING_FILES){
+        log_action(LOG_WARN, cl, "Received a file", "Dropped because of too many files are waiting");
+        return;
+    }
+
+    file_transfer* transfer = (file_transfer*)malloc(sizeof(file_transfer));
+    retain_file(file); // Transfer keeps the file until it is written.
+    transfer->file = file;
+    transfer->offset = 0;
+    transfer->frame_end = 0;
+    transfer->next = NULL;
+    if(cl->last_file == NULL){
+        int lowat = FILE_NOTSENT_LOWAT; // Socket takes only a little more file data than it can send.
+        setsockopt(cl->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        cl->files = transfer;
+    }
+    else
+        cl->last_file->next = transfer;
+    cl->last_file = transfer;
+    cl->file_count += 1;
+    schedule_flush(cl);
+}
+
+/*
+    Applies backpressure before a frame is queued.
+    Returns 1 if the frame should be added to queue, 0 if it is dropped or merged.
+*/
+int admit_frame(client* cl, shared_frame* frame, int kind){
+
+    if(cl->slow_since != 0 && now_ms() - cl->slow_since >= options.slow_timeout){ // Client stayed over the high watermark too long.
+        if(options.slow_policy == POLICY_DISCONNECT){
+            evict_client(cl);
+            return 0;
+        }
+        if(kind != FRAME_KIND_REPLY && options.slow_policy == POLICY_DROP){
+            cl->dropped_frames += 1;
+            return 0;
+        }
+        if(kind != FRAME_KIND_REPLY && options.slow_policy == POLICY_COALESCE){
+            int i = 0;
+            int writing = writing_frames(cl);
+            if(kind == FRAME_KIND_COUNTER){ // Waiting counter is replaced with the new one.
+                for(i = cl->queue_count - 1 ; i >= writing ; i--){
+                    outbound_entry* entry = &cl->queue[(cl->queue_head + i) % cl->queue_capacity];
+                    if(entry->kind == FRAME_KIND_COUNTER){
+                        cl->queued_bytes += frame->length;
+                        cl->queued_bytes -= entry->frame->length;
+                        retain_frame(frame);
+                        release_frame(entry->frame);
+                        entry->frame = frame;
+                        return 0;
+                    }
+                }
+            }
+            drop_waiting_messages(cl, frame->length);
+        }
+    }
+
+    if(cl->queue_count == QUEUE_MAX_SLOTS || cl->queued_bytes + frame->length > options.high_watermark * QUEUE_LIMIT_FACTOR){ // Queue cannot grow anymore.
+        if(kind == FRAME_KIND_REPLY || options.slow_policy == POLICY_DISCONNECT){ // Client would miss an answer, it is disconnected.
+            evict_client(cl);
+        }
+        else{
+            cl->dropped_frames += 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Adds frame to the end of the queue.
+*/
+void push_frame(client* cl, shared_frame* frame, int kind){
+
+    if(cl->queue_count == cl->queue_capacity){ // Ring is full, it is grown in order.
+        int capacity = cl->queue_capacity == 0 ? QUEUE_INITIAL_SLOTS : cl->queue_capacity * 2;
+        outbound_entry* queue = (outbound_entry*)malloc(sizeof(outbound_entry) * capacity);
+        int i = 0;
+        for(i = 0 ; i < cl->queue_count ; i++){
+            queue[i] = cl->queue[(cl->queue_head + i) % cl->queue_capacity];
+        }
+        free(cl->queue);
+        cl->queue = queue;
+        cl->queue_capacity = capacity;
+        cl->queue_head = 0;
+    }
+
+    if(cl->queue_count == 0)
+        cl->queue_offset = 0;
+    retain_frame(frame); // Queue keeps the frame until it is written.
+    cl->queue[(cl->queue_head + cl->queue_count) % cl->queue_capacity].frame = frame;
+    cl->queue[(cl->queue_head + cl->queue_count) % cl->queue_capacity].kind = kind;
+    cl->queue_count += 1;
+    cl->queued_bytes += frame->length;
+
+    if(cl->queued_bytes > options.high_watermark && cl->slow_since == 0){
+        cl->slow_since = now_ms();
+    }
+}
+
+/*
+    Returns the number of frames at the head of queue that are being written. A partly written frame
+    is on the wire already and frames of a sendmsg that io_uring has not completed are read by the kernel,
+    remove_written takes the written bytes from them, so they cannot be dropped or replaced.
+*/
+int writing_frames(client* cl){
+
+    if(cl->send_request != NULL)
+        return cl->send_request->frame_count;
+    return cl->queue_offset > 0 ? 1 : 0;
+}
+
+/*
+    Drops oldest waiting room messages until a frame with given length fits under the high watermark.
+    Frames that are being written are kept.
+*/
+void drop_waiting_messages(client* cl, size_t length){
+
+    int i = 0;
+    int kept = 0;
+    int writing = writing_frames(cl);
+    for(i = 0 ; i < cl->queue_count ; i++){
+        outbound_entry entry = cl->queue[(cl->queue_head + i) % cl->queue_capacity];
+        if(i >= writing && entry.kind != FRAME_KIND_REPLY && cl->queued_bytes + length > options.high_watermark){
+            cl->queued_bytes -= entry.frame->length;
+            cl->dropped_frames += 1;
+            release_frame(entry.frame);
+            continue;
+        }
+        cl->queue[(cl->queue_head + kept) % cl->queue_capacity] = entry; // Kept frames are moved together in order.
+        kept += 1;
+    }
+    cl->queue_count = kept;
+}
+
+/*
+    Writes waiting frames and files until nothing waits or the socket is full.
+    Several frames are written with one call. If they do not fit into one call,
+    socket is corked until all of them are written, so the last call does not send a small segment.
+    Files are written one frame at a time when no frame waits.
+*/
+void write_queue(client* cl){
+
+    if(this_shard->ring != NULL){ // Kernel writes the queue, shard only learns the result.
+        uring_write_queue(cl);
+        return;
+    }
+
+    int corked = 0;
+    int flag = 1;
+    if(cl->queue_count > MAX_IOVEC){
+        setsockopt(cl->socket, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
+        corked = 1;
+    }
+
+    while(cl->queue_count > 0 || cl->files != NULL){
+
+        if(cl->files != NULL && (cl->queue_count == 0 || cl->files->offset != cl->files->frame_end)){ // A started frame of file is finished before other frames.
+            if(!write_file(cl))
+                break;
+            continue;
+        }
+
+        struct iovec parts[MAX_IOVEC];
+        struct msghdr message;
+        int part_number = 0;
+        while(part_number < cl->queue_count && part_number < MAX_IOVEC){
+            shared_frame* frame = cl->queue[(cl->queue_head + part_number) % cl->queue_capacity].frame;
+            size_t offset = part_number == 0 ? cl->queue_offset : 0;
+            parts[part_number].iov_base = frame->data + offset;
+            parts[part_number].iov_len = frame->length - offset;
+            part_number += 1;
+        }
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = parts;
+        message.msg_iovlen = part_number;
+
+        ssize_t bytes = sendmsg(cl->socket, &message, MSG_NOSIGNAL);
+        if(bytes < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) // Socket is broken, shard will disconnect client.
+                cl->connection_flag = DISCONNECTED;
+            else
+                cl->blocked = 1;
+            break; // Socket is full (EPOLLOUT will be reported).
+        }
+        __atomic_fetch_add(&this_shard->metrics.socket_writes, 1, __ATOMIC_RELAXED);
+        remove_written(cl, bytes);
+    }
+
+    if(corked){ // Rest of the data is sent now, the kernel keeps sending it if the socket is full.
+        flag = 0;
+        setsockopt(cl->socket, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
+    }
+}
+
+/*
+    Writes the first waiting file of client with sendfile until the end of its current frame.
+    Bytes go from page cache to socket, they are not copied into the shard.
+    Returns 1 if something is written, 0 if the socket is full or broken.
+*/
+int write_file(client* cl){
+
+    file_transfer* transfer = cl->files;
+    shared_file* file = transfer->file;
+
+    if(transfer->offset == transfer->frame_end){ // Next frame of file: announcement or a data frame.
+        if((size_t)transfer->offset < file->first_length)
+            transfer->frame_end = file->first_length;
+        else
+            transfer->frame_end = transfer->offset + file->frame_length;
+        if((size_t)transfer->frame_end > file->size)
+            transfer->frame_end = file->size;
+    }
+
+    ssize_t bytes = sendfile(cl->socket, file->fd, &transfer->offset, transfer->frame_end - transfer->offset);
+    if(bytes < 0){
+        if(errno == EINTR)
+            return 1;
+        if(errno != EAGAIN && errno != EWOULDBLOCK) // Socket is broken, shard will disconnect client.
+            cl->connection_flag = DISCONNECTED;
+        else
+            cl->blocked = 1;
+        return 0;
+    }
+    __atomic_fetch_add(&this_shard->metrics.socket_writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&this_shard->metrics.file_bytes, bytes, __ATOMIC_RELAXED);
+
+    if(bytes == 0 || (size_t)transfer->offset == file->size){ // File is written (or spool file ended early).
+        cl->files = transfer->next;
+        if(cl->files == NULL){
+            int lowat = 0; // System default again.
+            setsockopt(cl->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+            cl->last_file = NULL;
+        }
+        cl->file_count -= 1;
+        release_file(file);
+        free(transfer);
+    }
+    return 1;
+}
+
+/*
+    Adds a reference to spooled file.
+*/
+void retain_file(shared_file* file){
+
+    __atomic_add_fetch(&file->reference_counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Removes a reference from spooled file. Last reference closes the spool file, so its disk space is freed.
+*/
+void release_file(shared_file* file){
+
+    if(__atomic_sub_fetch(&file->reference_counter, 1, __ATOMIC_ACQ_REL) == 0){
+        close(file->fd);
+        free(file);
+    }
+}
+
+/*
+    Releases all waiting files of client.
+*/
+void clear_files(client* cl){
+
+    while(cl->files != NULL){
+        file_transfer* transfer = cl->files;
+        cl->files = transfer->next;
+        release_file(transfer->file);
+        free(transfer);
+    }
+    cl->last_file = NULL;
+    cl->file_count = 0;
+}
+
+/*
+    Removes written bytes from the beginning of queue.
+*/
+void remove_written(client* cl, size_t bytes){
+
+    cl->queued_bytes -= bytes;
+    while(bytes > 0){
+        outbound_entry* entry = &cl->queue[cl->queue_head];
+        size_t remaining = entry->frame->length - cl->queue_offset;
+        if(bytes < remaining){
+            cl->queue_offset += bytes;
+            break;
+        }
+        bytes -= remaining;
+        release_frame(entry->frame);
+        cl->queue_head = (cl->queue_head + 1) % cl->queue_capacity;
+        cl->queue_count -= 1;
+        cl->queue_offset = 0;
+        __atomic_fetch_add(&this_shard->metrics.written_frames, 1, __ATOMIC_RELAXED);
+    }
+
+    if(cl->queued_bytes <= options.low_watermark)
+        cl->slow_since = 0; // Client is not slow anymore.
+}
+
+/*
+    Writes waiting frames and files of client when its socket is writable again.
+*/
+void flush_client(client* cl){
+
+    cl->blocked = 0;
+    if(cl->connection_flag == ALIVE && !cl->evicted)
+        write_queue(cl);
+}
+
+/*
+    Writes the queues of clients in flush list whose time has come. Clients whose flush window
+    is not over stay in the list. Returns the time (ms) until the earliest of them, -1 if the list is empty.
+*/
+int flush_waiting_clients(void){
+
+    long long now = options.flush_window > 0 ? now_ms() : 0;
+    long long next = -1;
+    int kept = 0;
+    int i = 0;
+
+    for(i = 0 ; i < this_shard->flush_count ; i++){
+        client* cl = find_client(this_shard->flush_clients[i]);
+        if(cl == NULL) // Client is disconnected.
+            continue;
+        if(cl->queue_count > 0 && cl->flush_at > now && !cl->blocked){ // Flush window is not over.
+            if(next == -1 || cl->flush_at < next)
+                next = cl->flush_at;
+            this_shard->flush_clients[kept++] = cl->id;
+            continue;
+        }
+        cl->flush_listed = 0;
+        if((cl->queue_count > 0 || cl->files != NULL) && !cl->blocked && cl->connection_flag == ALIVE && !cl->evicted)
+            write_queue(cl);
+    }
+    this_shard->flush_count = kept;
+
+    return next == -1 ? -1 : (int)(next - now);
+}
+
+/*
+    Disconnects a slow client. Socket is only shut down here because caller may be delivering a broadcast,
+    shard sees the end of connection and disconnects the client normally.
+*/
+void evict_client(client* cl){
+
+    if(cl->evicted)
+        return;
+    cl->evicted = 1;
+    shutdown(cl->socket, SHUT_RDWR);
+    char result[64];
+    snprintf(result, sizeof(result), "%zu bytes were waiting", cl->queued_bytes);
+    log_action(LOG_WARN, cl, "Disconnected because it is too slow", result);
+}
+
+/*
+    Releases all waiting frames of client.
+*/
+void clear_queue(client* cl){
+
+    while(cl->queue_count > 0){
+        release_frame(cl->queue[cl->queue_head].frame);
+        cl->queue_head = (cl->queue_head + 1) % cl->queue_capacity;
+        cl->queue_count -= 1;
+    }
+    free(cl->queue);
+    cl->queue = NULL;
+    cl->queue_capacity = 0;
+    cl->queue_head = 0;
+    cl->queue_offset = 0;
+    cl->queued_bytes = 0;
+}
+
+/*
+    Returns monotonic time in milliseconds.
+*/
+long long now_ms(void){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+    Adds a value to a histogram of calling shard. Values are in base units of histogram (ns or frames).
+*/
+void observe_histogram(int type, long long value){
+
+    histogram* h = &histograms[type];
+    histogram_counts* counts = &this_shard->metrics.histograms[type];
+    int bucket = 0;
+    while(bucket < h->bound_count && value > h->bounds[bucket])
+        bucket += 1;
+    __atomic_fetch_add(&counts->buckets[bucket], 1, __ATOMIC_RELAXED); // Only the shard writes, admin thread reads.
+    __atomic_fetch_add(&counts->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counts->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Opens admin sockets and starts admin thread.
+    Unix socket is used if its path is given, loopback port is used if it is not 0.
+    Returns 0 on success.
+*/
+int start_admin(void){
+
+    pthread_t admin;
+
+    if(options.admin_socket[0] != '\0'){
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, options.admin_socket, sizeof(address.sun_path) - 1);
+        unlink(options.admin_socket); // Socket file of a previous run is removed.
+        admin_sockets[0] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(admin_sockets[0] == -1 || bind(admin_sockets[0], (struct sockaddr*)&address, sizeof(address)) < 0){
+            printf("Could not open admin socket: %s\n", options.admin_socket);
+            return ADMIN_ERR;
+        }
+        listen(admin_sockets[0], 8);
+    }
+
+    if(options.admin_port != 0){
+        struct sockaddr_in address;
+        int reuse = 1;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Metrics are not served outside the machine.
+        address.sin_port = htons(options.admin_port);
+        admin_sockets[1] = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(admin_sockets[1], SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(admin_sockets[1] == -1 || bind(admin_sockets[1], (struct sockaddr*)&address, sizeof(address)) < 0){
+            printf("Could not open admin port: %d\n", options.admin_port);
+            return ADMIN_ERR;
+        }
+        listen(admin_sockets[1], 8);
+    }
+
+    if(admin_sockets[0] == -1 && admin_sockets[1] == -1) // Admin socket is disabled.
+        return 0;
+
+    if(pthread_create(&admin, NULL, admin_loop, NULL) != 0){
+        puts("Could not create thread");
+        return THREAD_CREATE_ERR;
+    }
+    pthread_detach(admin);
+
+    return 0;
+}
+
+/*
+    This function is used by admin thread.
+    Every connection to an admin socket gets the current metrics and is closed.
+*/
+void* admin_loop(void* arg){
+
+    struct pollfd sockets[2];
+    int i = 0;
+
+    for(i = 0 ; i < 2 ; i++){
+        sockets[i].fd = admin_sockets[i]; // Negative descriptors are ignored by poll.
+        sockets[i].events = POLLIN;
+    }
+
+    while(1){
+        if(poll(sockets, 2, -1) < 0)
+            continue;
+        for(i = 0 ; i < 2 ; i++){
+            if(sockets[i].revents & POLLIN){
+                int connection = accept(sockets[i].fd, NULL, NULL);
+                if(connection >= 0){
+                    serve_metrics(connection);
+                    close(connection);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes all metrics to an admin connection in Prometheus text format.
+    An HTTP request gets an HTTP response, anything else gets only the text.
+*/
+void serve_metrics(int connection){
+
+    char request[1024];
+    struct timeval timeout = {0, ADMIN_READ_TIMEOUT};
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t length = recv(connection, request, sizeof(request) - 1, 0); // Request is optional.
+
+    char* body = format_metrics(&request_arena);
+    if(length >= 4 && strncmp(request, "GET ", 4) == 0){
+        char* header = arena_printf(&request_arena, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", strlen(body));
+        send(connection, header, strlen(header), MSG_NOSIGNAL);
+    }
+
+    size_t written = 0;
+    size_t body_length = strlen(body);
+    while(written < body_length){
+        ssize_t bytes = send(connection, body + written, body_length - written, MSG_NOSIGNAL);
+        if(bytes <= 0)
+            break;
+        written += bytes;
+    }
+    arena_reset(&request_arena);
+}
+
+/*
+    Formats counters and histograms in Prometheus text format. Counters of all shards are summed.
+*/
+char* format_metrics(arena* a){
+
+    static const char* command_names[] = {"list", "create", "pcreate", "enter", "quit", "msg", "whoami", "exit", "message", "invalid", "history", "send", "compact"};
+    server_metrics total;
+    int i = 0;
+    int s = 0;
+    char* text = arena_strdup(a, "");
+
+    memset(&total, 0, sizeof(total));
+    for(s = 0 ; s < shard_count ; s++){ // Counters of a shard change while they are read, every counter is read once.
+        server_metrics* m = &shards[s].metrics;
+        total.accepted_connections += __atomic_load_n(&m->accepted_connections, __ATOMIC_RELAXED);
+        total.active_connections += __atomic_load_n(&m->active_connections, __ATOMIC_RELAXED);
+        for(i = 0 ; i < BUSY_REASONS ; i++)
+            total.rejected_connections[i] += __atomic_load_n(&m->rejected_connections[i], __ATOMIC_RELAXED);
+        for(i = 0 ; i < COMMAND_TYPES ; i++)
+            total.commands[i] += __atomic_load_n(&m->commands[i], __ATOMIC_RELAXED);
+        total.fanout_messages += __atomic_load_n(&m->fanout_messages, __ATOMIC_RELAXED);
+        total.fanout_bytes += __atomic_load_n(&m->fanout_bytes, __ATOMIC_RELAXED);
+        total.set_password_prompts += __atomic_load_n(&m->set_password_prompts, __ATOMIC_RELAXED);
+        total.enter_password_prompts += __atomic_load_n(&m->enter_password_prompts, __ATOMIC_RELAXED);
+        total.password_timeouts += __atomic_load_n(&m->password_timeouts, __ATOMIC_RELAXED);
+        total.shard_messages += __atomic_load_n(&m->shard_messages, __ATOMIC_RELAXED);
+        total.history_frames += __atomic_load_n(&m->history_frames, __ATOMIC_RELAXED);
+        total.socket_writes += __atomic_load_n(&m->socket_writes, __ATOMIC_RELAXED);
+        total.written_frames += __atomic_load_n(&m->written_frames, __ATOMIC_RELAXED);
+        total.file_uploads += __atomic_load_n(&m->file_uploads, __ATOMIC_RELAXED);
+        total.file_bytes += __atomic_load_n(&m->file_bytes, __ATOMIC_RELAXED);
+    }
+
+    text = arena_append(a, text, "# HELP deuchat_connections_accepted_total Connections accepted since the server started.\n"
+                                 "# TYPE deuchat_connections_accepted_total counter\n"
+                                 "deuchat_connections_accepted_total %llu\n", total.accepted_connections);
+    text = arena_append(a, text, "# HELP deuchat_connections_active Connected clients.\n"
+                                 "# TYPE deuchat_connections_active gauge\n"
+                                 "deuchat_connections_active %lld\n", total.active_connections);
+    text = arena_append(a, text, "# HELP deuchat_connections_rejected_total Connections that were told server is busy, by reason.\n"
+                                 "# TYPE deuchat_connections_rejected_total counter\n");
+    for(i = 0 ; i < BUSY_REASONS ; i++){
+        text = arena_append(a, text, "deuchat_connections_rejected_total{reason=\"%s\"} %llu\n", busy_reasons[i], total.rejected_connections[i]);
+    }
+    text = arena_append(a, text, "# HELP deuchat_shard_connections_active Connected clients by shard.\n"
+                                 "# TYPE deuchat_shard_connections_active gauge\n");
+    for(s = 0 ; s < shard_count ; s++){
+        text = arena_append(a, text, "deuchat_shard_connections_active{shard=\"%d\"} %lld\n", s, __atomic_load_n(&shards[s].metrics.active_connections, __ATOMIC_RELAXED));
+    }
+    text = arena_append(a, text, "# HELP deuchat_commands_total Commands by type, message is a room message without -msg.\n"
+                                 "# TYPE deuchat_commands_total counter\n");
+    for(i = 0 ; i < COMMAND_TYPES ; i++){
+        text = arena_append(a, text, "deuchat_commands_total{command=\"%s\"} %llu\n", command_names[i], total.commands[i]);
+    }
+    text = arena_append(a, text, "# HELP deuchat_fanout_messages_total Frames given to room members by broadcasts.\n"
+                                 "# TYPE deuchat_fanout_messages_total counter\n"
+                                 "deuchat_fanout_messages_total %llu\n", total.fanout_messages);
+    text = arena_append(a, text, "# HELP deuchat_fanout_bytes_total Bytes given to room members by broadcasts.\n"
+                                 "# TYPE deuchat_fanout_bytes_total counter\n"
+                                 "deuchat_fanout_bytes_total %llu\n", total.fanout_bytes);
+    text = arena_append(a, text, "# HELP deuchat_password_prompts_total Password prompts sent to clients.\n"
+                                 "# TYPE deuchat_password_prompts_total counter\n"
+                                 "deuchat_password_prompts_total{kind=\"set\"} %llu\n"
+                                 "deuchat_password_prompts_total{kind=\"enter\"} %llu\n",
+                                 total.set_password_prompts, total.enter_password_prompts);
+    text = arena_append(a, text, "# HELP deuchat_password_timeouts_total Password prompts that are not answered in time.\n"
+                                 "# TYPE deuchat_password_timeouts_total counter\n"
+                                 "deuchat_password_timeouts_total %llu\n", total.password_timeouts);
+    text = arena_append(a, text, "# HELP deuchat_cross_shard_messages_total Messages sent from one shard to another.\n"
+                                 "# TYPE deuchat_cross_shard_messages_total counter\n"
+                                 "deuchat_cross_shard_messages_total %llu\n", total.shard_messages);
+    text = arena_append(a, text, "# HELP deuchat_history_frames_total Messages in room history sent to entering clients.\n"
+                                 "# TYPE deuchat_history_frames_total counter\n"
+                                 "deuchat_history_frames_total %llu\n", total.history_frames);
+    text = arena_append(a, text, "# HELP deuchat_socket_writes_total Calls that write queued frames to client sockets.\n"
+                                 "# TYPE deuchat_socket_writes_total counter\n"
+                                 "deuchat_socket_writes_total %llu\n", total.socket_writes);
+    text = arena_append(a, text, "# HELP deuchat_written_frames_total Frames written to client sockets.\n"
+                                 "# TYPE deuchat_written_frames_total counter\n"
+                                 "deuchat_written_frames_total %llu\n", total.written_frames);
+    text = arena_append(a, text, "# HELP deuchat_file_uploads_total Files spooled and shared with a room.\n"
+                                 "# TYPE deuchat_file_uploads_total counter\n"
+                                 "deuchat_file_uploads_total %llu\n", total.file_uploads);
+    text = arena_append(a, text, "# HELP deuchat_file_bytes_total Spooled bytes written to client sockets with sendfile.\n"
+                                 "# TYPE deuchat_file_bytes_total counter\n"
+                                 "deuchat_file_bytes_total %llu\n", total.file_bytes);
+
+    for(i = 0 ; i < HISTOGRAM_TYPES ; i++){
+        text = arena_append(a, text, "# HELP %s %s\n# TYPE %s histogram\n", histograms[i].name, histograms[i].help, histograms[i].name);
+        text = format_histogram(a, text, i);
+    }
+
+    return text;
+}
+
+/*
+    Appends buckets, sum and count of a histogram of all shards to text. Buckets are cumulative.
+*/
+char* format_histogram(arena* a, char* text, int type){
+
+    histogram* h = &histograms[type];
+    histogram_counts total;
+    unsigned long long cumulative = 0;
+    int i = 0;
+    int s = 0;
+
+    memset(&total, 0, sizeof(total));
+    for(s = 0 ; s < shard_count ; s++){
+        histogram_counts* counts = &shards[s].metrics.histograms[type];
+        for(i = 0 ; i <= h->bound_count ; i++)
+            total.buckets[i] += __atomic_load_n(&counts->buckets[i], __ATOMIC_RELAXED);
+        total.sum += __atomic_load_n(&counts->sum, __ATOMIC_RELAXED);
+        total.count += __atomic_load_n(&counts->count, __ATOMIC_RELAXED);
+    }
+
+    for(i = 0 ; i <= h->bound_count ; i++){
+        cumulative += total.buckets[i];
+        if(i < h->bound_count)
+            text = arena_append(a, text, "%s_bucket{le=\"%g\"} %llu\n", h->name, h->bounds[i] * h->scale, cumulative);
+        else
+            text = arena_append(a, text, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, cumulative);
+    }
+    text = arena_append(a, text, "%s_sum %g\n", h->name, total.sum * h->scale);
+    text = arena_append(a, text, "%s_count %llu\n", h->name, total.count);
+
+    return text;
+}
+
+/*
+    Returns monotonic time in nanoseconds.
+*/
+long long now_ns(void){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Logs an action of client. Record is only copied into the ring of thread,
+    it is formatted and written by log writer thread.
+*/
+void log_action(int level, client* cl, char* action, char* result){
+
+    if(level < options.log_level)
+        return;
+
+    log_record* record = reserve_log_record();
+    if(record == NULL)
+        return;
+    record->level = level;
+    record->client_id = cl->id;
+    record->socket = cl->socket;
+    snprintf(record->nickname, sizeof(record->nickname), "%s", cl->nickname == NULL ? "-" : cl->nickname);
+    snprintf(record->action, sizeof(record->action), "%s", action);
+    snprintf(record->result, sizeof(record->result), "%s", result);
+    commit_log_record();
+}
+
+/*
+    Logs a server event that does not belong to a client.
+*/
+void log_message(int level, const char* format, ...){
+
+    if(level < options.log_level)
+        return;
+
+    log_record* record = reserve_log_record();
+    if(record == NULL)
+        return;
+    va_list args;
+    va_start(args, format);
+    record->level = level;
+    record->client_id = -1;
+    record->socket = -1;
+    strcpy(record->nickname, "-");
+    vsnprintf(record->action, sizeof(record->action), format, args);
+    record->result[0] = '\0';
+    va_end(args);
+    commit_log_record();
+}
+
+/*
+    Returns the next free record in the ring of calling thread, NULL if the ring is full.
+    A full ring drops the record, commands never wait for the log writer.
+*/
+log_record* reserve_log_record(void){
+
+    if(thread_log_ring == NULL){ // First record of thread, its ring is added to the list of writer.
+        thread_log_ring = (log_ring*)calloc(1, sizeof(log_ring));
+        thread_log_ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+        while(!__atomic_compare_exchange_n(&log_rings, &thread_log_ring->next, thread_log_ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+
+    log_ring* ring = thread_log_ring;
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(ring->head - tail == LOG_RING_SIZE){
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    log_record* record = &ring->records[ring->head % LOG_RING_SIZE];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    return record;
+}
+
+/*
+    Makes the reserved record visible to log writer.
+*/
+void commit_log_record(void){
+
+    __atomic_store_n(&thread_log_ring->head, thread_log_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Opens log file and starts log writer thread.
+    Returns 0 on success.
+*/
+int start_logging(void){
+
+    pthread_t writer;
+
+    if(strcmp(options.log_file, "-") == 0)
+        log_file = stdout;
+    else
+        log_file = fopen(options.log_file, "a");
+    if(log_file == NULL){
+        printf("Could not open log file: %s\n", options.log_file);
+        return LOG_ERR;
+    }
+
+    if(pthread_create(&writer, NULL, log_writer, NULL) != 0){
+        puts("Could not create thread");
+        return THREAD_CREATE_ERR;
+    }
+    pthread_detach(writer);
+
+    return 0;
+}
+
+/*
+    This function is used by log writer thread.
+    Moves records from the rings of all threads into log file.
+    File is flushed when there is nothing to write.
+*/
+void* log_writer(void* arg){
+
+    while(1){
+
+        int written = 0;
+        log_ring* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+        for( ; ring != NULL ; ring = ring->next){
+            unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            while(ring->tail != head){
+                write_log_record(&ring->records[ring->tail % LOG_RING_SIZE]);
+                __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE); // Record can be used again.
+                written += 1;
+            }
+            unsigned int dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if(dropped != ring->reported){
+                fprintf(log_file, "level=warn action=\"%u log records are dropped\"\n", dropped - ring->reported);
+                ring->reported = dropped;
+            }
+        }
+
+        if(written == 0){
+            fflush(log_file);
+            usleep(LOG_IDLE_SLEEP);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes one record as a line of key=value fields.
+*/
+void write_log_record(log_record* record){
+
+    static const char* level_names[] = {"debug", "info", "warn", "error"};
+    char time_text[32];
+    time_t seconds = record->time_ms / 1000;
+    struct tm parts;
+    gmtime_r(&seconds, &parts);
+    strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%S", &parts);
+
+    fprintf(log_file, "time=%s.%03dZ level=%s client=%d socket=%d nickname=", time_text, (int)(record->time_ms % 1000), level_names[record->level], record->client_id, record->socket);
+    write_log_text(record->nickname);
+    fputs(" action=", log_file);
+    write_log_text(record->action);
+    if(record->result[0] != '\0'){
+        fputs(" result=", log_file);
+        write_log_text(record->result);
+    }
+    fputc('\n', log_file);
+}
+
+/*
+    Writes a quoted text. Quotes and line breaks are escaped, so every record is one line.
+*/
+void write_log_text(const char* text){
+
+    fputc('"', log_file);
+    for( ; *text != '\0' ; text++){
+        if(*text == '"' || *text == '\\'){
+            fputc('\\', log_file);
+            fputc(*text, log_file);
+        }
+        else if(*text == '\n')
+            fputs("\\n", log_file);
+        else
+            fputc(*text, log_file);
+    }
+    fputc('"', log_file);
+}
+
+/*
+    Opens the room journal if a data directory is given. Rooms and their history are
+    recovered from the current epoch, written into a new epoch and old files are removed.
+    Called before shards start, so it uses the tables of shards directly.
+    Returns 0 on success.
+*/
+int start_journal(void){
+
+    pthread_t syncer;
+    char path[PATH_MAX];
+    int epoch = 0;
+    int recovered = 0;
+    int i = 0;
+
+    if(options.data_dir[0] == '\0') // Persistence is disabled.
+        return 0;
+
+    if(mkdir(options.data_dir, 0755) < 0 && errno != EEXIST){
+        printf("Could not create data directory: %s\n", options.data_dir);
+        return JOURNAL_ERR;
+    }
+    snprintf(path, sizeof(path), "%s/CURRENT", options.data_dir);
+    FILE* current = fopen(path, "r");
+    if(current != NULL){
+        if(fscanf(current, "%d", &epoch) != 1)
+            epoch = 0;
+        fclose(current);
+    }
+
+    long long start = now_ms();
+    if((recovered = recover_journal(epoch)) < 0){
+        printf("Could not read journal of epoch %d\n", epoch);
+        return JOURNAL_ERR;
+    }
+
+    for(i = 0 ; i < shard_count ; i++){ // Recovered rooms are the first records of new epoch.
+        this_shard = &shards[i];
+        this_shard->journal_epoch = epoch + 1;
+        if((this_shard->journal = open_segment(epoch + 1, i, 0)) == NULL){
+            printf("Could not create journal segment in %s\n", options.data_dir);
+            return JOURNAL_ERR;
+        }
+        this_shard->journal_sequence = 1;
+        snapshot_rooms();
+        this_shard->snapshot_bytes = this_shard->journal_bytes;
+        this_shard->journal_bytes = 0;
+        sync_segment(this_shard->journal);
+    }
+    this_shard = NULL;
+
+    snprintf(path, sizeof(path), "%s/CURRENT.tmp", options.data_dir);
+    current = fopen(path, "w");
+    if(current == NULL || fprintf(current, "%d\n", epoch + 1) < 0 || fflush(current) != 0 || fsync(fileno(current)) < 0){
+        printf("Could not write %s\n", path);
+        return JOURNAL_ERR;
+    }
+    fclose(current);
+    char current_path[PATH_MAX];
+    snprintf(current_path, sizeof(current_path), "%s/CURRENT", options.data_dir);
+    if(rename(path, current_path) < 0){ // New epoch is used from now on, even if the server crashes before old files are removed.
+        printf("Could not write %s\n", current_path);
+        return JOURNAL_ERR;
+    }
+    remove_old_segments(epoch + 1);
+    printf("Recovered %d rooms from journal in %lld ms\n", recovered, now_ms() - start);
+
+    if(pthread_create(&syncer, NULL, journal_syncer, NULL) != 0){
+        puts("Could not create thread");
+        return THREAD_CREATE_ERR;
+    }
+    pthread_detach(syncer);
+
+    return 0;
+}
+
+/*
+    Creates a journal segment of given shard. Whole segment is mapped, but only its first step
+    is allocated on disk, the rest is allocated while records are appended. Returns NULL on error.
+*/
+journal_segment* open_segment(int epoch, int shard_index, int sequence){
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08d-%03d-%08d.journal", options.data_dir, epoch, shard_index, sequence);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return NULL;
+    size_t reserved = options.segment_size < JOURNAL_RESERVE_STEP ? options.segment_size : JOURNAL_RESERVE_STEP;
+    if(posix_fallocate(fd, 0, reserved) != 0){
+        close(fd);
+        return NULL;
+    }
+    char* base = (char*)mmap(NULL, options.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+
+    journal_segment* segment = (journal_segment*)calloc(1, sizeof(journal_segment));
+    segment->base = base;
+    segment->size = options.segment_size;
+    segment->reserved = reserved;
+    segment->fd = fd;
+    segment->sequence = sequence;
+    return segment;
+}
+
+/*
+    Appends a record to the journal of calling shard. Record is only copied into mapped
+    segment, it is written to disk by journal syncer. A new segment is started when
+    the record does not fit into the current one.
+*/
+void journal_append(int type, int room_id, int value, const char* first, size_t first_length, const char* second, size_t second_length){
+
+    journal_segment* segment = this_shard->journal;
+    if(segment == NULL) // Persistence is disabled or journal is being recovered.
+        return;
+
+    journal_record header;
+    size_t length = sizeof(header) + first_length + second_length;
+    size_t padded = (length + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+    if(segment->written + padded > segment->size && (segment = roll_segment()) == NULL){
+        log_message(LOG_ERROR, "Could not create journal segment: %s", strerror(errno));
+        this_shard->journal_dropped += 1;
+        return;
+    }
+    if(segment->written + padded > __atomic_load_n(&segment->reserved, __ATOMIC_ACQUIRE) && !reserve_segment(segment, segment->written + padded)){ // Syncer is behind, mapped pages after the end of file cannot be written.
+        log_message(LOG_ERROR, "Could not allocate journal segment: %s", strerror(errno));
+        this_shard->journal_dropped += 1;
+        return;
+    }
+    this_shard->journal_bytes += padded;
+
+    char* record = segment->base + segment->written;
+    header.length = first_length + second_length;
+    header.checksum = 0;
+    header.type = type;
+    header.room_id = room_id;
+    header.value = value;
+    memcpy(record + sizeof(header), first, first_length);
+    if(second_length > 0)
+        memcpy(record + sizeof(header) + first_length, second, second_length);
+    memcpy(record, &header, sizeof(header));
+    header.checksum = journal_checksum(record, length);
+    memcpy(record, &header, sizeof(header));
+    __atomic_store_n(&segment->written, segment->written + padded, __ATOMIC_RELEASE);
+}
+
+/*
+    Starts the next segment of calling shard. Segment that journal syncer opened is used,
+    it is opened here only if syncer is behind. Full segment is given to syncer.
+    Returns the new segment, NULL on error.
+*/
+journal_segment* roll_segment(void){
+
+    journal_segment* segment = this_shard->journal;
+    journal_segment* next = __atomic_exchange_n(&this_shard->spare_segment, NULL, __ATOMIC_ACQUIRE);
+    if(next != NULL && next->sequence < segment->sequence){ // Syncer took its number before the shard opened one, it stays empty.
+        retire_segment(next);
+        next = NULL;
+    }
+    if(next == NULL)
+        next = open_segment(this_shard->journal_epoch, this_shard->index, __atomic_fetch_add(&this_shard->journal_sequence, 1, __ATOMIC_SEQ_CST));
+    if(next == NULL)
+        return NULL;
+
+    retire_segment(segment);
+    __atomic_store_n(&this_shard->journal, next, __ATOMIC_RELEASE);
+    return next;
+}
+
+/*
+    Gives a segment of calling shard to journal syncer, syncer writes and unmaps it.
+*/
+void retire_segment(journal_segment* segment){
+
+    segment->next = __atomic_load_n(&this_shard->retired_segments, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&this_shard->retired_segments, &segment->next, segment, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+    Allocates the next steps of segment file on disk until it has given length.
+    Journal syncer allocates ahead of the shard, the shard does it only if syncer is behind.
+    Returns 0 if the disk is full.
+*/
+int reserve_segment(journal_segment* segment, size_t length){
+
+    size_t reserved = (length + JOURNAL_RESERVE_STEP - 1) / JOURNAL_RESERVE_STEP * JOURNAL_RESERVE_STEP;
+    size_t old = __atomic_load_n(&segment->reserved, __ATOMIC_ACQUIRE);
+    if(reserved > segment->size)
+        reserved = segment->size;
+    if(reserved <= old)
+        return 1;
+    int result = posix_fallocate(segment->fd, old, reserved - old);
+    if(result != 0){
+        errno = result;
+        return 0;
+    }
+    while(old < reserved && !__atomic_compare_exchange_n(&segment->reserved, &old, reserved, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)); // Other thread may have allocated more.
+    return 1;
+}
+
+/*
+    Appends creation of a room to journal. Its history size is recorded with it.
+*/
+void journal_room(chat_room* room){
+
+    const char* password = room->password == NULL ? "" : room->password;
+    journal_append(JOURNAL_CREATE, room->id, room->type, room->name, strlen(room->name) + 1, password, strlen(password) + 1);
+    journal_append(JOURNAL_HISTORY, room->id, room->history_capacity, NULL, 0, NULL, 0);
+}
+
+/*
+    Appends every active room of calling shard and the messages in its history to journal.
+*/
+void snapshot_rooms(void){
+
+    int i = 0;
+    int t = 0;
+    for(i = 0 ; i < this_shard->rooms.slot_count ; i++){
+        chat_room* room = (chat_room*)this_shard->rooms.chunks[i / CHUNK_SLOTS] + i % CHUNK_SLOTS;
+        if(room->is_active != ROOM_ACTIVE)
+            continue;
+        journal_room(room);
+        for(t = 0 ; t < room->history_count ; t++){ // Oldest message first.
+            shared_frame* frame = room->history[(room->history_head - room->history_count + t + room->history_capacity) % room->history_capacity];
+            journal_append(JOURNAL_MESSAGE, room->id, 0, frame->data, frame->length, NULL, 0);
+        }
+    }
+}
+
+/*
+    Starts a new segment with a snapshot of the rooms of calling shard when enough records are
+    appended after the last snapshot. Journal syncer removes older segments when it is on disk.
+*/
+void compact_journal(void){
+
+    if(this_shard->journal == NULL || this_shard->journal_bytes < options.segment_size * JOURNAL_COMPACT_SEGMENTS || this_shard->journal_bytes < this_shard->snapshot_bytes * 2)
+        return;
+
+    journal_segment* segment = roll_segment();
+    if(segment == NULL){
+        log_message(LOG_ERROR, "Could not create journal segment: %s", strerror(errno));
+        return;
+    }
+    int dropped = this_shard->journal_dropped;
+    this_shard->journal_bytes = 0;
+    snapshot_rooms();
+    this_shard->snapshot_bytes = this_shard->journal_bytes;
+    this_shard->journal_bytes = 0;
+    if(this_shard->journal_dropped != dropped) // Snapshot is not complete, older segments are kept.
+        return;
+    __atomic_store_n(&this_shard->snapshot_end_sequence, this_shard->journal->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&this_shard->snapshot_end, this_shard->journal->written, __ATOMIC_RELAXED);
+    __atomic_store_n(&this_shard->snapshot_sequence, segment->sequence, __ATOMIC_RELEASE); // Syncer reads the end after it.
+}
+
+/*
+    Reads all segments of given epoch in order and rebuilds rooms and their history.
+    A record that is not complete (server crashed while writing it) ends its segment.
+    Returns the number of recovered rooms, -1 on error.
+*/
+int recover_journal(int epoch){
+
+    DIR* directory = opendir(options.data_dir);
+    struct dirent* entry;
+    char** names = NULL;
+    int name_count = 0;
+    int name_capacity = 0;
+    int recovered = 0;
+    int i = 0;
+
+    if(directory == NULL)
+        return -1;
+    while((entry = readdir(directory)) != NULL){
+        int file_epoch = 0;
+        int file_shard = 0;
+        int file_sequence = 0;
+        if(sscanf(entry->d_name, "%d-%d-%d.journal", &file_epoch, &file_shard, &file_sequence) != 3 || file_epoch != epoch)
+            continue;
+        if(name_count == name_capacity){
+            name_capacity = name_capacity == 0 ? 16 : name_capacity * 2;
+            names = (char**)realloc(names, sizeof(char*) * name_capacity);
+        }
+        names[name_count++] = strdup(entry->d_name);
+    }
+    closedir(directory);
+    qsort(names, name_count, sizeof(char*), compare_names); // Names are zero padded, so segments of a shard are in order.
+
+    for(i = 0 ; i < shard_count ; i++) // Directory would be copied for every recovered room.
+        shards[i].directory_stale = 1;
+    int* recovered_ids = (int*)malloc(sizeof(int) * (SLOT_MASK + 1) * 2); // Old id and new id of rooms, by old slot number.
+    memset(recovered_ids, -1, sizeof(int) * (SLOT_MASK + 1) * 2);
+    for(i = 0 ; i < name_count ; i++){
+        char path[PATH_MAX];
+        struct stat status;
+        snprintf(path, sizeof(path), "%s/%s", options.data_dir, names[i]);
+        int fd = open(path, O_RDONLY);
+        if(fd < 0 || fstat(fd, &status) < 0 || status.st_size == 0){
+            if(fd >= 0)
+                close(fd);
+            continue;
+        }
+        char* base = (char*)mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED)
+            continue;
+        madvise(base, status.st_size, MADV_SEQUENTIAL); // Segment is read once from start to end.
+
+        size_t offset = 0;
+        while(offset + sizeof(journal_record) <= (size_t)status.st_size){
+            journal_record header;
+            memcpy(&header, base + offset, sizeof(header));
+            size_t length = sizeof(header) + header.length;
+            if(header.type == 0 || offset + length > (size_t)status.st_size) // Rest of segment is empty.
+                break;
+            char* record = base + offset;
+            journal_record check = header;
+            check.checksum = 0;
+            unsigned int checksum = journal_checksum_parts((char*)&check, sizeof(check), record + sizeof(header), header.length);
+            if(checksum != header.checksum) // Record was being written when the server stopped.
+                break;
+            recovered += replay_record(&header, record + sizeof(header), recovered_ids);
+            offset += (length + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+        }
+        munmap(base, status.st_size);
+    }
+
+    for(i = 0 ; i < name_count ; i++)
+        free(names[i]);
+    free(names);
+    free(recovered_ids);
+    for(i = 0 ; i < shard_count ; i++){
+        this_shard = &shards[i];
+        this_shard->directory_stale = 0;
+        build_directory();
+    }
+    this_shard = NULL;
+
+    return recovered;
+}
+
+/*
+    Applies a record of journal. Rooms are created in the shards that own their names now,
+    number of shards may be different from the run that wrote the journal.
+    Returns 1 if a room is created, -1 if a room is closed, 0 otherwise.
+*/
+int replay_record(journal_record* header, char* payload, int* recovered_ids){
+
+    int* ids = &recovered_ids[(header->room_id & SLOT_MASK) * 2];
+    chat_room* room = NULL;
+
+    if(header->type == JOURNAL_CREATE){
+        char* name = payload;
+        char* password = payload + strlen(name) + 1;
+        if(ids[0] == header->room_id){ // Snapshot writes the room again, its history follows.
+            this_shard = &shards[id_shard(ids[1])];
+            room = find_room(ids[1]);
+            if(room != NULL)
+                resize_history(room, 0);
+            return 0;
+        }
+        this_shard = &shards[room_shard(name)];
+        if(find_room_index(name) != -1) // Name is used by a room that is not closed in journal.
+            return 0;
+        room = open_room(name, header->value, password);
+        if(room == NULL)
+            return 0;
+        ids[0] = header->room_id;
+        ids[1] = room->id;
+        return 1;
+    }
+
+    if(ids[0] != header->room_id) // Room of record is not recovered.
+        return 0;
+    this_shard = &shards[id_shard(ids[1])];
+    room = find_room(ids[1]);
+    if(room == NULL)
+        return 0;
+
+    if(header->type == JOURNAL_HISTORY){
+        resize_history(room, header->value < 0 ? 0 : header->value > HISTORY_LIMIT ? HISTORY_LIMIT : header->value);
+    }
+    else if(header->type == JOURNAL_MESSAGE && room->history_capacity > 0 && header->length >= FRAME_HEADER_SIZE){
+        shared_frame* frame = (shared_frame*)malloc(sizeof(shared_frame) + header->length + 1);
+        frame->reference_counter = 1;
+        frame->length = header->length;
+        memcpy(frame->data, payload, header->length);
+        record_history(room, frame);
+        release_frame(frame);
+    }
+    else if(header->type == JOURNAL_CLOSE){
+        close_room(room);
+        ids[0] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    This function is used by journal syncer thread.
+    Writes appended records of all shards to disk periodically (group commit),
+    so shards never wait for the disk. Current segments are allocated ahead, next segments
+    are opened before shards need them and segments before snapshots are removed.
+*/
+void* journal_syncer(void* arg){
+
+    int i = 0;
+    while(1){
+        usleep(options.sync_interval * 1000);
+        for(i = 0 ; i < shard_count ; i++){
+            shard* s = &shards[i];
+            int sequence = __atomic_load_n(&s->journal, __ATOMIC_ACQUIRE)->sequence; // Older segments are retired before it is published.
+            journal_segment* retired = __atomic_exchange_n(&s->retired_segments, NULL, __ATOMIC_ACQUIRE);
+            while(retired != NULL){ // Segments that are full are written and closed.
+                journal_segment* next = retired->next;
+                sync_segment(retired);
+                munmap(retired->base, retired->size);
+                close(retired->fd);
+                free(retired);
+                retired = next;
+            }
+            journal_segment* current = __atomic_load_n(&s->journal, __ATOMIC_ACQUIRE);
+            sync_segment(current);
+            size_t written = __atomic_load_n(&current->written, __ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&current->reserved, __ATOMIC_ACQUIRE) < written + JOURNAL_RESERVE_STEP && !reserve_segment(current, written + 2 * JOURNAL_RESERVE_STEP))
+                log_message(LOG_ERROR, "Could not allocate journal segment: %s", strerror(errno));
+            if(__atomic_load_n(&s->spare_segment, __ATOMIC_ACQUIRE) == NULL){
+                journal_segment* spare = open_segment(s->journal_epoch, i, __atomic_fetch_add(&s->journal_sequence, 1, __ATOMIC_SEQ_CST));
+                if(spare != NULL)
+                    __atomic_store_n(&s->spare_segment, spare, __ATOMIC_RELEASE);
+            }
+            remove_compacted_segments(s, current, sequence);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes appended part of a segment to disk. Only journal syncer calls it while shards run.
+*/
+void sync_segment(journal_segment* segment){
+
+    size_t written = __atomic_load_n(&segment->written, __ATOMIC_ACQUIRE);
+    if(written == segment->synced)
+        return;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = segment->synced & ~(page - 1); // msync needs a page aligned address.
+    if(msync(segment->base + start, written - start, MS_SYNC) < 0){
+        log_message(LOG_ERROR, "Could not sync journal: %s", strerror(errno));
+        return;
+    }
+    segment->synced = written;
+}
+
+/*
+    Removes journal segments of epochs before given epoch.
+*/
+void remove_old_segments(int epoch){
+
+    DIR* directory = opendir(options.data_dir);
+    struct dirent* entry;
+    if(directory == NULL)
+        return;
+    while((entry = readdir(directory)) != NULL){
+        int file_epoch = 0;
+        int file_shard = 0;
+        int file_sequence = 0;
+        if(sscanf(entry->d_name, "%d-%d-%d.journal", &file_epoch, &file_shard, &file_sequence) == 3 && file_epoch != epoch){
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", options.data_dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(directory);
+}
+
+/*
+    Removes segments of a shard before its last snapshot when the snapshot is written to disk.
+    Segments older than given sequence are synced by journal syncer. It is used by journal syncer.
+*/
+void remove_compacted_segments(shard* s, journal_segment* current, int sequence){
+
+    int first = __atomic_load_n(&s->snapshot_sequence, __ATOMIC_ACQUIRE);
+    if(first <= s->removed_sequence)
+        return;
+    int end_sequence = __atomic_load_n(&s->snapshot_end_sequence, __ATOMIC_RELAXED);
+    size_t end = __atomic_load_n(&s->snapshot_end, __ATOMIC_RELAXED);
+    if(end_sequence >= sequence && (current->sequence != end_sequence || current->synced < end)) // Snapshot is not on disk yet.
+        return;
+
+    for( ; s->removed_sequence < first ; s->removed_sequence++){
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%08d-%03d-%08d.journal", options.data_dir, s->journal_epoch, s->index, s->removed_sequence);
+        unlink(path); // Numbers of spare segments that were not used have no files.
+    }
+}
+
+/*
+    Compares two file names for qsort.
+*/
+int compare_names(const void* first, const void* second){
+
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+/*
+    Builds the directory of calling shard from its active rooms at once.
+    It is used after journal recovery, a room does not copy the directory.
+*/
+void build_directory(void){
+
+    room_directory* old = this_shard->directory;
+    directory_entry** entries = (directory_entry**)malloc(sizeof(directory_entry*) * (this_shard->rooms.slot_count + 1));
+    int count = 0;
+    int i = 0;
+
+    for(i = 0 ; i < this_shard->rooms.slot_count ; i++){
+        chat_room* room = (chat_room*)this_shard->rooms.chunks[i / CHUNK_SLOTS] + i % CHUNK_SLOTS;
+        if(room->is_active != ROOM_ACTIVE)
+            continue;
+        entries[count++] = create_directory_entry(room);
+        arena_reset(&request_arena); // Text is copied into the entry.
+    }
+    qsort(entries, count, sizeof(directory_entry*), compare_entries);
+
+    int span_count = (count + DIRECTORY_CHUNK - 1) / DIRECTORY_CHUNK;
+    room_directory* directory = (room_directory*)malloc(sizeof(room_directory) + sizeof(directory_span) * span_count);
+    for(i = 0 ; i < span_count ; i++){ // Chunks are filled, later rooms split them.
+        int first = i * DIRECTORY_CHUNK;
+        directory->spans[i].chunk = create_directory_chunk(entries + first, count - first < DIRECTORY_CHUNK ? count - first : DIRECTORY_CHUNK);
+        directory->spans[i].first = first;
+    }
+    directory->span_count = span_count;
+    directory->count = count;
+    free(entries);
+    __atomic_store_n(&this_shard->directory, directory, __ATOMIC_SEQ_CST);
+
+    for(i = 0 ; i < old->span_count ; i++){
+        int e = 0;
+        for(e = 0 ; e < old->spans[i].chunk->count ; e++){
+            retire_memory(old->spans[i].chunk->entries[e]);
+        }
+        retire_memory(old->spans[i].chunk);
+    }
+    retire_memory(old);
+}
+
+/*
+    Compares names of two directory entries for qsort.
+*/
+int compare_entries(const void* first, const void* second){
+
+    return strcmp((*(directory_entry* const*)first)->name, (*(directory_entry* const*)second)->name);
+}
+
+/*
+    FNV-1a hash of a record. Checksum field of the record has to be 0.
+*/
+unsigned int journal_checksum(const char* record, size_t length){
+
+    return journal_checksum_parts(record, sizeof(journal_record), record + sizeof(journal_record), length - sizeof(journal_record));
+}
+
+/*
+    FNV-1a hash of a record header and its payload.
+*/
+unsigned int journal_checksum_parts(const char* header, size_t header_length, const char* payload, size_t payload_length){
+
+    unsigned int hash = 2166136261u;
+    size_t i = 0;
+    for(i = 0 ; i < header_length ; i++){
+        hash ^= (unsigned char)header[i];
+        hash *= 16777619u;
+    }
+    for(i = 0 ; i < payload_length ; i++){
+        hash ^= (unsigned char)payload[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Find room id with given name.
+    Reserved names do not belong to a room yet.
+*/
+int get_room_id_by_name(char* room_name){
+
+    if(strcmp(room_name, "") == 0)
+        return -1;
+
+    int room_id = find_room_index(room_name);
+    return room_id == ROOM_RESERVED ? -1 : room_id;
+}
+
+/*
+    FNV-1a hash of a room name.
+*/
+unsigned int hash_name(char* name){
+
+    unsigned int hash = 2166136261u;
+    while(*name){
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Finds the slot of given name in room name index.
+    Returns the slot if the name exists, otherwise -(first free slot) - 1.
+*/
+int find_index_slot(char* name, unsigned int hash){
+
+    int free_slot = -1;
+    int mask = this_shard->room_index_capacity - 1;
+    int slot = hash & mask;
+    while(this_shard->room_index[slot].name != NULL){
+        if(this_shard->room_index[slot].name == removed_index_name){ // Removed slot can be used again, but the name may be after it.
+            if(free_slot == -1)
+                free_slot = slot;
+        }
+        else if(this_shard->room_index[slot].hash == hash && strcmp(this_shard->room_index[slot].name, name) == 0){
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return -(free_slot == -1 ? slot : free_slot) - 1;
+}
+
+/*
+    Returns room id (or ROOM_RESERVED) for given name, -1 if the name is not in index.
+    Only names of rooms of calling shard are in its index.
+*/
+int find_room_index(char* name){
+
+    if(this_shard->room_index == NULL)
+        return -1;
+
+    int slot = find_index_slot(name, hash_name(name));
+    return slot >= 0 ? this_shard->room_index[slot].room_id : -1;
+}
+
+/*
+    Adds given name to room name index of calling shard or updates its room id.
+*/
+void insert_room_index(char* name, int room_id){
+
+    if(this_shard->room_index == NULL || (this_shard->room_index_used + 1) * 4 > this_shard->room_index_capacity * 3) // Load factor is kept under 0.75.
+        rehash_room_index();
+
+    unsigned int hash = hash_name(name);
+    int slot = find_index_slot(name, hash);
+    if(slot >= 0){
+        this_shard->room_index[slot].room_id = room_id;
+        return;
+    }
+
+    slot = -slot - 1;
+    if(this_shard->room_index[slot].name == NULL)
+        this_shard->room_index_used += 1;
+    this_shard->room_index_live += 1;
+    this_shard->room_index[slot].name = (char*)malloc(sizeof(char) * (strlen(name) + 1));
+    strcpy(this_shard->room_index[slot].name, name);
+    this_shard->room_index[slot].hash = hash;
+    this_shard->room_index[slot].room_id = room_id;
+}
+
+/*
+    Removes given name from room name index of calling shard.
+*/
+void remove_room_index(char* name){
+
+    if(this_shard->room_index == NULL)
+        return;
+
+    int slot = find_index_slot(name, hash_name(name));
+    if(slot < 0)
+        return;
+
+    free(this_shard->room_index[slot].name);
+    this_shard->room_index[slot].name = removed_index_name; // Slot is not emptied, names after it would not be found.
+    this_shard->room_index_live -= 1;
+}
+
+/*
+    Moves names into a new room name index and cleans removed slots. Capacity is doubled only if
+    at least half of it keeps names, otherwise the slots were filled by removed names and the size stays,
+    so the index follows live rooms and not all rooms that the shard ever had.
+*/
+void rehash_room_index(void){
+
+    int old_capacity = this_shard->room_index_capacity;
+    index_entry* old_index = this_shard->room_index;
+    int i = 0;
+
+    if(old_capacity == 0)
+        this_shard->room_index_capacity = INDEX_INITIAL_SLOTS;
+    else if(this_shard->room_index_live * 2 >= old_capacity)
+        this_shard->room_index_capacity = old_capacity * 2;
+    this_shard->room_index = (index_entry*)calloc(this_shard->room_index_capacity, sizeof(index_entry));
+    this_shard->room_index_used = 0;
+
+    for(i = 0 ; i < old_capacity ; i++){
+        if(old_index[i].name == NULL || old_index[i].name == removed_index_name)
+            continue;
+        int slot = old_index[i].hash & (this_shard->room_index_capacity - 1);
+        while(this_shard->room_index[slot].name != NULL)
+            slot = (slot + 1) & (this_shard->room_index_capacity - 1);
+        this_shard->room_index[slot] = old_index[i];
+        this_shard->room_index_used += 1;
+    }
+    free(old_index);
+}
+
+/*
+    Adds client to members of room. Nickname is copied, room shard does not read clients of other shards.
+    Member gets the smallest free member id, so ids of compact frames stay short.
+*/
+room_member* add_room_member(chat_room* room, int client_id, char* nickname, int compact){
+
+    room_member* member = &room->members[room->active_client_counter++];
+    member->client_id = client_id;
+    member->nickname = (char*)malloc(sizeof(char) * (strlen(nickname) + 1));
+    strcpy(member->nickname, nickname);
+    member->member_id = __builtin_ctz(~room->member_ids); // Room is not full, so there is a free bit.
+    room->member_ids |= 1u << member->member_id;
+    member->compact = compact;
+    room->compact_members += compact;
+    if(room->type == ROOM_TYPE_PUBLIC) // Members of private rooms are not listed.
+        directory_update(room);
+    return member;
+}
+
+/*
+    Removes client from members of room. Last member takes its place.
+    Returns member id of client, or -1 if client is not a member.
+*/
+int remove_room_member(chat_room* room, int client_id){
+
+    int i = 0;
+    for(i = 0 ; i < room->active_client_counter ; i++){ // Room has a few members, they are searched.
+        if(room->members[i].client_id == client_id){
+            int member_id = room->members[i].member_id;
+            room->member_ids &= ~(1u << member_id); // Id can be given to the next member.
+            room->compact_members -= room->members[i].compact;
+            free(room->members[i].nickname);
+            room->members[i] = room->members[--room->active_client_counter];
+            if(room->type == ROOM_TYPE_PUBLIC)
+                directory_update(room);
+            return member_id;
+        }
+    }
+    return -1;
+}
+
+/*
+    Prepares an empty table. Slot numbers of table are offset, offset + stride ...
+    so that tables of shards do not share slot numbers.
+*/
+void init_table(slot_table* table, size_t slot_size, void (*init_slot)(void*, int), int stride, int offset){
+
+    memset(table, 0, sizeof(slot_table));
+    table->slot_size = slot_size;
+    table->init_slot = init_slot;
+    table->stride = stride;
+    table->offset = offset;
+    table->slot_limit = (SLOT_MASK - offset) / stride + 1; // Slot numbers fit into slot bits of id.
+}
+
+/*
+    Returns the slot with given number, NULL if it does not belong to table or its chunk is not allocated.
+*/
+void* table_slot(slot_table* table, int slot){
+
+    if(slot < 0 || slot % table->stride != table->offset)
+        return NULL;
+    int local = slot / table->stride;
+    if(local >= table->slot_count)
+        return NULL;
+    return table->chunks[local / CHUNK_SLOTS] + (size_t)(local % CHUNK_SLOTS) * table->slot_size;
+}
+
+/*
+    Takes a free slot from table. Released slots are used first, a new chunk is allocated if there is none.
+    Returns slot number, -1 if the table cannot grow anymore.
+*/
+int table_alloc(slot_table* table){
+
+    int i = 0;
+    if(table->free_count > 0)
+        return table->free_slots[--table->free_count];
+
+    if(table->slot_count == table->slot_limit)
+        return -1;
+
+    if(table->slot_count % CHUNK_SLOTS == 0){ // Allocated chunks are full.
+        char* chunk = (char*)malloc(table->slot_size * CHUNK_SLOTS);
+        for(i = 0 ; i < CHUNK_SLOTS ; i++){
+            table->init_slot(chunk + i * table->slot_size, (table->slot_count + i) * table->stride + table->offset);
+        }
+        table->chunks[table->slot_count / CHUNK_SLOTS] = chunk;
+    }
+
+    return table->slot_count++ * table->stride + table->offset;
+}
+
+/*
+    Puts a slot into free list of table.
+*/
+void table_release(slot_table* table, int slot){
+
+    if(table->free_count == table->free_capacity){
+        table->free_capacity = table->free_capacity == 0 ? CHUNK_SLOTS : table->free_capacity * 2;
+        table->free_slots = (int*)realloc(table->free_slots, sizeof(int) * table->free_capacity);
+    }
+    table->free_slots[table->free_count++] = slot;
+}
+
+/*
+    Returns the id that the next owner of the slot of given id gets.
+*/
+int next_generation(int id){
+
+    int generation = ((id >> SLOT_BITS) + 1) & GENERATION_MASK;
+    return (generation << SLOT_BITS) | (id & SLOT_MASK);
+}
+
+/*
+    Prepares a client slot of new chunk.
+*/
+void init_client_slot(void* slot, int number){
+
+    client* cl = (client*)slot;
+    memset(cl, 0, sizeof(client));
+    cl->id = number;
+    cl->socket = -1;
+    cl->room_id = -1;
+    cl->connection_flag = DISCONNECTED;
+}
+
+/*
+    Prepares a room slot of new chunk.
+*/
+void init_room_slot(void* slot, int number){
+
+    chat_room* room = (chat_room*)slot;
+    memset(room, 0, sizeof(chat_room));
+    room->id = number;
+    room->is_active = ROOM_INACTIVE;
+}
+
+/*
+    Returns the client of calling shard with given id, NULL if it is disconnected.
+*/
+client* find_client(int id){
+
+    if(id < 0)
+        return NULL;
+    client* cl = (client*)table_slot(&this_shard->clients, id & SLOT_MASK);
+    if(cl == NULL || cl->id != id)
+        return NULL;
+    return cl;
+}
+
+/*
+    Returns the room of calling shard with given id, NULL if it is closed.
+*/
+chat_room* find_room(int id){
+
+    if(id < 0)
+        return NULL;
+    chat_room* room = (chat_room*)table_slot(&this_shard->rooms, id & SLOT_MASK);
+    if(room == NULL || room->id != id || room->is_active != ROOM_ACTIVE)
+        return NULL;
+    return room;
+}
+
+/*
+    Checking given password and creating proper message for client.
+*/
+int validate_password(char* password, char* result_buffer){
+
+    if(strlen(password) < 4){
+        strcpy(result_buffer, "unsuitable_password;Password cannot be shorter than 4 characters!\0");
+        return 0;
+    }
+    else if(strstr(password, " ") != NULL){
+        strcpy(result_buffer, "unsuitable_password;Password cannot contain space character!\0");
         return 0;
     }
 
     strcpy(result_buffer, "suitable_password;Password accepted!\0");
     return 1;
 }
+
+/*
+    Reads server options from command line.
+    Returns 0 if all options are valid.
+*/
+int parse_options(int argc, char** argv){
+
+    static struct option long_options[] = {
+        {"high-watermark", required_argument, 0, 'H'},
+        {"low-watermark", required_argument, 0, 'L'},
+        {"slow-policy", required_argument, 0, 'P'},
+        {"slow-timeout", required_argument, 0, 'T'},
+        {"log-level", required_argument, 0, 'V'},
+        {"log-file", required_argument, 0, 'F'},
+        {"admin-socket", required_argument, 0, 'A'},
+        {"admin-port", required_argument, 0, 'a'},
+        {"password-timeout", required_argument, 0, 'W'},
+        {"shards", required_argument, 0, 'S'},
+        {"history", required_argument, 0, 'R'},
+        {"data-dir", required_argument, 0, 'D'},
+        {"segment-size", required_argument, 0, 'M'},
+        {"sync-interval", required_argument, 0, 'Y'},
+        {"flush-window", required_argument, 0, 'X'},
+        {"flush-bytes", required_argument, 0, 'B'},
+        {"io-backend", required_argument, 0, 'I'},
+        {"spool-dir", required_argument, 0, 'U'},
+        {"max-file-size", required_argument, 0, 'Z'},
+        {"backlog", required_argument, 0, 'K'},
+        {"max-connections", required_argument, 0, 'C'},
+        {"connection-rate", required_argument, 0, 'N'},
+        {0, 0, 0, 0}
+    };
+    int option = 0;
+
+    while((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        if(option == 'H'){
+            options.high_watermark = strtoul(optarg, NULL, 10);
+        }
+        else if(option == 'L'){
+            options.low_watermark = strtoul(optarg, NULL, 10);
+        }
+        else if(option == 'P'){
+            if(strcmp(optarg, "drop") == 0)
+                options.slow_policy = POLICY_DROP;
+            else if(strcmp(optarg, "coalesce") == 0)
+                options.slow_policy = POLICY_COALESCE;
+            else if(strcmp(optarg, "disconnect") == 0)
+                options.slow_policy = POLICY_DISCONNECT;
+            else{
+                printf("Unknown slow consumer policy: %s\n", optarg);
+                return OPTION_ERR;
+            }
+        }
+        else if(option == 'T'){
+            options.slow_timeout = atoi(optarg);
+        }
+        else if(option == 'V'){
+            if(strcmp(optarg, "debug") == 0)
+                options.log_level = LOG_DEBUG;
+            else if(strcmp(optarg, "info") == 0)
+                options.log_level = LOG_INFO;
+            else if(strcmp(optarg, "warn") == 0)
+                options.log_level = LOG_WARN;
+            else if(strcmp(optarg, "error") == 0)
+                options.log_level = LOG_ERROR;
+            else{
+                printf("Unknown log level: %s\n", optarg);
+                return OPTION_ERR;
+            }
+        }
+        else if(option == 'F'){
+            options.log_file = optarg;
+        }
+        else if(option == 'A'){
+            options.admin_socket = optarg;
+        }
+        else if(option == 'a'){
+            options.admin_port = atoi(optarg);
+        }
+        else if(option == 'W'){
+            options.password_timeout = atoi(optarg);
+        }
+        else if(option == 'S'){
+            options.shards = atoi(optarg);
+        }
+        else if(option == 'R'){
+            options.history = atoi(optarg);
+        }
+        else if(option == 'D'){
+            options.data_dir = optarg;
+        }
+        else if(option == 'M'){
+            options.segment_size = strtoul(optarg, NULL, 10);
+        }
+        else if(option == 'Y'){
+            options.sync_interval = atoi(optarg);
+        }
+        else if(option == 'X'){
+            options.flush_window = atoi(optarg);
+        }
+        else if(option == 'B'){
+            options.flush_bytes = strtoul(optarg, NULL, 10);
+        }
+        else if(option == 'I'){
+            if(strcmp(optarg, "epoll") == 0)
+                options.io_backend = IO_EPOLL;
+            else if(strcmp(optarg, "uring") == 0)
+                options.io_backend = IO_URING;
+            else{
+                printf("Unknown I/O backend: %s\n", optarg);
+                return OPTION_ERR;
+            }
+        }
+        else if(option == 'U'){
+            options.spool_dir = optarg;
+        }
+        else if(option == 'Z'){
+            options.max_file_size = strtoul(optarg, NULL, 10);
+        }
+        else if(option == 'K'){
+            options.backlog = atoi(optarg);
+        }
+        else if(option == 'C'){
+            options.max_connections = atoi(optarg);
+        }
+        else if(option == 'N'){
+            options.connection_rate = atoi(optarg);
+        }
+        else{
+            puts("Usage: server.o [--high-watermark bytes] [--low-watermark bytes]\n"
+                 "                [--slow-policy drop|coalesce|disconnect] [--slow-timeout ms]\n"
+                 "                [--log-level debug|info|warn|error] [--log-file path|-]\n"
+                 "                [--admin-socket path] [--admin-port port] [--password-timeout ms]\n"
+                 "                [--shards n] [--history n]\n"
+                 "                [--data-dir path] [--segment-size bytes] [--sync-interval ms]\n"
+                 "                [--flush-window ms] [--flush-bytes bytes] [--io-backend epoll|uring]\n"
+                 "                [--spool-dir path] [--max-file-size bytes]\n"
+                 "                [--backlog n] [--max-connections n] [--connection-rate n]");
+            return OPTION_ERR;
+        }
+    }
+
+    if(options.low_watermark > options.high_watermark){
+        puts("Low watermark cannot be greater than high watermark");
+        return OPTION_ERR;
+    }
+
+    if(options.flush_window < 0){
+        puts("Flush window cannot be negative");
+        return OPTION_ERR;
+    }
+
+    if(options.flush_bytes > options.high_watermark){
+        puts("Flush bytes cannot be greater than high watermark");
+        return OPTION_ERR;
+    }
+
+    if(options.backlog < 1){
+        puts("Backlog has to be at least 1");
+        return OPTION_ERR;
+    }
+
+    if(options.max_connections < 0 || options.connection_rate < 0){
+        puts("Connection limits cannot be negative");
+        return OPTION_ERR;
+    }
+
+    if(options.sync_interval < 1){
+        puts("Sync interval has to be at least 1 ms");
+        return OPTION_ERR;
+    }
+
+    if(options.segment_size < MIN_SEGMENT_SIZE){
+        printf("Segment size cannot be smaller than %d bytes\n", MIN_SEGMENT_SIZE);
+        return OPTION_ERR;
+    }
+
+    if(access(options.spool_dir, W_OK | X_OK) != 0){
+        printf("Spool directory %s is not writable\n", options.spool_dir);
+        return OPTION_ERR;
+    }
+
+    if(options.history < 0 || options.history > HISTORY_LIMIT){
+        printf("History size has to be between 0 and %d\n", HISTORY_LIMIT);
+        return OPTION_ERR;
+    }
+
+    return 0;
+}